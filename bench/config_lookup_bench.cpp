@@ -0,0 +1,82 @@
+#include <gflags/gflags.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "conf/token_config_table.h"
+
+DEFINE_int32(tokens, 1000000, "Number of tokens in the config");
+DEFINE_int32(lookups, 10000000, "Number of lookups");
+
+template <typename Fn>
+static double measureNsPerLookup(const std::vector<std::string>& requests,
+                                 Fn&& lookup) {
+    int64_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& token : requests) {
+        found += lookup(token);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    if (found != static_cast<int64_t>(requests.size())) {
+        fprintf(stderr, "unexpected miss: %ld\n", requests.size() - found);
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           requests.size();
+}
+
+int main(int argc, char* argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    std::vector<std::string> tokens;
+    tokens.reserve(FLAGS_tokens);
+    for (int i = 0; i < FLAGS_tokens; ++i) {
+        tokens.push_back("conf_ratelimit_token_" + std::to_string(i));
+    }
+
+    std::unordered_map<std::string, TokenBucketConfig> map;
+    TokenConfigTable table;
+    table.reserve(tokens.size());
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        TokenBucketConfig config;
+        config.burst = static_cast<int64_t>(i);
+        config.rate = 1;
+        config.script_args[0].set(config.burst);
+        config.script_args[1].set(config.rate);
+        map.emplace(tokens[i], config);
+        table.insert_or_assign(tokens[i], config);
+    }
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> dist(0, tokens.size() - 1);
+    std::vector<std::string> requests;
+    requests.reserve(FLAGS_lookups);
+    for (int i = 0; i < FLAGS_lookups; ++i) {
+        requests.push_back(tokens[dist(rng)]);
+    }
+
+    // 原实现：先拷贝 token，再在 std::unordered_map 中查找并拷贝配置
+    double map_ns = measureNsPerLookup(requests, [&](const std::string& req) {
+        std::string token = req;
+        auto iter = map.find(token);
+        if (iter == map.end()) return 0;
+        TokenBucketConfig config = iter->second;
+        return config.burst >= 0 ? 1 : 0;
+    });
+
+    double table_ns = measureNsPerLookup(requests, [&](const std::string& req) {
+        const TokenConfigEntry* entry = table.find(req);
+        if (entry == nullptr) return 0;
+        TokenBucketConfig config = entry->config;
+        return config.burst >= 0 ? 1 : 0;
+    });
+
+    printf("tokens=%d lookups=%d\n", FLAGS_tokens, FLAGS_lookups);
+    printf("std::unordered_map   %.1f ns/lookup\n", map_ns);
+    printf("TokenConfigTable     %.1f ns/lookup\n", table_ns);
+    return 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// HdrHistogram 风格的对数线性直方图，记录微秒延迟。每个 2 的幂区间分成
+// 128 个线性子桶，相对误差小于 1%，计数为原子变量，可以在回调中并发记录
+class LatencyHistogram {
+public:
+    void Record(int64_t value_us) {
+        _counts[index(std::max<int64_t>(value_us, 0))].fetch_add(
+            1, std::memory_order_relaxed);
+    }
+
+    int64_t TotalCount() const {
+        int64_t total = 0;
+        for (const auto& count : _counts) {
+            total += count.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // percentile 取值 0 到 100
+    int64_t ValueAtPercentile(double percentile) const {
+        const int64_t total = TotalCount();
+        if (total == 0) {
+            return 0;
+        }
+
+        int64_t rank = static_cast<int64_t>(percentile / 100 * total + 0.5);
+        rank = std::min(std::max<int64_t>(rank, 1), total);
+        int64_t seen = 0;
+        for (size_t i = 0; i < kCount; ++i) {
+            seen += _counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return highestEquivalentValue(i);
+            }
+        }
+        return highestEquivalentValue(kCount - 1);
+    }
+
+    int64_t Max() const {
+        for (size_t i = kCount; i > 0; --i) {
+            if (_counts[i - 1].load(std::memory_order_relaxed) > 0) {
+                return highestEquivalentValue(i - 1);
+            }
+        }
+        return 0;
+    }
+
+    // 输出与 HdrHistogram 的 percentile distribution 相同的格式，
+    // 可以直接用 HdrHistogram 的 plotter 画图
+    void PrintPercentiles(FILE* out) const {
+        const int64_t total = TotalCount();
+        fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+                "TotalCount", "1/(1-Percentile)");
+        int64_t seen = 0;
+        for (size_t i = 0; i < kCount; ++i) {
+            int64_t count = _counts[i].load(std::memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            seen += count;
+            double percentile = static_cast<double>(seen) / total;
+            if (seen < total) {
+                fprintf(out, "%12.3f %14.12f %10ld %14.2f\n",
+                        highestEquivalentValue(i) / 1000.0, percentile,
+                        static_cast<long>(seen), 1 / (1 - percentile));
+            } else {
+                fprintf(out, "%12.3f %14.12f %10ld\n",
+                        highestEquivalentValue(i) / 1000.0, percentile,
+                        static_cast<long>(seen));
+            }
+        }
+    }
+
+private:
+    static constexpr int kSubBucketBits = 7;
+    static constexpr int64_t kSubBuckets = 1 << kSubBucketBits;
+    // 最大约 2^40 微秒
+    static constexpr int kBuckets = 40 - kSubBucketBits + 1;
+    static constexpr size_t kCount = kBuckets * kSubBuckets;
+
+    static size_t index(int64_t value) {
+        if (value < kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        int msb = 63 - __builtin_clzll(static_cast<uint64_t>(value));
+        int bucket = msb - kSubBucketBits + 1;
+        if (bucket >= kBuckets) {
+            return kCount - 1;
+        }
+        int64_t sub = (value >> (bucket - 1)) & (kSubBuckets - 1);
+        return static_cast<size_t>(bucket * kSubBuckets + sub);
+    }
+
+    static int64_t lowestEquivalentValue(size_t index) {
+        int64_t bucket = index / kSubBuckets;
+        int64_t sub = index % kSubBuckets;
+        if (bucket == 0) {
+            return sub;
+        }
+        return (kSubBuckets + sub) << (bucket - 1);
+    }
+
+    static int64_t highestEquivalentValue(size_t index) {
+        if (index + 1 >= kCount) {
+            return lowestEquivalentValue(index);
+        }
+        return lowestEquivalentValue(index + 1) - 1;
+    }
+
+private:
+    std::atomic<int64_t> _counts[kCount] = {};
+};
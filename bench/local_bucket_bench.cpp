@@ -0,0 +1,117 @@
+#include <gflags/gflags.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "limiter/local_bucket_table.h"
+
+DEFINE_int64(keys, 10000000, "Number of distinct tokens");
+DEFINE_int64(capacity, 0, "Capacity of the table, 0 to use -keys");
+DEFINE_int64(ops, 20000000, "Number of random acquires after populating");
+DEFINE_int32(threads, 4, "Number of threads");
+
+// 不保存所有 token，避免 token 本身的内存混入 RSS
+static std::string_view formatToken(char* buf, uint64_t index) {
+    static const char kPrefix[] = "bench_token_";
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + index % 10);
+        index /= 10;
+    } while (index > 0);
+
+    size_t size = sizeof(kPrefix) - 1;
+    memcpy(buf, kPrefix, size);
+    while (n > 0) {
+        buf[size++] = digits[--n];
+    }
+    return std::string_view(buf, size);
+}
+
+static double residentMb() {
+    long pages = 0;
+    long resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) {
+        return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return static_cast<double>(resident) * sysconf(_SC_PAGESIZE) /
+           (1024 * 1024);
+}
+
+// 各线程执行 fn(thread_index)，返回每秒完成的操作数
+template <typename Fn>
+static double runThreads(int64_t ops, Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < FLAGS_threads; ++i) {
+        threads.emplace_back(fn, i);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return ops / std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    FLAGS_threads = std::max(FLAGS_threads, 1);
+
+    TokenBucketConfig config;
+    config.burst = 100;
+    config.rate = 10;
+    config.formatScriptArgs();
+
+    const double base_mb = residentMb();
+    LocalBucketTable table(FLAGS_capacity > 0 ? FLAGS_capacity
+                                              : FLAGS_keys);
+    const double table_mb = residentMb() - base_mb;
+
+    // 每个 token 扣减一次，全部成为活跃的桶
+    const int64_t keys = FLAGS_keys;
+    double insert_ops = runThreads(keys, [&](int thread_index) {
+        char buf[64];
+        LimitDecision decision;
+        for (int64_t i = thread_index; i < keys; i += FLAGS_threads) {
+            table.TryAcquire(formatToken(buf, i), config, 1, false,
+                             &decision);
+        }
+    });
+    const int64_t evicted_on_insert = table.evictions();
+
+    const int64_t ops_per_thread = FLAGS_ops / FLAGS_threads;
+    double acquire_ops = runThreads(
+        ops_per_thread * FLAGS_threads, [&](int thread_index) {
+            std::mt19937_64 rng(thread_index);
+            std::uniform_int_distribution<int64_t> dist(0, keys - 1);
+            char buf[64];
+            LimitDecision decision;
+            for (int64_t i = 0; i < ops_per_thread; ++i) {
+                table.TryAcquire(formatToken(buf, dist(rng)), config, 1,
+                                 false, &decision);
+            }
+        });
+
+    printf("keys=%ld capacity=%zu threads=%d\n", keys, table.capacity(),
+           FLAGS_threads);
+    printf("table rss          %.1f MB (%.1f bytes/key)\n", table_mb,
+           table_mb * 1024 * 1024 / keys);
+    printf("total rss          %.1f MB\n", residentMb());
+    printf("insert             %.0f ops/s, %ld evicted\n", insert_ops,
+           evicted_on_insert);
+    printf("random acquire     %.0f ops/s, %ld evicted\n", acquire_ops,
+           table.evictions() - evicted_on_insert);
+    return 0;
+}
@@ -0,0 +1,376 @@
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <butil/time.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client/ratelimit_stream.h"
+#include "latency_histogram.h"
+#include "ratelimit.pb.h"
+#include "stub_redis.h"
+
+DEFINE_string(server, "127.0.0.1:50051",
+              "RateLimit service address, empty to only run the stub redis");
+DEFINE_string(load_balancer, "", "Load balancer used when server is a naming "
+              "service url");
+DEFINE_string(mode, "closed",
+              "closed: keep -concurrency requests in flight; open: send at "
+              "-qps no matter how fast the server replies");
+DEFINE_string(transport, "unary",
+              "unary: one CheckLimit rpc per request; stream: decision "
+              "frames on one limit stream per channel");
+DEFINE_int32(concurrency, 64, "Requests in flight in closed-loop mode");
+DEFINE_int32(qps, 10000, "Target qps in open-loop mode");
+DEFINE_int32(sender_threads, 4, "Threads pacing requests in open-loop mode");
+DEFINE_int32(duration_s, 10, "Seconds to measure");
+DEFINE_int32(warmup_s, 2, "Seconds to run before measuring");
+DEFINE_int32(timeout_ms, 500, "RPC timeout");
+DEFINE_string(connection_type, "single",
+              "Connection type of each channel: single or pooled");
+DEFINE_int32(channels, 1,
+             "Number of channels with separate connections, requests are "
+             "spread over them. Use more than the number of server shards "
+             "so that SO_REUSEPORT spreads the load");
+DEFINE_int32(tokens, 1000, "Number of distinct tokens");
+DEFINE_string(token_prefix, "bench_token_",
+              "Tokens are named <token_prefix><index>");
+DEFINE_string(distribution, "uniform", "Token distribution: uniform or zipf");
+DEFINE_double(zipf_s, 1.0, "Exponent of the zipf distribution");
+DEFINE_int32(cost, 1, "Cost of each request");
+DEFINE_bool(dry_run, false, "Send dry-run requests");
+DEFINE_int32(stub_redis_port, 0,
+             "Start an in-process stub redis on this port, 0 to disable");
+DEFINE_string(script_dir, "../conf",
+              "Directory of the lua scripts recognized by the stub redis");
+DEFINE_int32(stub_redis_capacity, 1 << 20,
+             "Max number of tokens kept by the stub redis");
+DEFINE_string(hdr_output, "",
+              "Write the latency percentile distribution to this file");
+
+namespace {
+
+// 按均匀分布或 zipf 分布选择 token，zipf 分布下第 i 个 token 的概率与
+// 1/(i+1)^s 成正比
+class TokenPicker {
+public:
+    TokenPicker() {
+        _tokens.reserve(FLAGS_tokens);
+        for (int i = 0; i < FLAGS_tokens; ++i) {
+            _tokens.push_back(FLAGS_token_prefix + std::to_string(i));
+        }
+
+        if (FLAGS_distribution == "zipf") {
+            _cdf.reserve(_tokens.size());
+            double sum = 0;
+            for (size_t i = 0; i < _tokens.size(); ++i) {
+                sum += 1 / std::pow(static_cast<double>(i + 1), FLAGS_zipf_s);
+                _cdf.push_back(sum);
+            }
+            for (auto& value : _cdf) {
+                value /= sum;
+            }
+        }
+    }
+
+    const std::string& Pick() {
+        thread_local std::mt19937_64 rng(std::random_device{}());
+        if (_cdf.empty()) {
+            std::uniform_int_distribution<size_t> dist(0, _tokens.size() - 1);
+            return _tokens[dist(rng)];
+        }
+
+        std::uniform_real_distribution<double> dist(0, 1);
+        size_t index =
+            std::lower_bound(_cdf.begin(), _cdf.end(), dist(rng)) -
+            _cdf.begin();
+        return _tokens[std::min(index, _tokens.size() - 1)];
+    }
+
+private:
+    std::vector<std::string> _tokens;
+    std::vector<double> _cdf;
+};
+
+struct BenchStats {
+    LatencyHistogram latency;
+    std::atomic<int64_t> allowed{0};
+    std::atomic<int64_t> denied{0};
+    std::atomic<int64_t> failed{0};
+    // 在此之前发出的请求属于预热，不计入结果
+    int64_t measure_start_us = 0;
+    int64_t measure_end_us = 0;
+};
+
+std::atomic<bool> g_stopped{false};
+std::atomic<int64_t> g_inflight{0};
+
+// 请求发往的目标，stream 不为空时通过 stream 发送
+struct BenchTarget {
+    RateLimitService_Stub* stub;
+    RateLimitStream* stream;
+};
+
+// 一个异步请求，完成后自身作为 done 被调用。闭环模式下复用同一个对象
+// 继续发送，开环模式下每个请求一个对象
+class BenchCall : public google::protobuf::Closure {
+public:
+    BenchCall(const BenchTarget& target, TokenPicker* picker,
+              BenchStats* stats, bool closed_loop)
+        : _target(target),
+          _picker(picker),
+          _stats(stats),
+          _closed_loop(closed_loop) {}
+
+    // scheduled_us 为计划发送的时间，开环模式下从计划时间开始计算延迟，
+    // 避免服务端变慢时少发请求而低估延迟
+    void Send(int64_t scheduled_us) {
+        _scheduled_us = scheduled_us;
+        g_inflight.fetch_add(1, std::memory_order_relaxed);
+        if (_target.stream != nullptr) {
+            _target.stream->CheckLimit(
+                _picker->Pick(), FLAGS_cost, FLAGS_dry_run,
+                [this](const RateLimitStream::Result& result) {
+                    finish(!result.ok, result.allowed);
+                });
+            return;
+        }
+
+        _cntl.Reset();
+        _cntl.set_timeout_ms(FLAGS_timeout_ms);
+        _request.set_token(_picker->Pick());
+        _request.set_cost(FLAGS_cost);
+        _request.set_dry_run(FLAGS_dry_run);
+        _response.Clear();
+        _target.stub->CheckLimit(&_cntl, &_request, &_response, this);
+    }
+
+    void Run() override { finish(_cntl.Failed(), _response.allowed()); }
+
+private:
+    void finish(bool failed, bool allowed) {
+        const int64_t now_us = butil::gettimeofday_us();
+        if (_scheduled_us >= _stats->measure_start_us &&
+            _scheduled_us < _stats->measure_end_us) {
+            if (failed) {
+                _stats->failed.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                _stats->latency.Record(now_us - _scheduled_us);
+                if (allowed) {
+                    _stats->allowed.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    _stats->denied.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // 先发出下一个请求再减少在途计数，主线程看到在途计数为 0 时
+        // 不会再有回调访问这些对象
+        const bool closed_loop = _closed_loop;
+        if (closed_loop && !g_stopped.load(std::memory_order_relaxed)) {
+            Send(now_us);
+        } else if (!closed_loop) {
+            delete this;
+        }
+        g_inflight.fetch_sub(1, std::memory_order_release);
+    }
+
+    BenchTarget _target;
+    TokenPicker* _picker;
+    BenchStats* _stats;
+    const bool _closed_loop;
+    int64_t _scheduled_us = 0;
+    brpc::Controller _cntl;
+    RateLimitRequest _request;
+    RateLimitResponse _response;
+};
+
+using TargetList = std::vector<BenchTarget>;
+
+void runClosedLoop(const TargetList& targets, TokenPicker* picker,
+                   BenchStats* stats) {
+    std::vector<std::unique_ptr<BenchCall>> calls;
+    for (int i = 0; i < FLAGS_concurrency; ++i) {
+        calls.emplace_back(new BenchCall(targets[i % targets.size()], picker,
+                                         stats, true));
+    }
+    for (auto& call : calls) {
+        call->Send(butil::gettimeofday_us());
+    }
+
+    std::this_thread::sleep_for(
+        std::chrono::seconds(FLAGS_warmup_s + FLAGS_duration_s));
+    g_stopped.store(true, std::memory_order_relaxed);
+    while (g_inflight.load(std::memory_order_acquire) > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void runOpenLoop(const TargetList& targets, TokenPicker* picker,
+                 BenchStats* stats) {
+    const int threads = std::max(FLAGS_sender_threads, 1);
+    const double interval_us =
+        1e6 * threads / std::max(FLAGS_qps, 1);
+    const int64_t start_us = butil::gettimeofday_us();
+
+    std::vector<std::thread> senders;
+    for (int t = 0; t < threads; ++t) {
+        senders.emplace_back([=, &targets]() {
+            // 各线程错开发送时间
+            double next_us = start_us + interval_us * t / threads;
+            size_t next_target = t;
+            while (next_us < stats->measure_end_us) {
+                int64_t now_us = butil::gettimeofday_us();
+                if (now_us < next_us) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(
+                        static_cast<int64_t>(next_us) - now_us));
+                }
+                const BenchTarget& target =
+                    targets[next_target++ % targets.size()];
+                BenchCall* call =
+                    new BenchCall(target, picker, stats, false);
+                call->Send(static_cast<int64_t>(next_us));
+                next_us += interval_us;
+            }
+        });
+    }
+    for (auto& sender : senders) {
+        sender.join();
+    }
+
+    while (g_inflight.load(std::memory_order_acquire) > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void printReport(const BenchStats& stats) {
+    const LatencyHistogram& latency = stats.latency;
+    const int64_t completed = latency.TotalCount();
+    const double seconds = std::max(FLAGS_duration_s, 1);
+
+    printf("mode=%s transport=%s tokens=%d distribution=%s channels=%d",
+           FLAGS_mode.c_str(), FLAGS_transport.c_str(), FLAGS_tokens,
+           FLAGS_distribution.c_str(), FLAGS_channels);
+    if (FLAGS_mode == "open") {
+        printf(" target_qps=%d\n", FLAGS_qps);
+    } else {
+        printf(" concurrency=%d\n", FLAGS_concurrency);
+    }
+    printf("throughput  %.0f qps\n", completed / seconds);
+    printf("allowed     %ld\n", static_cast<long>(stats.allowed.load()));
+    printf("denied      %ld\n", static_cast<long>(stats.denied.load()));
+    printf("failed      %ld\n", static_cast<long>(stats.failed.load()));
+    printf("latency(us) p50=%ld p90=%ld p99=%ld p99.9=%ld p99.99=%ld "
+           "max=%ld\n",
+           static_cast<long>(latency.ValueAtPercentile(50)),
+           static_cast<long>(latency.ValueAtPercentile(90)),
+           static_cast<long>(latency.ValueAtPercentile(99)),
+           static_cast<long>(latency.ValueAtPercentile(99.9)),
+           static_cast<long>(latency.ValueAtPercentile(99.99)),
+           static_cast<long>(latency.Max()));
+
+    if (!FLAGS_hdr_output.empty()) {
+        FILE* out = fopen(FLAGS_hdr_output.c_str(), "w");
+        if (out == nullptr) {
+            LOG(ERROR) << "Failed to open " << FLAGS_hdr_output;
+            return;
+        }
+        latency.PrintPercentiles(out);
+        fclose(out);
+    }
+}
+
+}    // namespace
+
+int main(int argc, char* argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    std::unique_ptr<StubRedis> stub_redis;
+    if (FLAGS_stub_redis_port > 0) {
+        stub_redis.reset(
+            new StubRedis(FLAGS_script_dir, FLAGS_stub_redis_capacity));
+        if (stub_redis->Start(FLAGS_stub_redis_port) != 0) {
+            return -1;
+        }
+    }
+
+    // 只运行 redis 桩，供限流服务通过 -redis_address 连接
+    if (FLAGS_server.empty()) {
+        if (!stub_redis) {
+            LOG(ERROR) << "Nothing to do without -server and -stub_redis_port";
+            return -1;
+        }
+        while (!brpc::IsAskedToQuit()) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        stub_redis->Stop();
+        return 0;
+    }
+
+    // 每个 channel 使用不同的 connection_group，各自建立连接
+    if (FLAGS_transport != "unary" && FLAGS_transport != "stream") {
+        LOG(ERROR) << "Unknown transport: " << FLAGS_transport;
+        return -1;
+    }
+
+    std::vector<std::unique_ptr<brpc::Channel>> channels;
+    std::vector<std::unique_ptr<RateLimitService_Stub>> stubs;
+    std::vector<std::unique_ptr<RateLimitStream>> streams;
+    TargetList targets;
+    for (int i = 0; i < std::max(FLAGS_channels, 1); ++i) {
+        brpc::ChannelOptions options;
+        options.timeout_ms = FLAGS_timeout_ms;
+        options.connection_type = FLAGS_connection_type;
+        options.connection_group = "bench_" + std::to_string(i);
+        channels.emplace_back(new brpc::Channel);
+        if (channels.back()->Init(FLAGS_server.c_str(),
+                                  FLAGS_load_balancer.c_str(),
+                                  &options) != 0) {
+            LOG(ERROR) << "Fail to initialize channel";
+            return -1;
+        }
+        stubs.emplace_back(new RateLimitService_Stub(channels.back().get()));
+
+        RateLimitStream* stream = nullptr;
+        if (FLAGS_transport == "stream") {
+            streams.emplace_back(new RateLimitStream);
+            stream = streams.back().get();
+            if (stream->Init(FLAGS_server, FLAGS_load_balancer, &options) !=
+                0) {
+                return -1;
+            }
+        }
+        targets.push_back(BenchTarget{stubs.back().get(), stream});
+    }
+
+    TokenPicker picker;
+    BenchStats stats;
+    stats.measure_start_us =
+        butil::gettimeofday_us() + FLAGS_warmup_s * 1000000LL;
+    stats.measure_end_us =
+        stats.measure_start_us + FLAGS_duration_s * 1000000LL;
+
+    if (FLAGS_mode == "open") {
+        runOpenLoop(targets, &picker, &stats);
+    } else if (FLAGS_mode == "closed") {
+        runClosedLoop(targets, &picker, &stats);
+    } else {
+        LOG(ERROR) << "Unknown mode: " << FLAGS_mode;
+        return -1;
+    }
+
+    printReport(stats);
+
+    if (stub_redis) {
+        stub_redis->Stop();
+    }
+    return 0;
+}
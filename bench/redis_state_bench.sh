@@ -0,0 +1,86 @@
+#!/bin/bash
+# 对比令牌桶状态的两种 redis 存储格式（ratelimit.lua 的 hash 和
+# ratelimit_packed.lua 的二进制字符串）每个 key 的内存和脚本的吞吐、延迟。
+# 会清空 REDIS_DB，不要指向线上使用的库。
+#
+#   REDIS_HOST/REDIS_PORT  测试使用的 redis
+#   REDIS_DB               测试使用的库，每种格式测量前都会 FLUSHDB
+#   KEYS                   写入的 token 数
+#   REQUESTS               redis-benchmark 对每个脚本发送的请求数
+#   CLIENTS                redis-benchmark 的并发连接数
+#
+# 没有 redis-benchmark 时改用 redis-cli -r 在一个连接上串行发送 REQUESTS
+# 个请求（同一个 token），latency 列为平均往返时间
+set -eu
+
+REDIS_HOST=${REDIS_HOST:-127.0.0.1}
+REDIS_PORT=${REDIS_PORT:-6379}
+REDIS_DB=${REDIS_DB:-15}
+KEYS=${KEYS:-1000000}
+REQUESTS=${REQUESTS:-1000000}
+CLIENTS=${CLIENTS:-50}
+SCRIPT_DIR=${SCRIPT_DIR:-$(dirname "$0")/../conf}
+
+cli() {
+    redis-cli -h "$REDIS_HOST" -p "$REDIS_PORT" -n "$REDIS_DB" "$@"
+}
+
+used_memory() {
+    cli INFO memory | awk -F: '/^used_memory:/ {print $2}' | tr -d '\r'
+}
+
+# 每个 token 扣减一次，通过 pipeline 写入。packed 的 key 在桶重新装满时
+# 过期，每秒 1 个令牌、扣减 1000 个时为 1000 秒，测量期间不会过期
+populate() {
+    awk -v sha="$1" -v n="$KEYS" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            k = "bench_token_" i
+            printf "*8\r\n$7\r\nEVALSHA\r\n$40\r\n%s\r\n$1\r\n1\r\n", sha
+            printf "$%d\r\n%s\r\n", length(k), k
+            printf "$7\r\n1000000\r\n$1\r\n1\r\n$4\r\n1000\r\n$1\r\n0\r\n"
+        }
+    }' | cli --pipe >/dev/null
+}
+
+# 输出 "requests/s latency"
+measure() {
+    if command -v redis-benchmark >/dev/null; then
+        # 随机 token 上的扣减，大部分请求会修改状态
+        result=$(redis-benchmark -h "$REDIS_HOST" -p "$REDIS_PORT" \
+            --dbnum "$REDIS_DB" -n "$REQUESTS" -c "$CLIENTS" -r "$KEYS" -q \
+            EVALSHA "$1" 1 bench_token___rand_int__ 1000000 1 1 0 |
+            tr '\r' '\n' | grep 'requests per second' | tail -1)
+        qps=$(grep -o '[0-9.]* requests per second' <<<"$result" |
+            cut -d' ' -f1)
+        latency=$(grep -o 'p50=.*' <<<"$result" || true)
+        echo "$qps ${latency:--}"
+        return
+    fi
+
+    start=$(date +%s%N)
+    cli -r "$REQUESTS" EVALSHA "$1" 1 bench_token_0 1000000 1 1 0 >/dev/null
+    elapsed=$(($(date +%s%N) - start))
+    awk -v n="$REQUESTS" -v ns="$elapsed" \
+        'BEGIN {printf "%.0f avg=%.1fus", n * 1e9 / ns, ns / n / 1000}'
+}
+
+printf "%-8s %12s %12s %14s %s\n" format bytes/key memory_usage \
+    requests/s latency
+for format in hash packed; do
+    script=ratelimit.lua
+    [ "$format" = packed ] && script=ratelimit_packed.lua
+    sha=$(cli SCRIPT LOAD "$(cat "$SCRIPT_DIR/$script")")
+
+    cli FLUSHDB >/dev/null
+    before=$(used_memory)
+    populate "$sha"
+    after=$(used_memory)
+    per_key=$(((after - before) / KEYS))
+    usage=$(cli MEMORY USAGE bench_token_0)
+
+    read -r qps latency <<<"$(measure "$sha")"
+    printf "%-8s %12s %12s %14s %s\n" "$format" "$per_key" "$usage" \
+        "$qps" "$latency"
+done
+
+cli FLUSHDB >/dev/null
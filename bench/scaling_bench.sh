@@ -0,0 +1,75 @@
+#!/bin/bash
+# 测量限流判断吞吐随 redis 连接模型、服务分片数和线程数的变化，
+# 在 build 目录下运行，输出每种配置下 RateLimitBench 闭环压测的吞吐和延迟。
+#
+#   REDIS_ADDRESS  限流服务连接的 redis，为空时在本机 6380 端口启动 redis 桩
+#   CONFIGS        要测量的配置，每项为 连接模型:连接数:服务分片数:每个分片的线程数
+#   CONCURRENCY    压测的在途请求数
+#   CHANNELS       压测客户端的连接数，需要大于服务分片数
+#   DURATION       每种配置的压测秒数
+set -u
+
+REDIS_ADDRESS=${REDIS_ADDRESS:-}
+CONFIGS=${CONFIGS:-"single:1:1:4 pooled:1:1:4 per_worker:4:1:4 \
+per_worker:8:1:8 single:1:2:2 single:1:4:1 per_worker:2:4:1"}
+CONCURRENCY=${CONCURRENCY:-512}
+CHANNELS=${CHANNELS:-16}
+DURATION=${DURATION:-10}
+TOKENS=${TOKENS:-1000}
+PORT=${PORT:-50051}
+
+pids=()
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+}
+trap cleanup EXIT
+
+if [ -z "$REDIS_ADDRESS" ]; then
+    ./RateLimitBench -server= -stub_redis_port=6380 -script_dir=../conf \
+        >/dev/null 2>&1 &
+    pids+=($!)
+    REDIS_ADDRESS=127.0.0.1:6380
+    sleep 1
+fi
+
+# 压测 token 的配置写入本地文件，不依赖 etcd
+conf_file=$(mktemp)
+{
+    echo "{"
+    for ((i = 0; i < TOKENS; i++)); do
+        sep=","
+        [ $i -eq $((TOKENS - 1)) ] && sep=""
+        echo "\"bench_token_$i\": {\"burst\": 100000, \"rate\": 100000}$sep"
+    done
+    echo "}"
+} >"$conf_file"
+
+printf "%-12s %5s %7s %8s %10s %8s %8s\n" type conns shards threads \
+    qps p50_us p99_us
+for config in $CONFIGS; do
+    IFS=: read -r type conns shards threads <<<"$config"
+
+    ./RateLimitServer -port="$PORT" -limit_conf_file="$conf_file" \
+        -redis_address="$REDIS_ADDRESS" -redis_connection_type="$type" \
+        -redis_connections="$conns" -server_shards="$shards" \
+        -num_threads="$threads" >/dev/null 2>&1 &
+    server=$!
+    sleep 2
+
+    report=$(./RateLimitBench -server=127.0.0.1:"$PORT" -mode=closed \
+        -concurrency="$CONCURRENCY" -channels="$CHANNELS" \
+        -tokens="$TOKENS" -duration_s="$DURATION" 2>/dev/null)
+    qps=$(awk '/^throughput/ {print $2}' <<<"$report")
+    p50=$(grep -o 'p50=[0-9]*' <<<"$report" | cut -d= -f2)
+    p99=$(grep -o 'p99=[0-9]*' <<<"$report" | cut -d= -f2)
+    printf "%-12s %5s %7s %8s %10s %8s %8s\n" "$type" "$conns" "$shards" \
+        "$threads" "${qps:--}" "${p50:--}" "${p99:--}"
+
+    kill "$server"
+    wait "$server" 2>/dev/null
+done
+
+rm -f "$conf_file"
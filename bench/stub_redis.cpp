@@ -0,0 +1,330 @@
+#include "stub_redis.h"
+
+#include <butil/logging.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+int64_t toInt(const butil::StringPiece& value, int64_t default_value = 0) {
+    int64_t result = default_value;
+    std::from_chars(value.data(), value.data() + value.size(), result);
+    return result;
+}
+
+void setDecision(brpc::RedisReply* output, const LimitDecision& decision) {
+    output->SetArray(3);
+    (*output)[0].SetInteger(decision.allowed ? 1 : 0);
+    (*output)[1].SetInteger(decision.remaining);
+    (*output)[2].SetInteger(decision.retry_after_ms);
+}
+
+}    // namespace
+
+class StubRedis::AuthHandler : public brpc::RedisCommandHandler {
+public:
+    brpc::RedisCommandHandlerResult Run(
+        brpc::RedisConnContext* ctx,
+        const std::vector<butil::StringPiece>& args,
+        brpc::RedisReply* output, bool flush_batched) override {
+        output->SetStatus("OK");
+        return brpc::REDIS_CMD_HANDLED;
+    }
+};
+
+class StubRedis::PingHandler : public brpc::RedisCommandHandler {
+public:
+    brpc::RedisCommandHandlerResult Run(
+        brpc::RedisConnContext* ctx,
+        const std::vector<butil::StringPiece>& args,
+        brpc::RedisReply* output, bool flush_batched) override {
+        output->SetStatus("PONG");
+        return brpc::REDIS_CMD_HANDLED;
+    }
+};
+
+class StubRedis::ScriptHandler : public brpc::RedisCommandHandler {
+public:
+    explicit ScriptHandler(StubRedis* redis) : _redis(redis) {}
+
+    brpc::RedisCommandHandlerResult Run(
+        brpc::RedisConnContext* ctx,
+        const std::vector<butil::StringPiece>& args,
+        brpc::RedisReply* output, bool flush_batched) override {
+        if (args.size() != 3 || args[1].size() != 4 ||
+            strncasecmp(args[1].data(), "load", 4) != 0) {
+            output->SetError("ERR only SCRIPT LOAD is supported");
+            return brpc::REDIS_CMD_HANDLED;
+        }
+
+        std::string sha1 = digest(args[2].as_string());
+        {
+            // 未知的脚本也返回 sha1，执行时返回 NOSCRIPT
+            std::lock_guard<std::mutex> lock(_redis->_mutex);
+            _redis->_scripts.emplace(sha1, kUnknownScript);
+        }
+        output->SetString(sha1);
+        return brpc::REDIS_CMD_HANDLED;
+    }
+
+private:
+    StubRedis* _redis;
+};
+
+class StubRedis::EvalShaHandler : public brpc::RedisCommandHandler {
+public:
+    explicit EvalShaHandler(StubRedis* redis) : _redis(redis) {}
+
+    brpc::RedisCommandHandlerResult Run(
+        brpc::RedisConnContext* ctx,
+        const std::vector<butil::StringPiece>& args,
+        brpc::RedisReply* output, bool flush_batched) override {
+        if (args.size() < 3) {
+            output->SetError("ERR wrong number of arguments for 'evalsha'");
+            return brpc::REDIS_CMD_HANDLED;
+        }
+
+        int kind = _redis->scriptKind(args[1].as_string());
+        if (kind == kGroupScript) {
+            _redis->evalGroup(args, output);
+        } else if (kind == kLeaseScript) {
+            _redis->evalLease(args, output);
+        } else if (kind >= 0) {
+            _redis->evalLimit(kind, args, output);
+        } else {
+            output->SetError("NOSCRIPT No matching script");
+        }
+        return brpc::REDIS_CMD_HANDLED;
+    }
+
+private:
+    StubRedis* _redis;
+};
+
+class StubRedis::SetNxHandler : public brpc::RedisCommandHandler {
+public:
+    explicit SetNxHandler(StubRedis* redis) : _redis(redis) {}
+
+    brpc::RedisCommandHandlerResult Run(
+        brpc::RedisConnContext* ctx,
+        const std::vector<butil::StringPiece>& args,
+        brpc::RedisReply* output, bool flush_batched) override {
+        if (args.size() != 3) {
+            output->SetError("ERR wrong number of arguments for 'setnx'");
+            return brpc::REDIS_CMD_HANDLED;
+        }
+
+        std::lock_guard<std::mutex> lock(_redis->_mutex);
+        bool inserted =
+            _redis->_integers.emplace(args[1].as_string(), toInt(args[2]))
+                .second;
+        output->SetInteger(inserted ? 1 : 0);
+        return brpc::REDIS_CMD_HANDLED;
+    }
+
+private:
+    StubRedis* _redis;
+};
+
+class StubRedis::IncrHandler : public brpc::RedisCommandHandler {
+public:
+    explicit IncrHandler(StubRedis* redis) : _redis(redis) {}
+
+    brpc::RedisCommandHandlerResult Run(
+        brpc::RedisConnContext* ctx,
+        const std::vector<butil::StringPiece>& args,
+        brpc::RedisReply* output, bool flush_batched) override {
+        if (args.size() != 2) {
+            output->SetError("ERR wrong number of arguments for 'incr'");
+            return brpc::REDIS_CMD_HANDLED;
+        }
+
+        std::lock_guard<std::mutex> lock(_redis->_mutex);
+        output->SetInteger(++_redis->_integers[args[1].as_string()]);
+        return brpc::REDIS_CMD_HANDLED;
+    }
+
+private:
+    StubRedis* _redis;
+};
+
+StubRedis::StubRedis(const std::string& script_dir, size_t capacity)
+    : _buckets(capacity) {
+    for (size_t i = 0; i < kLimitAlgorithmCount; ++i) {
+        registerScript(script_dir + "/" + kLimitAlgorithms[i].script,
+                       static_cast<int>(i));
+    }
+    registerScript(script_dir + "/ratelimit_packed.lua",
+                   static_cast<int>(LimitAlgorithm::kTokenBucket));
+    registerScript(script_dir + "/ratelimit_group.lua", kGroupScript);
+    registerScript(script_dir + "/ratelimit_lease.lua", kLeaseScript);
+}
+
+// 只用于识别脚本，不需要与 redis 计算的 sha1 相同
+std::string StubRedis::digest(const std::string& script) {
+    std::string result;
+    uint64_t hash = 14695981039346656037ULL;
+    for (int round = 0; round < 3; ++round) {
+        for (unsigned char c : script) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx",
+                 static_cast<unsigned long long>(hash));
+        result.append(buf);
+    }
+    result.resize(40);
+    return result;
+}
+
+void StubRedis::registerScript(const std::string& path, int kind) {
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        LOG(WARNING) << "Failed to open " << path
+                     << ", the stub redis will reply NOSCRIPT for it";
+        return;
+    }
+
+    std::ostringstream oss;
+    oss << ifs.rdbuf();
+    _scripts[digest(oss.str())] = kind;
+}
+
+int StubRedis::scriptKind(const std::string& sha1) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto iter = _scripts.find(sha1);
+    return iter == _scripts.end() ? kUnknownScript : iter->second;
+}
+
+// EVALSHA sha1 1 token arg1 arg2 cost dry_run
+void StubRedis::evalLimit(int kind,
+                          const std::vector<butil::StringPiece>& args,
+                          brpc::RedisReply* output) {
+    if (args.size() < 8) {
+        output->SetError("ERR wrong number of arguments for limit script");
+        return;
+    }
+
+    TokenBucketConfig config;
+    config.algorithm = kLimitAlgorithms[kind].algorithm;
+    config.burst = toInt(args[4]);
+    if (config.algorithm == LimitAlgorithm::kTokenBucket ||
+        config.algorithm == LimitAlgorithm::kGcra) {
+        config.rate = toInt(args[5]);
+    } else {
+        config.window_ms = toInt(args[5]);
+    }
+
+    const butil::StringPiece& token = args[3];
+    int64_t cost = toInt(args[6], 1);
+    LimitDecision decision;
+    if (cost < 0) {
+        _buckets.Release(std::string_view(token.data(), token.size()), config,
+                         -cost);
+        decision.allowed = true;
+    } else {
+        _buckets.TryAcquire(std::string_view(token.data(), token.size()),
+                            config, cost, args[7] == "1", &decision);
+    }
+    setDecision(output, decision);
+}
+
+// EVALSHA sha1 n token... cost dry_run {algorithm arg1 arg2}...
+void StubRedis::evalGroup(const std::vector<butil::StringPiece>& args,
+                          brpc::RedisReply* output) {
+    const int64_t num_keys = toInt(args[2]);
+    if (num_keys <= 0 ||
+        args.size() != static_cast<size_t>(5 + 4 * num_keys)) {
+        output->SetError("ERR wrong number of arguments for group script");
+        return;
+    }
+
+    const size_t argv = 3 + num_keys;
+    const int64_t cost = toInt(args[argv], 1);
+    const bool dry_run = args[argv + 1] == "1";
+
+    std::vector<LimitGroupMember> members(num_keys);
+    for (int64_t i = 0; i < num_keys; ++i) {
+        const size_t base = argv + 2 + i * 3;
+        TokenBucketConfig& config = members[i].config;
+        std::string_view algorithm(args[base].data(), args[base].size());
+        // 桩中两种状态格式的令牌桶没有区别
+        if (algorithm == "token_bucket_packed") {
+            algorithm = "token_bucket";
+        }
+        if (!ParseLimitAlgorithm(algorithm, &config.algorithm)) {
+            output->SetError("ERR unsupported algorithm in limit group");
+            return;
+        }
+        config.burst = toInt(args[base + 1]);
+        if (config.algorithm == LimitAlgorithm::kSlidingWindow) {
+            config.window_ms = toInt(args[base + 2]);
+        } else {
+            config.rate = toInt(args[base + 2]);
+        }
+        members[i].token = args[3 + i].as_string();
+    }
+
+    // 与 ratelimit_group.lua 一样先判断所有层，全部通过再扣减
+    LimitDecision decision;
+    _buckets.TryAcquireGroup(members, cost, dry_run, &decision);
+    setDecision(output, decision);
+}
+
+// EVALSHA sha1 1 token capacity rate want give_back packed，返回预留的令牌数。
+// 桩中不处理归还
+void StubRedis::evalLease(const std::vector<butil::StringPiece>& args,
+                          brpc::RedisReply* output) {
+    if (args.size() < 7) {
+        output->SetError("ERR wrong number of arguments for lease script");
+        return;
+    }
+
+    TokenBucketConfig config;
+    config.burst = toInt(args[4]);
+    config.rate = toInt(args[5]);
+    const std::string_view token(args[3].data(), args[3].size());
+
+    LimitDecision decision;
+    _buckets.TryAcquire(token, config, 0, true, &decision);
+
+    int64_t granted = std::min(toInt(args[6]), decision.remaining);
+    if (granted > 0) {
+        _buckets.TryAcquire(token, config, granted, false, &decision);
+        if (!decision.allowed) {
+            granted = 0;
+        }
+    }
+    output->SetInteger(std::max<int64_t>(granted, 0));
+}
+
+int StubRedis::Start(int port) {
+    brpc::RedisService* service = new brpc::RedisService;
+    service->AddCommandHandler("auth", new AuthHandler);
+    service->AddCommandHandler("ping", new PingHandler);
+    service->AddCommandHandler("script", new ScriptHandler(this));
+    service->AddCommandHandler("evalsha", new EvalShaHandler(this));
+    service->AddCommandHandler("setnx", new SetNxHandler(this));
+    service->AddCommandHandler("incr", new IncrHandler(this));
+
+    // redis_service 由 server 负责释放
+    brpc::ServerOptions options;
+    options.redis_service = service;
+    if (_server.Start(port, &options) != 0) {
+        LOG(ERROR) << "Failed to start stub redis on port " << port;
+        return -1;
+    }
+
+    LOG(INFO) << "Stub redis started on port " << port;
+    return 0;
+}
+
+void StubRedis::Stop() {
+    _server.Stop(0);
+    _server.Join();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <brpc/redis.h>
+#include <brpc/server.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "limiter/local_bucket_table.h"
+
+// 进程内的 redis 桩，只实现限流服务用到的命令。限流脚本不经过 lua，
+// 而是按 SCRIPT LOAD 的内容识别出对应的算法，由 LocalBucketTable 在本地
+// 执行，压测结果不受网络和 redis 本身的影响
+class StubRedis {
+public:
+    // script_dir 为限流服务加载的 lua 脚本所在的目录
+    StubRedis(const std::string& script_dir, size_t capacity);
+    ~StubRedis() = default;
+
+    // 返回 0 表示成功
+    int Start(int port);
+
+    void Stop();
+
+private:
+    // 脚本的类型，kLimitAlgorithms 中的算法按下标表示
+    enum ScriptKind {
+        kGroupScript = -1,
+        kLeaseScript = -2,
+        kUnknownScript = -3,
+    };
+
+    class AuthHandler;
+    class PingHandler;
+    class ScriptHandler;
+    class EvalShaHandler;
+    class SetNxHandler;
+    class IncrHandler;
+
+    static std::string digest(const std::string& script);
+
+    void registerScript(const std::string& path, int kind);
+
+    int scriptKind(const std::string& sha1);
+
+    void evalLimit(int kind, const std::vector<butil::StringPiece>& args,
+                   brpc::RedisReply* output);
+
+    void evalGroup(const std::vector<butil::StringPiece>& args,
+                   brpc::RedisReply* output);
+
+    void evalLease(const std::vector<butil::StringPiece>& args,
+                   brpc::RedisReply* output);
+
+private:
+    LocalBucketTable _buckets;
+
+    std::mutex _mutex;
+    // 脚本 sha1 -> 类型
+    std::unordered_map<std::string, int> _scripts;
+    // SETNX/INCR 使用的整数键
+    std::unordered_map<std::string, int64_t> _integers;
+
+    brpc::Server _server;
+};
@@ -0,0 +1,35 @@
+local key = KEYS[1]
+local limit = tonumber(ARGV[1])
+-- 计数的过期时间（毫秒），防止调用方没有释放导致计数泄漏
+local ttl = tonumber(ARGV[2])
+-- 大于 0 为获取，小于 0 为释放
+local cost = tonumber(ARGV[3]) or 1
+-- 为 1 时只判断不占用，也不修改任何状态
+local dry_run = ARGV[4] == '1'
+
+local inflight = tonumber(redis.call('GET', key)) or 0
+
+-- 返回 {是否允许, 剩余并发数, 重试等待时间}，并发数何时释放无法预知，
+-- 被拒绝时重试等待时间为 0，cost 超过上限时为 -1
+if cost < 0 then
+    if dry_run then
+        return {1, limit - inflight, 0}
+    end
+    inflight = math.max(inflight + cost, 0)
+    if inflight == 0 then
+        redis.call('DEL', key)
+    else
+        redis.call('SET', key, inflight, 'PX', ttl)
+    end
+    return {1, limit - inflight, 0}
+end
+
+if inflight + cost > limit then
+    return {0, math.max(limit - inflight, 0), cost > limit and -1 or 0}
+end
+
+if not dry_run then
+    inflight = inflight + cost
+    redis.call('SET', key, inflight, 'PX', ttl)
+end
+return {1, limit - inflight, 0}
\ No newline at end of file
@@ -0,0 +1,36 @@
+local key = KEYS[1]
+local burst = tonumber(ARGV[1])
+local rate = tonumber(ARGV[2])
+-- 本次请求消耗的令牌数，未传递时默认为 1
+local cost = tonumber(ARGV[3]) or 1
+-- 为 1 时只判断不扣减，也不修改任何状态
+local dry_run = ARGV[4] == '1'
+
+-- GCRA 只保存一个理论到达时间 (TAT)，不需要 HMGET/HMSET/EXISTS/EXPIRE/TTL
+-- 每个令牌的发放间隔（微秒）
+local interval = 1000000 / rate
+local tolerance = interval * burst
+
+-- 获取Redis服务器时间（秒 + 微秒）
+local redis_time = redis.call('TIME')
+local now = tonumber(redis_time[1]) * 1000000 + tonumber(redis_time[2])  -- 微秒时间戳
+
+local tat = math.max(tonumber(redis.call('GET', key)) or now, now)
+local new_tat = tat + interval * cost
+
+-- 最多允许提前 burst 个令牌的时间
+if new_tat - now > tolerance then
+    local retry_after = -1
+    if cost <= burst then
+        retry_after = math.ceil((new_tat - now - tolerance) / 1000)
+    end
+    -- 返回 {是否允许, 剩余令牌数, 重试等待时间}
+    return {0, math.floor((now + tolerance - tat) / interval), retry_after}
+end
+
+if not dry_run then
+    -- 键在桶重新装满后自动过期
+    redis.call('SET', key, string.format('%.0f', new_tat), 'PX', math.ceil((new_tat - now) / 1000))
+    tat = new_tat
+end
+return {1, math.floor((now + tolerance - tat) / interval), 0}
\ No newline at end of file
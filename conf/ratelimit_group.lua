@@ -0,0 +1,163 @@
+-- 限流组：KEYS 为组内各层的 token，ARGV = {cost, dry_run, 各层的 {算法, 参数1, 参数2}}
+-- 先判断所有层，全部通过时才一起扣减，任何一层拒绝都不修改状态（被拒绝的令牌桶层只续期）
+-- 各层的 key 和单独判断时使用的 key 相同，状态是共享的
+local cost = tonumber(ARGV[1]) or 1
+local dry_run = ARGV[2] == '1'
+
+-- 获取Redis服务器时间（秒 + 微秒）
+local redis_time = redis.call('TIME')
+local now_us = tonumber(redis_time[1]) * 1000000 + tonumber(redis_time[2])  -- 微秒时间戳
+local now = math.floor(now_us / 1000)  -- 毫秒时间戳
+
+-- 每种算法返回 {是否允许, 剩余配额, 重试等待时间, 扣减函数}，与单独的脚本一致
+local function token_bucket(key, capacity, rate)
+    local data = redis.call('HMGET', key, 'tokens', 'last_refill')
+    local tokens = tonumber(data[1]) or capacity
+    local last_refill = tonumber(data[2]) or now
+    tokens = math.min(tokens + math.max(now - last_refill, 0) / 1000 * rate, capacity)
+
+    if tokens < cost then
+        -- 与 ratelimit.lua 相同，被拒绝且剩余 TTL 小于 5 分钟时续期 10 分钟
+        if not dry_run then
+            local remaining_ttl = redis.call('TTL', key)
+            if remaining_ttl >= 0 and remaining_ttl < 300 then
+                redis.call('EXPIRE', key, 600)
+            end
+        end
+        local retry_after = -1
+        if cost <= capacity then
+            retry_after = math.ceil((cost - tokens) * 1000 / rate)
+        end
+        return false, math.floor(tokens), retry_after
+    end
+    return true, math.floor(tokens - cost), 0, function()
+        redis.call('HMSET', key, 'tokens', tokens - cost, 'last_refill', now)
+        redis.call('EXPIRE', key, 1800)
+    end
+end
+
+-- ratelimit_packed.lua 的令牌桶，状态为一个字符串
+local function token_bucket_packed(key, capacity, rate)
+    local full = capacity * 1000
+    local need = cost * 1000
+    local tokens = full
+    local data = redis.pcall('GET', key)
+    if type(data) == 'string' then
+        local stored, last_refill = struct.unpack('<i8i8', data)
+        tokens = math.min(stored + math.max(now - last_refill, 0) * rate, full)
+    elseif type(data) == 'table' and data.err then
+        local old = redis.call('HMGET', key, 'tokens', 'last_refill')
+        local stored = tonumber(old[1]) or capacity
+        local last_refill = tonumber(old[2]) or now
+        tokens = math.min(math.floor(stored * 1000) + math.max(now - last_refill, 0) * rate, full)
+    end
+
+    if tokens < need then
+        local retry_after = -1
+        if cost <= capacity then
+            retry_after = math.ceil((need - tokens) / rate)
+        end
+        return false, math.floor(tokens / 1000), retry_after
+    end
+    local left = tokens - need
+    return true, math.floor(left / 1000), 0, function()
+        redis.call('SET', key, struct.pack('<i8i8', left, now), 'PX', math.max(math.ceil((full - left) / rate), 1))
+    end
+end
+
+local function gcra(key, burst, rate)
+    local interval = 1000000 / rate
+    local tolerance = interval * burst
+    local tat = math.max(tonumber(redis.call('GET', key)) or now_us, now_us)
+    local new_tat = tat + interval * cost
+
+    if new_tat - now_us > tolerance then
+        local retry_after = -1
+        if cost <= burst then
+            retry_after = math.ceil((new_tat - now_us - tolerance) / 1000)
+        end
+        return false, math.floor((now_us + tolerance - tat) / interval), retry_after
+    end
+    return true, math.floor((now_us + tolerance - new_tat) / interval), 0, function()
+        redis.call('SET', key, string.format('%.0f', new_tat), 'PX', math.ceil((new_tat - now_us) / 1000))
+    end
+end
+
+local function sliding_window(key, limit, window)
+    local window_id = math.floor(now / window)
+    local data = redis.call('HMGET', key, 'id', 'cur', 'prev')
+    local id = tonumber(data[1]) or window_id
+    local cur = tonumber(data[2]) or 0
+    local prev = tonumber(data[3]) or 0
+    if id ~= window_id then
+        if id == window_id - 1 then
+            prev = cur
+        else
+            prev = 0
+        end
+        cur = 0
+    end
+
+    local elapsed = (now % window) / window
+    local estimated = prev * (1 - elapsed) + cur
+    if estimated + cost > limit then
+        local retry_after = -1
+        if cost <= limit then
+            local room = limit - cur - cost
+            if room >= 0 and prev > 0 then
+                retry_after = math.ceil((1 - room / prev - elapsed) * window)
+            else
+                retry_after = window - now % window
+            end
+        end
+        return false, math.max(math.floor(limit - estimated), 0), retry_after
+    end
+    return true, math.floor(limit - estimated - cost), 0, function()
+        redis.call('HMSET', key, 'id', window_id, 'cur', cur + cost, 'prev', prev)
+        redis.call('PEXPIRE', key, window * 2)
+    end
+end
+
+local algorithms = {
+    token_bucket = token_bucket,
+    token_bucket_packed = token_bucket_packed,
+    gcra = gcra,
+    sliding_window = sliding_window,
+}
+
+-- 第一阶段：逐层判断，剩余配额取最小值，重试等待时间取最大值
+local allowed = true
+local remaining = nil
+local retry_after = 0
+local commits = {}
+for i, key in ipairs(KEYS) do
+    local base = i * 3
+    local algorithm = algorithms[ARGV[base]]
+    if algorithm == nil then
+        return redis.error_reply('unsupported algorithm in limit group: ' .. tostring(ARGV[base]))
+    end
+
+    local ok, left, wait, commit = algorithm(key, tonumber(ARGV[base + 1]), tonumber(ARGV[base + 2]))
+    if remaining == nil or left < remaining then
+        remaining = left
+    end
+    if not ok then
+        allowed = false
+        if wait < 0 or retry_after < 0 then
+            retry_after = -1
+        elseif wait > retry_after then
+            retry_after = wait
+        end
+    end
+    commits[i] = commit
+end
+
+-- 第二阶段：全部通过时才扣减
+if allowed and not dry_run then
+    for _, commit in ipairs(commits) do
+        commit()
+    end
+end
+
+-- 返回 {是否允许, 剩余配额, 重试等待时间}
+return {allowed and 1 or 0, remaining or 0, retry_after}
\ No newline at end of file
@@ -0,0 +1,66 @@
+local key = KEYS[1]
+local capacity = tonumber(ARGV[1])
+local rate = tonumber(ARGV[2])
+-- 本次希望预留的令牌数
+local want = tonumber(ARGV[3])
+-- 上一个租约过期后归还的令牌数
+local give_back = tonumber(ARGV[4]) or 0
+-- 为 1 时令牌桶的状态与 ratelimit_packed.lua 相同，保存为一个字符串
+local packed = ARGV[5] == '1'
+
+-- 设置键的基准过期时间（单位：秒），例如1小时
+local base_ttl = 3600
+
+-- 获取Redis服务器时间（秒 + 微秒）
+local redis_time = redis.call('TIME')
+local now = tonumber(redis_time[1]) * 1000 + math.floor(tonumber(redis_time[2]) / 1000)  -- 毫秒时间戳
+
+if packed then
+    local full = capacity * 1000
+    local tokens = full
+    local data = redis.pcall('GET', key)
+    if type(data) == 'string' then
+        local stored, last_refill = struct.unpack('<i8i8', data)
+        tokens = math.min(stored + math.max(now - last_refill, 0) * rate, full)
+    elseif type(data) == 'table' and data.err then
+        local old = redis.call('HMGET', key, 'tokens', 'last_refill')
+        local stored = tonumber(old[1]) or capacity
+        local last_refill = tonumber(old[2]) or now
+        tokens = math.min(math.floor(stored * 1000) + math.max(now - last_refill, 0) * rate, full)
+    end
+    tokens = math.min(tokens + give_back * 1000, full)
+
+    local granted = math.max(math.min(math.floor(tokens / 1000), want), 0)
+    tokens = tokens - granted * 1000
+    redis.call('SET', key, struct.pack('<i8i8', tokens, now), 'PX', math.max(math.ceil((full - tokens) / rate), 1))
+    return granted
+end
+
+-- 检查键是否存在，与 ratelimit.lua 共用同一个令牌桶
+local exists = redis.call('EXISTS', key)
+
+-- 如果键不存在，初始化令牌桶并设置TTL
+if exists == 0 then
+    redis.call('HMSET', key, 'tokens', capacity, 'last_refill', now)
+    redis.call('EXPIRE', key, base_ttl)  -- 初始TTL
+end
+
+-- 获取当前令牌状态
+local data = redis.call('HMGET', key, 'tokens', 'last_refill')
+local tokens = tonumber(data[1])
+local last_refill = tonumber(data[2])
+
+-- 计算新令牌，并加上归还的令牌
+local delta = math.max(now - last_refill, 0) / 1000  -- 转换为秒
+local new_tokens = delta * rate
+tokens = math.min(tokens + new_tokens + give_back, capacity)
+
+-- 尽可能多地预留令牌，最多预留 want 个
+local granted = math.max(math.min(math.floor(tokens), want), 0)
+tokens = tokens - granted
+
+redis.call('HMSET', key, 'tokens', tokens, 'last_refill', now)
+-- 续期TTL（示例续期30分钟）
+redis.call('EXPIRE', key, 1800)
+
+return granted
\ No newline at end of file
@@ -0,0 +1,55 @@
+-- 与 ratelimit.lua 相同的令牌桶，状态保存为一个字符串而不是 hash：
+-- 千分之一令牌精度的剩余令牌数和毫秒时间戳，各为 8 字节小端整数。
+-- 扣减时只执行一次 SET PX，过期时间为桶重新装满所需的时间，过期后
+-- key 不存在即为满桶；拒绝时不写入任何状态
+local key = KEYS[1]
+local capacity = tonumber(ARGV[1])
+local rate = tonumber(ARGV[2])
+-- 本次请求消耗的令牌数，未传递时默认为 1
+local cost = tonumber(ARGV[3]) or 1
+-- 为 1 时只判断不扣减，也不修改任何状态
+local dry_run = ARGV[4] == '1'
+
+-- 获取Redis服务器时间（秒 + 微秒）
+local redis_time = redis.call('TIME')
+local now = tonumber(redis_time[1]) * 1000 + math.floor(tonumber(redis_time[2]) / 1000)  -- 毫秒时间戳
+
+-- rate 个令牌每秒，即 rate 个千分之一令牌每毫秒
+local full = capacity * 1000
+local need = cost * 1000
+local tokens = full
+
+local data = redis.pcall('GET', key)
+if type(data) == 'string' then
+    local stored, last_refill = struct.unpack('<i8i8', data)
+    tokens = math.min(stored + math.max(now - last_refill, 0) * rate, full)
+elseif type(data) == 'table' and data.err then
+    -- 还是 ratelimit.lua 写入的 hash，读出后在下一次扣减时覆盖
+    local old = redis.call('HMGET', key, 'tokens', 'last_refill')
+    local stored = tonumber(old[1]) or capacity
+    local last_refill = tonumber(old[2]) or now
+    tokens = math.min(math.floor(stored * 1000) + math.max(now - last_refill, 0) * rate, full)
+end
+
+local allowed = tokens >= need
+if allowed and not dry_run then
+    tokens = tokens - need
+    if rate > 0 then
+        redis.call('SET', key, struct.pack('<i8i8', tokens, now), 'PX', math.max(math.ceil((full - tokens) / rate), 1))
+    else
+        redis.call('SET', key, struct.pack('<i8i8', tokens, now))
+    end
+end
+
+-- 被拒绝时计算令牌足够所需的等待时间（毫秒），cost 超过容量时永远不会通过
+local retry_after = 0
+if not allowed then
+    if cost > capacity then
+        retry_after = -1
+    else
+        retry_after = math.ceil((need - tokens) / rate)
+    end
+end
+
+-- 返回 {是否允许, 剩余令牌数, 重试等待时间}
+return {allowed and 1 or 0, math.floor(tokens / 1000), retry_after}
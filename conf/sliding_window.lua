@@ -0,0 +1,55 @@
+local key = KEYS[1]
+local limit = tonumber(ARGV[1])
+local window = tonumber(ARGV[2])  -- 窗口长度（毫秒）
+-- 本次请求消耗的次数，未传递时默认为 1
+local cost = tonumber(ARGV[3]) or 1
+-- 为 1 时只判断不计数，也不修改任何状态
+local dry_run = ARGV[4] == '1'
+
+-- 获取Redis服务器时间（秒 + 微秒）
+local redis_time = redis.call('TIME')
+local now = tonumber(redis_time[1]) * 1000 + math.floor(tonumber(redis_time[2]) / 1000)  -- 毫秒时间戳
+
+local window_id = math.floor(now / window)
+
+-- 当前窗口编号、当前窗口计数、上一个窗口计数
+local data = redis.call('HMGET', key, 'id', 'cur', 'prev')
+local id = tonumber(data[1]) or window_id
+local cur = tonumber(data[2]) or 0
+local prev = tonumber(data[3]) or 0
+
+if id ~= window_id then
+    if id == window_id - 1 then
+        prev = cur
+    else
+        prev = 0
+    end
+    cur = 0
+end
+
+-- 按当前窗口已经过去的比例估算滑动窗口内的请求数
+local elapsed = (now % window) / window
+local estimated = prev * (1 - elapsed) + cur
+if estimated + cost > limit then
+    -- 等到上一个窗口的权重衰减到足够小，当前窗口放不下时至少等到下一个窗口
+    local retry_after = -1
+    if cost <= limit then
+        local room = limit - cur - cost
+        if room >= 0 and prev > 0 then
+            retry_after = math.ceil((1 - room / prev - elapsed) * window)
+        else
+            retry_after = window - now % window
+        end
+    end
+    -- 返回 {是否允许, 剩余次数, 重试等待时间}
+    return {0, math.max(math.floor(limit - estimated), 0), retry_after}
+end
+
+if not dry_run then
+    cur = cur + cost
+    estimated = estimated + cost
+    redis.call('HMSET', key, 'id', window_id, 'cur', cur, 'prev', prev)
+    -- 两个窗口之后数据不再有用
+    redis.call('PEXPIRE', key, window * 2)
+end
+return {1, math.floor(limit - estimated), 0}
\ No newline at end of file
@@ -0,0 +1,38 @@
+local key = KEYS[1]
+local limit = tonumber(ARGV[1])
+local window = tonumber(ARGV[2]) * 1000  -- 窗口长度（微秒）
+-- 本次请求消耗的次数，未传递时默认为 1
+local cost = tonumber(ARGV[3]) or 1
+-- 为 1 时只判断不记录，也不修改任何状态
+local dry_run = ARGV[4] == '1'
+
+-- 获取Redis服务器时间（秒 + 微秒）
+local redis_time = redis.call('TIME')
+local now = tonumber(redis_time[1]) * 1000000 + tonumber(redis_time[2])  -- 微秒时间戳
+
+-- 有序集合中每个成员为一次请求，score 为请求时间，窗口之外的记录不计数
+if not dry_run then
+    redis.call('ZREMRANGEBYSCORE', key, '-inf', now - window)
+end
+local count = redis.call('ZCOUNT', key, '(' .. (now - window), '+inf')
+
+if count + cost > limit then
+    -- 等到最早的若干条记录移出窗口
+    local retry_after = -1
+    if cost <= limit then
+        local index = count + cost - limit - 1
+        local oldest = redis.call('ZRANGEBYSCORE', key, '(' .. (now - window), '+inf', 'WITHSCORES', 'LIMIT', index, 1)
+        retry_after = math.ceil((tonumber(oldest[2]) + window - now) / 1000)
+    end
+    -- 返回 {是否允许, 剩余次数, 重试等待时间}
+    return {0, limit - count, retry_after}
+end
+
+if not dry_run then
+    for i = 1, cost do
+        redis.call('ZADD', key, now, now .. ':' .. (count + i))
+    end
+    redis.call('PEXPIRE', key, math.ceil(window / 1000))
+    count = count + cost
+end
+return {1, limit - count, 0}
\ No newline at end of file
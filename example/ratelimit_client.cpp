@@ -1,9 +1,8 @@
-#include <brpc/channel.h>
 #include <gflags/gflags.h>
 #include <chrono>
 #include <thread>
 
-#include "ratelimit.pb.h"
+#include "client/ratelimit_client.h"
 
 DEFINE_string(server, "consul://ratelimit_service", "RateLimit service address");
 DEFINE_string(token, "test_token", "Token to be checked");
@@ -14,38 +13,33 @@ DEFINE_int32(threads, 1, "Number of threads");
 int main(int argc, char* argv[]) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
 
+    // 所有线程共用一个客户端，同时发起的判断会合并发送
+    RateLimitClient client;
+    if (client.Init(FLAGS_server, "rr") != 0) {
+        LOG(ERROR) << "Fail to initialize client";
+        return -1;
+    }
+
     std::vector<std::thread> threads;
 
     for (int i = 0; i < FLAGS_threads; ++i) {
-        threads.push_back(std::thread([]() {
-            brpc::Channel channel;
-            if (channel.Init(FLAGS_server.c_str(), "rr", NULL) != 0) {
-                LOG(ERROR) << "Fail to initialize channel";
-                return;
-            }
-
-            RateLimitService_Stub stub(&channel);
-
-            RateLimitRequest request;
-            request.set_token(FLAGS_token);
-
-            RateLimitResponse response;
-            brpc::Controller cntl;
-
+        threads.push_back(std::thread([&client]() {
             for (int i = 0; i < FLAGS_count; i++) {
-                stub.CheckLimit(&cntl, &request, &response, NULL);
-                if (cntl.Failed()) {
-                    LOG(ERROR) << "Fail to send request: " << cntl.ErrorText();
+                RateLimitClient::Result result = client.CheckLimit(FLAGS_token);
+                if (!result.ok) {
+                    LOG(ERROR) << "Fail to send request: " << result.error_text;
                     return;
                 }
 
-                if (response.allowed()) {
-                    LOG(INFO) << "thread " << std::this_thread::get_id() << ",Request " << i << " allowed";
+                if (result.allowed) {
+                    LOG(INFO) << "thread " << std::this_thread::get_id() << ",Request " << i << " allowed"
+                              << ", remaining=" << result.remaining;
                 } else {
-                    LOG(INFO) << "thread " << std::this_thread::get_id() << ",Request " << i << " denied";
+                    LOG(INFO) << "thread " << std::this_thread::get_id() << ",Request " << i << " denied"
+                              << ", retry_after_ms=" << result.retry_after_ms
+                              << (result.cached ? " (cached)" : "");
                 }
 
-                cntl.Reset();
                 std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_interval_ms));
             }
         }));
@@ -56,4 +50,4 @@ int main(int argc, char* argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <brpc/channel.h>
+#include <bthread/mutex.h>
+#include <bthread/unstable.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ratelimit.pb.h"
+
+// 限流服务的客户端。
+// - 一个时间窗口内发起的判断合并成一次 CheckLimitBatch 调用
+// - 同一窗口内 token、cost 和 dry_run 都相同的判断合并成一条：试算共享
+//   同一个结果；扣减时一次扣减所有请求的 cost，被拒绝但剩余配额还够部分
+//   请求通过，或者合计的 cost 超过容量时再拆开逐个判断，不会少放行
+// - 服务端返回拒绝和重试等待时间后，在等待时间内 cost 不小于被拒绝 cost
+//   的判断直接在本地拒绝
+class RateLimitClient {
+public:
+    struct Options {
+        // 判断在客户端等待凑批的最长时间，0 表示立即发送
+        int64_t batch_window_us = 100;
+        // 一次 RPC 最多包含的判断数
+        size_t max_batch_size = 64;
+        // 合并同一窗口内相同的判断
+        bool coalesce = true;
+        // 本地拒绝缓存的槽位数，0 表示关闭
+        size_t denied_cache_capacity = 4096;
+        // 本地拒绝的最长时间，服务端的配置调大之后尽快生效
+        int64_t denied_cache_max_ms = 1000;
+    };
+
+    struct Result {
+        // RPC 失败时为 false，失败原因在 error_text 中
+        bool ok = false;
+        bool allowed = false;
+        int64_t remaining = 0;
+        int64_t retry_after_ms = 0;
+        // 由本地拒绝缓存给出，没有访问服务端
+        bool cached = false;
+        std::string error_text;
+    };
+
+    using Callback = std::function<void(const Result&)>;
+
+    RateLimitClient();
+    explicit RateLimitClient(const Options& options);
+    // 发出所有等待凑批的判断，并等待在途的调用结束
+    ~RateLimitClient();
+
+    // 参数与 brpc::Channel::Init 相同，成功时返回 0，之后才能发起判断
+    int Init(const std::string& server, const std::string& load_balancer,
+             const brpc::ChannelOptions* channel_options = nullptr);
+
+    // 异步判断。命中本地拒绝缓存时 callback 在调用线程中执行，
+    // 否则在 brpc 的 bthread 中执行
+    void CheckLimit(const std::string& token, int64_t cost, bool dry_run,
+                    Callback callback);
+
+    // 同步判断，在 bthread 中调用时只阻塞当前 bthread
+    Result CheckLimit(const std::string& token, int64_t cost = 1,
+                      bool dry_run = false);
+
+    // 释放并发限制的计数，不经过批量和缓存
+    void ReleaseLimit(const std::string& token, int64_t cost,
+                      Callback callback);
+
+private:
+    // 一条待发送的判断，callbacks 为合并到这一条上的所有请求
+    struct Check {
+        std::string token;
+        // 单个请求的 cost
+        int64_t cost;
+        bool dry_run;
+        // 拆开重新判断的请求不再合并
+        bool coalescable;
+        std::vector<Callback> callbacks;
+    };
+
+    // 一次 RPC，只有一条判断时使用 CheckLimit
+    struct Batch {
+        brpc::Controller cntl;
+        RateLimitRequest request;
+        RateLimitResponse response;
+        RateLimitBatchRequest batch_request;
+        RateLimitBatchResponse batch_response;
+        std::vector<Check> checks;
+    };
+
+    class DeniedCache;
+
+    // 发送给服务端的 cost
+    static int64_t requestCost(const Check& check);
+
+    void submit(Check&& check);
+
+    static void onTimer(void* arg);
+
+    static void* runFlush(void* arg);
+
+    void flush();
+
+    void send(std::vector<Check>&& checks);
+
+    void onBatchDone(Batch* batch);
+
+    void finish(Check&& check, const RateLimitResponse& response);
+
+private:
+    Options _options;
+    brpc::Channel _channel;
+    std::unique_ptr<RateLimitService_Stub> _stub;
+    std::unique_ptr<DeniedCache> _denied;
+
+    bthread::Mutex _mutex;
+    std::vector<Check> _pending;
+    // 可合并的判断在 _pending 中的位置
+    std::unordered_map<std::string, size_t> _pending_index;
+    // 析构开始后置位，新的判断不再等待凑批
+    bool _stopping;
+    bool _timer_armed;
+    bthread_timer_t _timer;
+
+    // 在途的 RPC 和已启动的定时器
+    std::atomic<int64_t> _inflight;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <brpc/channel.h>
+#include <brpc/stream.h>
+#include <bthread/countdown_event.h>
+#include <bthread/mutex.h>
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "client/ratelimit_client.h"
+
+// 在一个 brpc stream 上连续发起判断，适合单个连接上判断量很大的调用方。
+// token 在 stream 上第一次使用时发送一次，之后每个判断只发送一个 16 字节
+// 的帧，服务端不需要解析 protobuf。token 数超过服务端允许的上限时，
+// 重新定义最久没有使用的 token 的编号。结果按发起顺序返回，callback 在 stream
+// 的 bthread 中按顺序执行，不能在其中发起同步判断。
+// 一个 stream 固定连接一个服务端实例，不经过 RateLimitClient 的批量和
+// 本地拒绝缓存；stream 断开后未返回的判断全部失败，需要重新创建对象
+class RateLimitStream : public brpc::StreamInputHandler {
+public:
+    using Result = RateLimitClient::Result;
+    using Callback = RateLimitClient::Callback;
+
+    RateLimitStream();
+    // 关闭 stream，未返回的判断以失败结束
+    ~RateLimitStream();
+
+    // 参数与 brpc::Channel::Init 相同，成功建立 stream 时返回 0
+    int Init(const std::string& server, const std::string& load_balancer,
+             const brpc::ChannelOptions* channel_options = nullptr);
+
+    // 异步判断。服务端处理不过来、stream 缓冲写满时直接失败，
+    // callback 在调用线程中执行
+    void CheckLimit(const std::string& token, int64_t cost, bool dry_run,
+                    Callback callback);
+
+    // 同步判断，在 bthread 中调用时只阻塞当前 bthread
+    Result CheckLimit(const std::string& token, int64_t cost = 1,
+                      bool dry_run = false);
+
+    // 释放并发限制的计数
+    void ReleaseLimit(const std::string& token, int64_t cost,
+                      Callback callback);
+
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf* const messages[],
+                             size_t size) override;
+
+    void on_idle_timeout(brpc::StreamId id) override {}
+
+    void on_closed(brpc::StreamId id) override;
+
+private:
+    // token 和它在 stream 上的编号，最近使用的在前面
+    using TokenList = std::list<std::pair<std::string, uint32_t>>;
+    using TokenIndex = std::unordered_map<std::string, TokenList::iterator>;
+
+    // 为 token 分配编号并把定义写入 message，没有空闲的编号时淘汰最久
+    // 没有使用的 token。服务端按顺序处理帧，之前发出的判断不受影响
+    TokenIndex::iterator defineToken(const std::string& token,
+                                     butil::IOBuf* message);
+
+    void send(uint8_t type, const std::string& token, int64_t cost,
+              bool dry_run, Callback&& callback);
+
+private:
+    brpc::Channel _channel;
+    brpc::StreamId _stream;
+    bool _stream_created;
+    // 由 OpenLimitStream 返回
+    uint32_t _max_tokens;
+
+    bthread::Mutex _mutex;
+    TokenIndex _token_ids;
+    TokenList _token_lru;
+    // 定义写入失败而撤销的编号
+    std::vector<uint32_t> _free_token_ids;
+    // 已经发送、等待结果的判断，与服务端的回复一一对应
+    std::deque<Callback> _callbacks;
+    bool _closed;
+    bthread::CountdownEvent _closed_event;
+};
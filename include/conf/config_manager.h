@@ -2,41 +2,134 @@
 
 #include <butil/containers/doubly_buffered_data.h>
 
-#include <atomic>
 #include <memory>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-struct TokenBucketConfig {
-    int64_t burst;
-    int64_t rate;
-};
+#include "conf/token_config.h"
+#include "conf/token_config_table.h"
+#include "limiter/periodic_task.h"
+
+namespace brpc {
+class Channel;
+}    // namespace brpc
+
+namespace etcdserverpb {
+class RangeRequest;
+class RangeResponse;
+}    // namespace etcdserverpb
 
 class ConfigManager {
 public:
+    // conf_file 不为空时从本地 json 文件读取配置，不访问 etcd，
+    // 文件修改后自动重新加载。首次加载失败时抛出异常
     ConfigManager(const std::string& etcd_addr,
-                  const std::string& limit_conf_prefix);
-    ~ConfigManager() = default;
+                  const std::string& limit_conf_prefix,
+                  const std::string& conf_file = "");
+    ~ConfigManager();
 
-    bool getTokenBucketConfig(const std::string& token,
+    bool getTokenBucketConfig(std::string_view token,
                               TokenBucketConfig& config);
 
+    // 获取限流组各层的 token 和配置，各层配置来自同一份快照。
+    // members 中已有的元素会被复用
+    bool getLimitGroup(std::string_view token,
+                       std::vector<LimitGroupMember>* members);
+
 private:
-    using ConfigMap = std::unordered_map<std::string, TokenBucketConfig>;
+    using ConfigMap = TokenConfigTable;
+    // 解析得到的配置以及限流组的各层 token
+    using ParsedConfig = std::pair<TokenBucketConfig, std::vector<std::string>>;
+    // 增量同步得到的变更，配置为空表示删除该 token
+    using ConfigDelta =
+        std::vector<std::pair<std::string, std::optional<ParsedConfig>>>;
 
     std::string getPrefixRangeEnd(const std::string& prefix);
 
-    void loadInitialConfig();
+    bool rangeEtcd(const etcdserverpb::RangeRequest& request,
+                   etcdserverpb::RangeResponse* response);
+
+    // 全量拉取前缀下的所有配置，失败时保留当前配置
+    bool loadInitialConfig();
+
+    // 文件格式为 {"token": {token 限流配置}, ...}，失败时保留当前配置
+    bool loadConfigFile();
+
+    // 文件修改时间变化时重新加载
+    bool syncConfigFile();
+
+    bool syncIncrementalConfig();
+
+    // 从 -config_snapshot_file 加载配置以及对应的 etcd revision
+    bool loadSnapshot();
+
+    // 配置有变化并且距离上次写入超过 -config_snapshot_interval_seconds 时
+    // 把当前配置写入快照
+    void saveSnapshot();
+
+    // 一次周期同步，etcd 访问失败时返回 false
+    bool sync();
+
+    // 下一次同步的间隔，连续失败时指数退避，并加上随机抖动
+    int64_t nextSyncDelayMs() const;
 
     void startPeriodicScan();
 
-    static bool Modify(ConfigMap& bg_map, const ConfigMap& new_map) {
-        bg_map = new_map;
+    // 由 _sync_task 在后台 bthread 中调用，不占用定时器线程
+    void syncOnce();
+
+    // 第一次调用换入新配置，第二次调用从前台拷贝，整个过程只拷贝一次
+    struct Replace {
+        ConfigMap* new_map;
+        bool swapped = false;
+
+        bool operator()(ConfigMap& bg_map, const ConfigMap& fg_map) {
+            if (!swapped) {
+                bg_map.swap(*new_map);
+                swapped = true;
+            } else {
+                bg_map = fg_map;
+            }
+            return true;
+        }
+    };
+
+    static bool ApplyDelta(ConfigMap& bg_map, const ConfigDelta& delta) {
+        for (const auto& change : delta) {
+            if (change.second) {
+                bg_map.insert_or_assign(change.first, change.second->first,
+                                        change.second->second);
+            } else {
+                bg_map.erase(change.first);
+            }
+        }
         return true;
     }
 
 private:
     std::string _etcd_addr;
     std::string _limit_conf_prefix;
+    std::string _conf_file;
+    // 最近一次加载的配置文件修改时间
+    int64_t _conf_file_mtime;
     butil::DoublyBufferedData<ConfigMap> _configMap;
+    // 所有 etcd 请求复用同一个 channel
+    std::unique_ptr<brpc::Channel> _etcd_channel;
+
+    // 最近一次同步到的 etcd revision 以及前缀下的 key 数量
+    int64_t _revision;
+    int64_t _key_count;
+
+    int64_t _last_full_scan_ms;
+    // 快照写入之后配置是否有变化
+    bool _snapshot_dirty;
+    // 0 表示还没有写入过快照
+    int64_t _last_snapshot_ms;
+    // 连续同步失败的次数
+    int _sync_failures;
+    // 析构时先停止，等待正在进行的同步结束
+    PeriodicTask _sync_task;
 };
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "conf/token_config_table.h"
+
+// 配置快照文件，启动时不访问 etcd 也能直接提供服务。
+// 文件由定长文件头和连续的变长记录组成，文件头中保存对应的 etcd revision
+// 和记录部分的 crc32c 校验和，加载时 mmap 整个文件，校验通过后逐条插入
+// 配置表，不需要解析 json
+struct ConfigSnapshotMeta {
+    // 生成快照时的 etcd key 前缀，与当前配置不同的快照不会被加载
+    std::string prefix;
+    int64_t revision = 0;
+    // etcd 中前缀下的 key 数量，包括解析失败的配置
+    int64_t key_count = 0;
+};
+
+// 把配置表编码为快照文件的内容，token 或限流组成员超过 65535 字节的配置
+// 不写入
+void EncodeConfigSnapshot(const ConfigSnapshotMeta& meta,
+                          const TokenConfigTable& table, std::string* data);
+
+// 先写入临时文件再重命名，写入过程中退出不会留下不完整的快照，
+// 返回 true 时文件和目录项都已经持久化
+bool WriteConfigSnapshot(const std::string& path, const std::string& data);
+
+// 文件不存在、损坏或者版本不匹配时返回 false，不修改 table
+bool LoadConfigSnapshot(const std::string& path, ConfigSnapshotMeta* meta,
+                        TokenConfigTable* table);
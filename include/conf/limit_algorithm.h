@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+enum class LimitAlgorithm {
+    kTokenBucket,
+    kGcra,
+    kSlidingWindow,
+    kSlidingWindowLog,
+    kConcurrency,
+};
+
+struct LimitAlgorithmInfo {
+    LimitAlgorithm algorithm;
+    // etcd 配置中 algorithm 字段的取值
+    const char* name;
+    // conf 目录下对应的 lua 脚本
+    const char* script;
+    // 是否可以作为限流组的一层，在 ratelimit_group.lua 中实现
+    bool groupable;
+};
+
+// 按枚举值顺序排列。所有脚本的参数格式相同:
+// KEYS[1]=token, ARGV={arg1, arg2, cost, dry_run}，
+// 返回 {是否允许, 剩余配额, 重试等待毫秒数}
+inline constexpr LimitAlgorithmInfo kLimitAlgorithms[] = {
+    {LimitAlgorithm::kTokenBucket, "token_bucket", "ratelimit.lua", true},
+    {LimitAlgorithm::kGcra, "gcra", "gcra.lua", true},
+    {LimitAlgorithm::kSlidingWindow, "sliding_window", "sliding_window.lua",
+     true},
+    {LimitAlgorithm::kSlidingWindowLog, "sliding_window_log",
+     "sliding_window_log.lua", false},
+    {LimitAlgorithm::kConcurrency, "concurrency", "concurrency.lua", false},
+};
+
+inline constexpr size_t kLimitAlgorithmCount =
+    sizeof(kLimitAlgorithms) / sizeof(kLimitAlgorithms[0]);
+
+inline const LimitAlgorithmInfo& GetLimitAlgorithmInfo(
+    LimitAlgorithm algorithm) {
+    return kLimitAlgorithms[static_cast<size_t>(algorithm)];
+}
+
+inline bool ParseLimitAlgorithm(std::string_view name,
+                                LimitAlgorithm* algorithm) {
+    for (const auto& info : kLimitAlgorithms) {
+        if (name == info.name) {
+            *algorithm = info.algorithm;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "conf/limit_algorithm.h"
+
+enum class LimitMode {
+    kRedis,
+    kLocal,
+    kLease,
+};
+
+// redis 不可用时的降级策略
+enum class FallbackPolicy {
+    kFail,
+    kAllow,
+    kDeny,
+    kLocal,
+};
+
+// 预先格式化好的 redis 整数参数，请求路径上不需要再格式化和分配内存
+struct RedisIntArg {
+    char data[24];
+    uint8_t size = 0;
+
+    void set(int64_t value) {
+        auto result = std::to_chars(data, data + sizeof(data), value);
+        size = static_cast<uint8_t>(result.ptr - data);
+    }
+
+    std::string_view view() const { return std::string_view(data, size); }
+};
+
+// burst 对令牌桶和 GCRA 为桶容量，对滑动窗口为窗口内允许的请求数，
+// 对并发限制为最大并发数；rate 为每秒生成的令牌数；
+// window_ms 为滑动窗口的长度，或者并发计数在没有请求时的过期时间
+struct TokenBucketConfig {
+    int64_t burst;
+    int64_t rate = 0;
+    int64_t window_ms = 0;
+    LimitAlgorithm algorithm = LimitAlgorithm::kTokenBucket;
+    LimitMode mode = LimitMode::kRedis;
+    FallbackPolicy fallback = FallbackPolicy::kFail;
+    // 大于 0 表示该 token 为限流组，组内各层的配置通过
+    // ConfigManager::getLimitGroup 获取
+    uint8_t group_size = 0;
+
+    // 预先格式化好的脚本参数 ARGV[1] 和 ARGV[2]
+    RedisIntArg script_args[2];
+
+    // 按算法填充 script_args，令牌桶和 GCRA 的第二个参数为 rate，
+    // 其他算法为 window_ms
+    void formatScriptArgs() {
+        const bool rate_based = algorithm == LimitAlgorithm::kTokenBucket ||
+                                algorithm == LimitAlgorithm::kGcra;
+        script_args[0].set(burst);
+        script_args[1].set(rate_based ? rate : window_ms);
+    }
+};
+
+// 限流组最多包含的层数
+inline constexpr size_t kMaxLimitGroupSize = 8;
+
+// 限流组中的一层
+struct LimitGroupMember {
+    std::string token;
+    TokenBucketConfig config;
+};
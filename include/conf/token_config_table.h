@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "conf/token_config.h"
+
+struct TokenConfigEntry {
+    std::string token;
+    uint64_t hash;
+    TokenBucketConfig config;
+    // 限流组各层的 token，按配置中的顺序排列
+    std::vector<std::string> group;
+};
+
+// 开放寻址（线性探测）的 token 配置表，槽位中保存预先计算好的哈希值，
+// 条目连续存放，支持 string_view 查找，查找过程不分配内存
+class TokenConfigTable {
+public:
+    using const_iterator = std::vector<TokenConfigEntry>::const_iterator;
+
+    TokenConfigTable() = default;
+
+    const TokenConfigEntry* find(std::string_view token) const;
+
+    void insert_or_assign(std::string_view token,
+                          const TokenBucketConfig& config,
+                          const std::vector<std::string>& group = {});
+
+    bool erase(std::string_view token);
+
+    void reserve(size_t size);
+
+    void swap(TokenConfigTable& other);
+
+    size_t size() const { return _entries.size(); }
+
+    bool empty() const { return _entries.empty(); }
+
+    const_iterator begin() const { return _entries.begin(); }
+
+    const_iterator end() const { return _entries.end(); }
+
+    static uint64_t Hash(std::string_view token);
+
+private:
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr uint64_t kDeleted = 1;
+
+    struct Slot {
+        uint64_t hash = kEmpty;
+        uint32_t index = 0;
+    };
+
+    size_t findSlot(std::string_view token, uint64_t hash) const;
+
+    void rehash(size_t capacity);
+
+private:
+    std::vector<Slot> _slots;
+    std::vector<TokenConfigEntry> _entries;
+    size_t _deleted = 0;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include "limiter/local_bucket_table.h"
+
+// 被 redis 拒绝的 token 在下一次有足够配额之前的本地负缓存。
+// 直接映射的定长表，每个槽位记录 token 的哈希以及拒绝截止时间和被拒绝的
+// cost，冲突时直接覆盖。写入方通过 key 中的序号互斥，读者按 seqlock 的
+// 方式校验。截止时间之前 cost 不小于被拒绝 cost 的请求在本地拒绝，不再
+// 访问 redis
+class DeniedCache {
+public:
+    // capacity 为 0 时关闭
+    explicit DeniedCache(size_t capacity);
+    ~DeniedCache() = default;
+
+    // 命中时填充 decision 并返回 true
+    bool Lookup(std::string_view token, int64_t cost,
+                LimitDecision* decision);
+
+    // 记录 redis 返回的拒绝结果，retry_after_ms 不大于 0 时不缓存
+    void Insert(std::string_view token, int64_t cost,
+                const LimitDecision& decision);
+
+private:
+    struct alignas(16) Slot {
+        // 高 48 位为 token 哈希，低 16 位为写入序号
+        std::atomic<uint64_t> key{0};
+        // 高 44 位为截止时间（毫秒），低 20 位为被拒绝的 cost
+        std::atomic<uint64_t> state{0};
+    };
+
+    static uint64_t hash(std::string_view token);
+
+    static uint64_t nowMs();
+
+private:
+    std::unique_ptr<Slot[]> _slots;
+    size_t _mask;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <butil/containers/doubly_buffered_data.h>
+#include <bvar/bvar.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+#include "limiter/periodic_task.h"
+#include "limiter/token_sketch.h"
+
+// 基于 Space-Saving 算法的热点 token 检测。请求路径上按
+// -hot_key_sample_rate 采样计数，后台每隔 -hot_key_interval_ms 取出
+// qps 不低于 -hot_key_min_qps 的前 -hot_key_top_k 个 token 作为热点，
+// 已经是热点的 token 在 qps 降到阈值一半以下后才会被移除
+class HotKeyDetector {
+public:
+    HotKeyDetector();
+    ~HotKeyDetector() = default;
+
+    void Start();
+
+    // 在请求路径上调用，按采样率计数
+    void Record(const std::string& token);
+
+    bool IsHot(const std::string& token);
+
+private:
+    // 热点 token 以及上一个周期估算的 qps
+    using HotSet = std::unordered_map<std::string, int64_t>;
+
+    void refresh();
+
+    static void describe(std::ostream& os, void* arg);
+
+private:
+    TokenSketch _sketch;
+    butil::DoublyBufferedData<HotSet> _hot;
+    // 热点为空时请求路径上不需要查表
+    std::atomic<size_t> _hot_count;
+    int64_t _last_refresh_ms;
+
+    bvar::PassiveStatus<std::string> _hot_keys_status;
+    // 最后一个成员，最先析构，停止之后才释放 refresh 用到的成员
+    PeriodicTask _refresher;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "conf/token_config.h"
+
+// 一次限流判断的结果
+struct LimitDecision {
+    bool allowed = false;
+    // 判断之后剩余的配额
+    int64_t remaining = 0;
+    // 被拒绝时建议的重试等待时间（毫秒），-1 表示重试也不会通过，
+    // 0 表示无法预知
+    int64_t retry_after_ms = 0;
+};
+
+// 进程内限流状态表，每个 token 的状态为一个 64 位整数，通过 CAS 无锁更新:
+// 令牌桶为千分之一令牌精度的剩余令牌数(高 32 位)和毫秒时间戳(低 32 位)，
+// GCRA 为微秒精度的理论到达时间，滑动窗口为窗口编号和前后两个窗口的计数，
+// 并发限制为当前并发数。滑动窗口日志需要保存窗口内每次请求的时间，
+// 单独存放在按桶分片、加锁保护的表中。
+//
+// 内存在构造时一次分配，每个桶为 16 字节的记录。token 按哈希落在分片内
+// 一个 kWays 路的组中，组内查找不加锁；组满时在分片锁内先回收过期的桶，
+// 没有过期的桶时按 CLOCK 淘汰最近没有被访问的桶。桶的过期时间与 lua
+// 脚本一致：令牌桶扣减后为 1800 秒，被拒绝且剩余不足 300 秒时续期到
+// 600 秒，其他算法为状态失效所需的时间，过期的桶按新建处理
+class LocalBucketTable {
+public:
+    // capacity 为最多保存的 token 数，占用 16 * capacity 字节（向上取整）
+    explicit LocalBucketTable(size_t capacity);
+    ~LocalBucketTable() = default;
+
+    // dry_run 为 true 时只判断不扣减。超出容量时淘汰冷的桶，总能得到结果。
+    // 令牌桶的 burst 最多为 4294967，滑动窗口最多为 1048575，更大的配置
+    // 按上限计算，cost 超过上限时拒绝且 retry_after_ms 为 -1
+    void TryAcquire(std::string_view token, const TokenBucketConfig& config,
+                    int64_t cost, bool dry_run, LimitDecision* decision);
+
+    // 限流组：先试算所有层，全部通过时再逐层扣减。剩余配额取各层的最小值，
+    // 重试等待时间取被拒绝各层的最大值。扣减不是原子的，并发时可能多扣减
+    void TryAcquireGroup(const std::vector<LimitGroupMember>& group,
+                         int64_t cost, bool dry_run, LimitDecision* decision);
+
+    // 归还并发限制的计数，其他算法不需要释放
+    void Release(std::string_view token, const TokenBucketConfig& config,
+                 int64_t cost);
+
+    // 实际的槽位数
+    size_t capacity() const { return _capacity; }
+
+    // 因为过期被回收和被 CLOCK 淘汰的桶数
+    int64_t expirations() const {
+        return _expirations.load(std::memory_order_relaxed);
+    }
+    int64_t evictions() const {
+        return _evictions.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kShardCount = 64;
+    static constexpr size_t kWays = 8;
+
+    // key 的高 40 位为 token 哈希的指纹，第 23 位为 CLOCK 的访问位，
+    // 低 23 位为过期时间（秒），为 0 表示空槽位
+    struct alignas(16) Slot {
+        std::atomic<uint64_t> key{0};
+        std::atomic<uint64_t> state{0};
+    };
+
+    // 一个组正好占两个 cache line
+    struct alignas(64) Set {
+        Slot slots[kWays];
+    };
+
+    struct Shard {
+        std::unique_ptr<Set[]> sets;
+        size_t mask = 0;
+        // 插入、回收和淘汰时加锁
+        std::mutex mutex;
+        // CLOCK 的指针，分片内的组共用
+        size_t hand = 0;
+    };
+
+    struct LogShard {
+        std::mutex mutex;
+        std::unordered_map<const Slot*, std::deque<uint32_t>> logs;
+    };
+
+    // fingerprint 返回 token 在槽位 key 中的指纹。无锁命中的槽位没有被固定，
+    // 判断期间可能被淘汰并分配给其他 token，判断后用 ownedBy 确认
+    Slot* findOrInsert(std::string_view token, LimitAlgorithm algorithm,
+                       uint64_t* fingerprint);
+
+    // 槽位仍然属于指纹为 fingerprint 的 token
+    static bool ownedBy(const Slot* slot, uint64_t fingerprint);
+
+    // 在分片锁内为新 token 选出槽位，优先空槽位和过期的桶
+    Slot* evict(Shard* shard, Set* set, uint32_t now);
+
+    // 按判断结果续期，与脚本中的 EXPIRE/PEXPIRE 对应
+    static void renew(Slot* slot, uint64_t fingerprint,
+                      const TokenBucketConfig& config,
+                      const LimitDecision& decision);
+
+    // 桶被回收或者淘汰时丢弃滑动窗口日志
+    void dropLog(const Slot* slot);
+
+    // 按 config.algorithm 选择算法
+    void acquire(Slot* slot, const TokenBucketConfig& config, int64_t cost,
+                 bool dry_run, LimitDecision* decision);
+
+    static void acquireTokenBucket(Slot* slot, const TokenBucketConfig& config,
+                                   int64_t cost, bool dry_run,
+                                   LimitDecision* decision);
+    static void acquireGcra(Slot* slot, const TokenBucketConfig& config,
+                            int64_t cost, bool dry_run,
+                            LimitDecision* decision);
+    static void acquireSlidingWindow(Slot* slot,
+                                     const TokenBucketConfig& config,
+                                     int64_t cost, bool dry_run,
+                                     LimitDecision* decision);
+    void acquireSlidingWindowLog(const Slot* slot,
+                                 const TokenBucketConfig& config,
+                                 int64_t cost, bool dry_run,
+                                 LimitDecision* decision);
+    static void acquireConcurrency(Slot* slot, const TokenBucketConfig& config,
+                                   int64_t cost, bool dry_run,
+                                   LimitDecision* decision);
+
+    static uint32_t nowMs();
+    static uint64_t nowUs();
+    // 23 位的秒级时间戳，用于过期时间
+    static uint32_t nowSeconds();
+
+private:
+    Shard _shards[kShardCount];
+    LogShard _log_shards[kShardCount];
+    // 有滑动窗口日志时才需要在回收桶时查找日志
+    std::atomic<bool> _has_logs{false};
+    size_t _capacity;
+
+    std::atomic<int64_t> _expirations{0};
+    std::atomic<int64_t> _evictions{0};
+};
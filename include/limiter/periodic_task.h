@@ -0,0 +1,54 @@
+#pragma once
+
+#include <bthread/condition_variable.h>
+#include <bthread/mutex.h>
+#include <bthread/unstable.h>
+
+#include <cstdint>
+#include <functional>
+
+// 由 bthread 定时器驱动、在后台 bthread 中周期执行的任务，服务中所有
+// 定时刷新、同步和探测都通过它调度。Stop 返回后任务不会再执行，正在执行的
+// 一次会先结束，持有者在析构时停止即可安全释放任务引用的成员
+class PeriodicTask {
+public:
+    PeriodicTask() = default;
+    ~PeriodicTask() { Stop(); }
+
+    PeriodicTask(const PeriodicTask&) = delete;
+    PeriodicTask& operator=(const PeriodicTask&) = delete;
+
+    // 每次调度前调用 interval_ms 取得间隔，可以随 gflags 动态修改。
+    // fn 返回 false 时不再调度，之后可以再次 Start；在 fn 执行期间调用
+    // Start 时，这一次结束后继续调度。name 用于日志，定时器添加失败时
+    // 返回 false
+    bool Start(const char* name, std::function<int64_t()> interval_ms,
+               std::function<bool()> fn);
+
+    void Stop();
+
+private:
+    static void onTimer(void* arg);
+
+    static void* run(void* arg);
+
+    // 调用时持有 _mutex
+    bool scheduleLocked();
+
+private:
+    const char* _name = "";
+    std::function<int64_t()> _interval_ms;
+    std::function<bool()> _fn;
+
+    bthread::Mutex _mutex;
+    // 定时器到期后的一次执行结束时唤醒 Stop
+    bthread::ConditionVariable _cond;
+    bthread_timer_t _timer = 0;
+    // 定时器已经添加，到期后的执行还没有结束
+    bool _scheduled = false;
+    // fn 正在执行
+    bool _running = false;
+    // fn 执行期间被再次 Start
+    bool _restart = false;
+    bool _stopped = false;
+};
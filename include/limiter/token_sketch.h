@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// 基于 Space-Saving 算法统计各 token 请求数的草图，最多跟踪 capacity 个
+// token，按 token 哈希分片加锁。计数满时替换计数最小的 token，请求数
+// 足够大的 token 一定会被保留。token 只在进入草图时拷贝，已经跟踪的
+// token 计数和替换都不分配内存
+class TokenSketch {
+public:
+    explicit TokenSketch(size_t capacity);
+    ~TokenSketch() = default;
+
+    void Add(const std::string& token);
+
+    // 取出各 token 计数的下界并清空，按计数从大到小排列
+    void Drain(std::vector<std::pair<int64_t, std::string>>* counts);
+
+private:
+    static constexpr size_t kShardCount = 16;
+
+    struct Counter {
+        int64_t count = 0;
+        // 替换计数最小的 token 时继承的计数，count - error 为下界
+        int64_t error = 0;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Counter> counters;
+    };
+
+    size_t _shard_capacity;
+    Shard _shards[kShardCount];
+};
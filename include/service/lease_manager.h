@@ -0,0 +1,110 @@
+#pragma once
+
+#include <brpc/channel.h>
+#include <brpc/redis.h>
+#include <bthread/mutex.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "conf/config_manager.h"
+#include "limiter/periodic_task.h"
+#include "ratelimit.pb.h"
+#include "service/redis_shard_set.h"
+
+// 从 redis 令牌桶中一次预留一批令牌，在本地消费直到用完或者过期，
+// 过期未用完的令牌会归还给 redis
+class LeaseManager {
+public:
+    // 续租失败时按 token 的降级策略判断，写入 response 并返回 true，
+    // 无法降级时返回 false
+    using DegradeFunc = std::function<bool(
+        const std::string& token, const TokenBucketConfig& config,
+        int64_t cost, ::RateLimitResponse* response)>;
+
+    explicit LeaseManager(RedisShardSet* redis_shards);
+    ~LeaseManager();
+
+    // packed_state 为 true 时令牌桶的状态与 ratelimit_packed.lua 相同
+    void Start(const std::string& lease_script_sha1, bool packed_state,
+               DegradeFunc degrade);
+
+    // 只在租约内判断，租约不足时返回 false，
+    // 成功时 remaining 为租约中剩余的令牌数
+    bool TryConsume(const std::string& token, int64_t cost,
+                    int64_t* remaining);
+
+    // 租约不足时发起续租，done 在得到结果后调用
+    void Acquire(const std::string& token, const TokenBucketConfig& config,
+                 int64_t cost, brpc::Controller* cntl,
+                 ::RateLimitResponse* response,
+                 ::google::protobuf::Closure* done);
+
+private:
+    struct Waiter {
+        int64_t cost;
+        brpc::Controller* cntl;
+        ::RateLimitResponse* response;
+        ::google::protobuf::Closure* done;
+    };
+
+    struct Lease {
+        std::string token;
+        std::atomic<int64_t> remaining{0};
+        std::atomic<int64_t> expire_us{0};
+        std::atomic<int64_t> consumed{0};
+
+        bthread::Mutex mutex;
+        bool refilling = false;
+        TokenBucketConfig config;
+        int64_t last_refill_us = 0;
+        double qps = 0;
+        std::vector<Waiter> waiters;
+    };
+
+    struct RefillCall {
+        Lease* lease;
+        RedisShard* shard;
+        butil::Timer timer;
+        brpc::Controller redis_cntl;
+        brpc::RedisResponse redis_response;
+    };
+
+    Lease* findLease(const std::string& token, bool create);
+
+    static bool consume(Lease* lease, int64_t cost, int64_t now_us,
+                        int64_t* remaining);
+
+    int64_t leaseSize(Lease* lease, const TokenBucketConfig& config,
+                      int64_t now_us);
+
+    void onRefillComplete(RefillCall* call);
+
+    void sweep();
+
+    static void onSweepComplete(brpc::Controller* redis_cntl,
+                                brpc::RedisResponse* redis_response);
+
+private:
+    static constexpr size_t kShardCount = 32;
+
+    struct Shard {
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, std::unique_ptr<Lease>> leases;
+    };
+
+    RedisShardSet* _redis_shards;
+    std::string _lease_script_sha1;
+    // 脚本的最后一个参数
+    const char* _packed_arg = "0";
+    DegradeFunc _degrade;
+    Shard _shards[kShardCount];
+
+    // 析构时先停止，等待正在进行的回收结束
+    PeriodicTask _sweep_task;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <butil/containers/doubly_buffered_data.h>
+#include <bvar/bvar.h>
+#include <bvar/multi_dimension.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "limiter/periodic_task.h"
+#include "limiter/token_sketch.h"
+
+// 请求失败的原因
+enum class LimitError {
+    kConfigNotFound,
+    kInvalidGroup,
+    kBreakerOpen,
+    kRedisFailed,
+    kInvalidReply,
+    kOverloaded,
+    kCount,
+};
+
+// 限流服务的监控指标，都可以通过 brpc 内置的 /brpc_metrics 以 Prometheus
+// 格式导出:
+// + 各阶段耗时 limit_stage_config_lookup、limit_stage_redis 和
+//   limit_stage_callback，单位为纳秒
+// + 按原因统计的失败数 limit_errors{type}
+// + 请求量前 -metrics_top_tokens 个 token 的判断结果
+//   limit_token_decisions{token, outcome}，其余 token 汇总为
+//   token="other"，标签数量有上限。请求量按 -metrics_sample_rate 采样后
+//   由 Space-Saving 草图统计，每隔 -metrics_interval_ms 重新选择
+class LimitMetrics {
+public:
+    LimitMetrics();
+    ~LimitMetrics() = default;
+
+    void Start();
+
+    void RecordConfigLookup(int64_t ns) { _config_lookup << ns; }
+    void RecordRedis(int64_t ns) { _redis << ns; }
+    void RecordCallback(int64_t ns) { _callback << ns; }
+
+    void RecordDecision(const std::string& token, bool allowed);
+
+    void RecordError(LimitError error) {
+        *_error_counters[static_cast<size_t>(error)] << 1;
+    }
+
+private:
+    using Counter = bvar::Adder<int64_t>;
+
+    struct TokenCounters {
+        Counter* pass = nullptr;
+        Counter* reject = nullptr;
+    };
+
+    using TopTokens = std::unordered_map<std::string, TokenCounters>;
+
+    static size_t replaceTopTokens(TopTokens& bg, const TopTokens& top);
+
+    void refresh();
+
+private:
+    bvar::LatencyRecorder _config_lookup;
+    bvar::LatencyRecorder _redis;
+    bvar::LatencyRecorder _callback;
+
+    bvar::MultiDimension<Counter> _errors;
+    Counter* _error_counters[static_cast<size_t>(LimitError::kCount)];
+
+    bvar::MultiDimension<Counter> _decisions;
+    TokenCounters _other;
+    butil::DoublyBufferedData<TopTokens> _top_tokens;
+    TokenSketch _sketch;
+
+    // 最后一个成员，最先析构，停止之后才释放 refresh 用到的成员
+    PeriodicTask _refresher;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <brpc/controller.h>
+#include <brpc/stream.h>
+#include <bthread/condition_variable.h>
+#include <bthread/mutex.h>
+#include <butil/iobuf.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "ratelimit.pb.h"
+#include "service/limit_stream_frame.h"
+
+class RateLimitServiceImpl;
+
+// OpenLimitStream 建立的一个 stream。每个判断帧复用对象池中的 controller、
+// 请求和响应，经过与 CheckLimit 相同的判断路径，不需要解析 protobuf，
+// token 只在定义时传输一次。判断可能异步完成，结果按帧的接收顺序排队，
+// 连续完成的结果合并成一个消息写回；客户端读得慢时等待 stream 可写。
+// 未写回的判断达到 -stream_max_pending 时暂停读取新的帧，客户端的
+// stream 缓冲写满后 StreamWrite 返回 EAGAIN，压力传回调用方
+class LimitStream : public brpc::StreamInputHandler {
+public:
+    // 在 OpenLimitStream 中接受客户端创建的 stream，成功时返回 0。
+    // 对象在 stream 关闭并且所有判断都完成后自行删除
+    static int Accept(RateLimitServiceImpl* service, brpc::Controller* cntl,
+                      ::LimitStreamResponse* response);
+
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf* const messages[],
+                             size_t size) override;
+
+    void on_idle_timeout(brpc::StreamId id) override;
+
+    void on_closed(brpc::StreamId id) override;
+
+private:
+    class Call;
+
+    // 一个判断的结果，按序号排队等待写回
+    struct Pending {
+        bool done = false;
+        LimitStreamResult result;
+        std::string error_text;
+    };
+
+    explicit LimitStream(RateLimitServiceImpl* service);
+    ~LimitStream();
+
+    // 解析一个消息中的所有帧，格式错误时返回 false
+    bool handleMessage(butil::IOBuf* message);
+
+    void handleCheck(const LimitStreamFrame& frame);
+
+    // 为一个判断分配序号，未写回的判断过多时等待，stream 关闭时返回 false
+    bool reserve(uint64_t* seq);
+
+    void complete(uint64_t seq, const LimitStreamResult& result,
+                  std::string error_text);
+
+    // 直接回复失败，不经过判断路径
+    void fail(uint64_t seq, uint32_t token_id, int error_code,
+              const std::string& error_text);
+
+    // 写出已经按序完成的结果，调用时持有 _mutex
+    void flushLocked();
+
+    static void onWritable(brpc::StreamId id, void* arg, int error_code);
+
+    void unref();
+
+private:
+    RateLimitServiceImpl* _service;
+    brpc::StreamId _stream;
+    // stream 本身持有一个引用，每个在途的判断和等待可写各持有一个
+    std::atomic<int> _refs;
+
+    // 只在 on_received_messages 中访问，brpc 保证同一个 stream 的回调串行
+    std::vector<std::string> _tokens;
+
+    bthread::Mutex _mutex;
+    // 结果写出或者 stream 关闭时唤醒 reserve
+    bthread::ConditionVariable _cond;
+    std::deque<Pending> _pending;
+    // _pending 中第一个判断的序号
+    uint64_t _first_seq;
+    // 已经完成但没有写出的结果
+    butil::IOBuf _unsent;
+    size_t _unsent_count;
+    // 正在处理收到的消息，同步完成的结果在处理结束后一起写出
+    bool _receiving;
+    bool _waiting_writable;
+    bool _closed;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+// OpenLimitStream 建立的 brpc stream 上传输的二进制帧，各字段为小端字节序，
+// 一个 stream 消息中可以包含多个帧，但一个帧不能跨越消息。
+//
+// 客户端发送 LimitStreamFrame：先用 kStreamDefineToken 把 token 绑定到一个
+// 编号（帧后紧跟 token_size 字节的 token），之后的 kStreamCheck 和
+// kStreamRelease 只携带编号和 cost，每个 token 在一个 stream 上只发送一次。
+// 服务端按接收顺序对每个 kStreamCheck 和 kStreamRelease 回复一个
+// LimitStreamResult，kStreamDefineToken 没有回复
+enum LimitStreamFrameType : uint8_t {
+    kStreamDefineToken = 1,
+    kStreamCheck = 2,
+    kStreamRelease = 3,
+};
+
+// LimitStreamFrame::flags
+const uint8_t kStreamFlagDryRun = 1;
+
+struct LimitStreamFrame {
+    uint8_t type;
+    uint8_t flags;
+    // kStreamDefineToken 时为帧后 token 的长度，其余为 0
+    uint16_t token_size;
+    uint32_t token_id;
+    // 与 RateLimitRequest::cost 相同，小于等于 0 时按 1 处理，
+    // 超过 burst 时直接拒绝，retry_after_ms 为 -1
+    int64_t cost;
+};
+
+enum LimitStreamStatus : uint8_t {
+    kStreamAllowed = 0,
+    kStreamDenied = 1,
+    // 判断失败，remaining 为 brpc 错误码，帧后紧跟 error_size 字节的错误信息
+    kStreamFailed = 2,
+};
+
+struct LimitStreamResult {
+    uint8_t status;
+    uint8_t reserved;
+    uint16_t error_size;
+    uint32_t token_id;
+    int64_t remaining;
+    int64_t retry_after_ms;
+};
+
+static_assert(sizeof(LimitStreamFrame) == 16, "LimitStreamFrame is 16 bytes");
+static_assert(sizeof(LimitStreamResult) == 24,
+              "LimitStreamResult is 24 bytes");
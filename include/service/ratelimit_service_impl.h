@@ -5,12 +5,23 @@
 #include <brpc/redis.h>
 #include <gflags/gflags.h>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "conf/config_manager.h"
+#include "limiter/denied_cache.h"
+#include "limiter/hot_key_detector.h"
+#include "limiter/local_bucket_table.h"
 #include "ratelimit.pb.h"
+#include "service/lease_manager.h"
+#include "service/limit_metrics.h"
+#include "service/redis_shard_set.h"
 
 class RateLimitServiceImpl : public RateLimitService {
 public:
-    explicit RateLimitServiceImpl(const std::string& limit_script);
+    // script_dir 为各限流算法 lua 脚本所在的目录
+    explicit RateLimitServiceImpl(const std::string& script_dir);
     virtual ~RateLimitServiceImpl() = default;
 
     void CheckLimit(::google::protobuf::RpcController* controller,
@@ -18,19 +29,123 @@ public:
                     ::RateLimitResponse* response,
                     ::google::protobuf::Closure* done) override;
 
+    void CheckLimitBatch(::google::protobuf::RpcController* controller,
+                         const ::RateLimitBatchRequest* request,
+                         ::RateLimitBatchResponse* response,
+                         ::google::protobuf::Closure* done) override;
+
+    void ReleaseLimit(::google::protobuf::RpcController* controller,
+                      const ::RateLimitRequest* request,
+                      ::RateLimitResponse* response,
+                      ::google::protobuf::Closure* done) override;
+
+    // 接受客户端创建的 brpc stream，之后的判断都在 stream 上完成
+    void OpenLimitStream(::google::protobuf::RpcController* controller,
+                         const ::LimitStreamRequest* request,
+                         ::LimitStreamResponse* response,
+                         ::google::protobuf::Closure* done) override;
+
     std::string service_id() const { return _service_id; }
 
 private:
-    static void onRedisCallComplete(butil::Timer* timer,
-                                    brpc::Controller* redis_cntl,
-                                    brpc::RedisResponse* redis_response,
-                                    brpc::Controller* cntl,
-                                    ::RateLimitResponse* response,
-                                    ::google::protobuf::Closure* done);
+    struct BatchEntry {
+        int index;
+        const std::string* token;
+        TokenBucketConfig config;
+        int64_t cost;
+        bool dry_run;
+        // 限流组的各层，普通 token 为空
+        std::vector<LimitGroupMember> group;
+    };
+
+    // 一个 CheckLimitBatch 请求，按 token 所在的分片拆分成多个 pipeline
+    struct BatchCall {
+        butil::Timer timer;
+        std::atomic<int> pending{0};
+
+        ::RateLimitBatchResponse* response;
+        ::google::protobuf::Closure* done;
+    };
+
+    struct BatchShardCall {
+        BatchCall* batch;
+        RedisShard* shard;
+        // 分片过载，没有发送给 redis
+        bool shed = false;
+        butil::Timer timer;
+        brpc::RedisRequest redis_request;
+        brpc::Controller redis_cntl;
+        brpc::RedisResponse redis_response;
+        std::vector<BatchEntry> entries;
+    };
+
+    std::string loadLuaScript(const std::string& path);
+
+    const std::string& scriptSha1(LimitAlgorithm algorithm) const {
+        return _lua_script_sha1[static_cast<size_t>(algorithm)];
+    }
+
+    // cost 小于 0 表示释放并发计数
+    bool degrade(const std::string& token, const TokenBucketConfig& config,
+                 int64_t cost, bool dry_run, LimitDecision* decision);
+
+    // 限流组的降级，本地限流时同样先判断所有层再一起扣减
+    bool degradeGroup(const std::vector<LimitGroupMember>& group,
+                      const TokenBucketConfig& config, int64_t cost,
+                      bool dry_run, LimitDecision* decision);
+
+    // 检查限流组的各层能否在一次脚本调用中完成，返回所在的分片，
+    // 失败时设置 error_text 并返回 nullptr
+    RedisShard* routeLimitGroup(const std::string& token,
+                                const std::vector<LimitGroupMember>& group,
+                                std::string* error_text) const;
+
+    // 内存后端在本进程内完成判断，限流组配置无效时设置 error_text 并
+    // 返回 false
+    bool checkInMemory(const std::string& token,
+                       const TokenBucketConfig& config, int64_t cost,
+                       bool dry_run, LimitDecision* decision,
+                       std::string* error_text);
+
+    // redis 分片熔断或者过载（overloaded）时按降级策略在本地判断，
+    // 无法降级时设置 cntl。group 为限流组的各层，普通 token 为 nullptr
+    void shed(const std::string& token, const TokenBucketConfig& config,
+              const std::vector<LimitGroupMember>* group, int64_t cost,
+              bool dry_run, bool overloaded, brpc::Controller* cntl,
+              ::RateLimitResponse* response);
+
+    void checkLimitGroup(const std::string& token,
+                         const TokenBucketConfig& config, int64_t cost,
+                         bool dry_run, brpc::Controller* cntl,
+                         ::RateLimitResponse* response,
+                         ::google::protobuf::Closure* done);
+
+    void onRedisBatchCallComplete(BatchShardCall* shard_call);
+
+    // 写入判断结果并计入 token 维度的通过/拒绝计数
+    void finishDecision(const std::string& token,
+                        const LimitDecision& decision,
+                        ::RateLimitResponse* response);
+
+    // 热点 token 自动切换到租约模式，由本地按预留的份额判断，
+    // 避免单个 redis key 被打满
+    void applyHotKey(const std::string& token, TokenBucketConfig* config);
+
+    friend class CheckLimitCall;
 
 private:
-    brpc::Channel _redis_channel;
-    std::string _lua_script_sha1;
+    RedisShardSet _redis_shards;
+    LeaseManager _lease_manager;
+    std::string _lua_script_sha1[kLimitAlgorithmCount];
+    std::string _group_script_sha1;
+    // -redis_state_encoding=packed，令牌桶的状态在 redis 中为一个字符串
+    bool _packed_state = false;
     std::string _service_id;
     ConfigManager _conf_manager;
-};
\ No newline at end of file
+    LocalBucketTable _local_buckets;
+    // -limit_backend=memory 时所有 token 的限流状态，此时不连接 redis
+    std::unique_ptr<LocalBucketTable> _memory_buckets;
+    HotKeyDetector _hot_keys;
+    DeniedCache _denied_cache;
+    LimitMetrics _metrics;
+};
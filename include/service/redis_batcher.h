@@ -0,0 +1,64 @@
+#pragma once
+
+#include <brpc/channel.h>
+#include <brpc/redis.h>
+#include <bthread/condition_variable.h>
+#include <bthread/mutex.h>
+#include <bthread/unstable.h>
+
+#include <vector>
+
+// 把一个时间窗口内到达的 redis 命令合并成一个 pipeline 发送
+class RedisBatcher {
+public:
+    class Call {
+    public:
+        virtual ~Call() = default;
+
+        virtual void AppendCommand(brpc::RedisRequest* request) = 0;
+
+        // redis 调用失败或者 reply 缺失时 reply 为 nullptr
+        virtual void OnReply(brpc::Controller* redis_cntl,
+                             const brpc::RedisReply* reply) = 0;
+
+    private:
+        friend class RedisBatcher;
+        int64_t _enqueue_us = 0;
+    };
+
+    RedisBatcher(brpc::Channel* channel, int64_t window_us,
+                 size_t max_batch_size);
+    // 等待已经触发的定时器发送完毕，再发送剩余的命令
+    ~RedisBatcher();
+
+    void Submit(Call* call);
+
+private:
+    using CallList = std::vector<Call*>;
+
+    static void onTimer(void* arg);
+
+    static void* runFlush(void* arg);
+
+    void flush();
+
+    void send(CallList* calls);
+
+    static void onBatchComplete(brpc::Controller* redis_cntl,
+                                brpc::RedisResponse* redis_response,
+                                CallList* calls);
+
+private:
+    brpc::Channel* _channel;
+    int64_t _window_us;
+    size_t _max_batch_size;
+
+    bthread::Mutex _mutex;
+    CallList _pending;
+    // 定时器已经添加，到期后的 runFlush 还没有开始
+    bool _timer_armed;
+    bthread_timer_t _timer;
+    // 正在执行的 runFlush 数，析构时等待归零
+    int _running_flushes;
+    bthread::ConditionVariable _flush_done;
+};
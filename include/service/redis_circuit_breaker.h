@@ -0,0 +1,47 @@
+#pragma once
+
+#include <brpc/channel.h>
+#include <bvar/bvar.h>
+
+#include <atomic>
+#include <string>
+
+#include "limiter/periodic_task.h"
+
+// 统计 redis 调用的错误率和慢调用比例，超过阈值后熔断，
+// 熔断期间在后台定时 PING redis，探测成功后恢复
+class RedisCircuitBreaker {
+public:
+    // name 为导出熔断状态的 bvar 名称
+    RedisCircuitBreaker(brpc::Channel* channel, const std::string& name);
+    ~RedisCircuitBreaker();
+
+    bool IsOpen() const { return _open.load(std::memory_order_relaxed); }
+
+    void OnCallEnd(bool failed, int64_t latency_us);
+
+private:
+    void trip();
+
+    void resetWindow(int64_t now_us);
+
+    static int getOpenStatus(void* arg);
+
+    // 探测成功时关闭熔断并返回 false，结束探测
+    bool probeOnce();
+
+    bool probe();
+
+private:
+    brpc::Channel* _channel;
+    std::atomic<bool> _open;
+
+    std::atomic<int64_t> _window_start_us;
+    std::atomic<int64_t> _calls;
+    std::atomic<int64_t> _errors;
+    std::atomic<int64_t> _slow_calls;
+
+    bvar::PassiveStatus<int> _open_status;
+    // 析构时先停止，等待正在进行的探测结束
+    PeriodicTask _probe_task;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <bvar/bvar.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// 按 redis 调用耗时自适应调整的并发上限（gradient 算法）。
+// 每个采样窗口结束时用无负载耗时与窗口平均耗时之比缩小上限，再加上
+// sqrt(上限) 的排队余量，redis 变慢时上限随之下降，恢复后逐步回升；
+// 调用失败时按比例退让。在途调用达到上限后新的请求不再发往 redis
+class RedisConcurrencyLimiter {
+public:
+    // name 为导出指标的 bvar 名称前缀
+    explicit RedisConcurrencyLimiter(const std::string& name);
+    ~RedisConcurrencyLimiter() = default;
+
+    // 占用 n 个并发，超过上限时返回 false。没有在途调用时总是成功，
+    // 避免命令数多于上限的 pipeline 永远无法发送
+    bool TryAcquire(int64_t n);
+
+    // 归还 TryAcquire 成功时占用的并发
+    void Release(int64_t n);
+
+    // 每次调用 redis 结束后调用，包括不经过准入控制的调用
+    void OnCallEnd(bool failed, int64_t latency_us);
+
+    int64_t limit() const { return _limit.load(std::memory_order_relaxed); }
+
+    int64_t inflight() const {
+        return _inflight.load(std::memory_order_relaxed);
+    }
+
+private:
+    void updateLimit();
+
+    static int64_t getLimit(void* arg);
+
+    static int64_t getInflight(void* arg);
+
+private:
+    std::atomic<int64_t> _limit;
+    std::atomic<int64_t> _inflight;
+
+    // 当前采样窗口的统计
+    std::atomic<int64_t> _window_start_us;
+    std::atomic<int64_t> _samples;
+    std::atomic<int64_t> _latency_sum_us;
+    std::atomic<int64_t> _failures;
+    std::atomic<int64_t> _max_inflight;
+
+    // 只在窗口结束时由一个线程更新
+    double _estimated_limit;
+    double _noload_latency_us;
+
+    bvar::PassiveStatus<int64_t> _limit_status;
+    bvar::PassiveStatus<int64_t> _inflight_status;
+    bvar::Adder<int64_t> _shed;
+};
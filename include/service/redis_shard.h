@@ -0,0 +1,95 @@
+#pragma once
+
+#include <brpc/channel.h>
+#include <brpc/redis.h>
+#include <bvar/bvar.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "service/redis_batcher.h"
+#include "service/redis_circuit_breaker.h"
+#include "service/redis_concurrency_limiter.h"
+
+// 一个 redis 分片，拥有独立的 channel、熔断器、自适应并发上限、批量发送器
+// 和监控指标。按 -redis_connection_type 可以使用一个多路复用的连接、brpc
+// 连接池，或者每个工作线程固定使用 -redis_connections 个连接中的一个
+class RedisShard {
+public:
+    RedisShard(size_t index, const std::string& address);
+    ~RedisShard();
+
+    // 初始化 channel 并完成认证，失败时返回 false
+    bool Init();
+
+    // 同步加载脚本，收到 NOSCRIPT 错误时会重新加载所有已加载过的脚本
+    bool LoadScript(const std::string& script, std::string* sha1);
+
+    bool IsOpen() const { return _breaker.IsOpen(); }
+
+    // 每次调用 redis 结束后调用，更新熔断器、并发上限和分片的监控指标
+    void OnCallEnd(bool failed, int64_t latency_us);
+
+    // 发送 n 条判断命令之前占用并发，返回 false 时分片过载，
+    // 请求应当降级或者直接失败
+    bool TryAcquire(int64_t n) { return _concurrency.TryAcquire(n); }
+
+    // 占用并发的调用结束后归还
+    void Release(int64_t n) { _concurrency.Release(n); }
+
+    // redis 返回错误时调用，NOSCRIPT 时在后台重新加载脚本
+    void OnReplyError(const brpc::RedisReply& reply);
+
+    size_t index() const { return _index; }
+    const std::string& address() const { return _address; }
+    // 当前线程使用的连接
+    brpc::Channel* channel() { return _channels[connectionIndex()]; }
+
+    // 当前线程使用的连接上的批量发送器，没有开启 -redis_batch_enabled 时
+    // 返回 nullptr
+    RedisBatcher* batcher() {
+        return _batchers.empty() ? nullptr
+                                 : _batchers[connectionIndex()].get();
+    }
+
+    // 按 -redis_* 参数初始化到 address 的 channel，并完成认证。
+    // connection_group 不同的 channel 不共享连接
+    static bool InitChannel(brpc::Channel* channel, const std::string& address,
+                            const std::string& connection_group = "");
+
+private:
+    size_t connectionIndex() const {
+        return _channels.size() == 1 ? 0 : workerIndex() % _channels.size();
+    }
+
+    // 当前工作线程的编号，第一次调用时分配
+    static size_t workerIndex();
+
+    static void* runReloadScripts(void* arg);
+
+    void reloadScripts();
+
+private:
+    size_t _index;
+    std::string _address;
+    // 第一个连接，熔断探测和脚本加载也使用它
+    brpc::Channel _channel;
+    // per_worker 模式下其余的连接
+    std::vector<std::unique_ptr<brpc::Channel>> _extra_channels;
+    // 只在 Init 中写入
+    std::vector<brpc::Channel*> _channels;
+    RedisCircuitBreaker _breaker;
+    RedisConcurrencyLimiter _concurrency;
+    // 每个连接一个
+    std::vector<std::unique_ptr<RedisBatcher>> _batchers;
+
+    // 只在启动时写入
+    std::vector<std::string> _scripts;
+    std::atomic<bool> _reloading;
+
+    bvar::LatencyRecorder _latency;
+    bvar::Adder<int64_t> _errors;
+    bvar::Adder<int64_t> _script_reloads;
+};
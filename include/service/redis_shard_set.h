@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "service/redis_shard.h"
+
+// 所有 redis 分片，按 token 把请求路由到分片。普通模式下使用带虚拟节点的
+// 一致性哈希环，增减分片时只有少量 token 迁移；集群模式下按 Redis Cluster
+// 的规则计算 token 的槽位，并通过 CLUSTER SLOTS 获取槽位所在的主节点
+class RedisShardSet {
+public:
+    RedisShardSet() = default;
+    ~RedisShardSet() = default;
+
+    // addresses 为逗号分隔的分片地址，集群模式下为任意一个种子节点，
+    // 失败时抛出异常
+    void Init(const std::string& addresses, bool cluster);
+
+    RedisShard* Route(std::string_view token) const;
+
+    size_t size() const { return _shards.size(); }
+    bool cluster() const { return !_slot_owners.empty(); }
+    RedisShard* shard(size_t index) const { return _shards[index].get(); }
+
+    // 在所有分片上加载脚本，所有分片返回的 sha1 相同
+    bool LoadScript(const std::string& script, std::string* sha1);
+
+    // 返回 key 中参与路由的部分，即 {hash tag} 中的内容，没有则为整个 key。
+    // 两种模式下 hash tag 相同的 token 都路由到同一个分片
+    static std::string_view HashTag(std::string_view key);
+
+    // Redis Cluster 的槽位算法，支持 {hash tag}
+    static uint16_t ClusterSlot(std::string_view key);
+
+private:
+    static constexpr size_t kClusterSlots = 16384;
+    static constexpr int kVirtualNodes = 160;
+
+    void addShard(const std::string& address);
+
+    void buildRing();
+
+    void discoverCluster(const std::string& seed);
+
+private:
+    std::vector<std::unique_ptr<RedisShard>> _shards;
+    // 哈希环，按哈希值排序的 (哈希值, 分片下标)
+    std::vector<std::pair<uint32_t, uint32_t>> _ring;
+    // 集群模式下每个槽位所在的分片下标
+    std::vector<uint16_t> _slot_owners;
+};
@@ -1,11 +1,29 @@
 #include <brpc/server.h>
 #include <gflags/gflags.h>
 
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include "service/healthcheck_service_impl.h"
 #include "service/ratelimit_service_impl.h"
 
 DEFINE_int32(port, 50051, "RateLimit service port");
 DEFINE_int32(num_threads, 1, "Overall number of threads for the server");
+DEFINE_int32(server_shards, 1,
+             "Number of server processes sharing the port via SO_REUSEPORT, "
+             "each with -num_threads threads. Local-mode and memory-backend "
+             "limits are enforced by each process separately");
+DEFINE_bool(pin_server_shards, true,
+            "Pin each server shard to its own subset of cpu cores");
 DEFINE_string(consul_health_check_path, "/healthcheck",
               "Consul health check path");
 
@@ -19,15 +37,30 @@ DECLARE_string(consul_agent_addr);
 
 static bool RegisterToConsul(const std::string& service_id);
 static void DeregisterFromConsul(const std::string& service_id);
+static int StartServerShards(std::vector<pid_t>* children);
+static void WatchServerShards();
+static void StopServerShards(const std::vector<pid_t>& children);
 
-int main(int argc, char* argv[]) {
-    gflags::ParseCommandLineFlags(&argc, &argv, true);
+// 主动停止分片之后，分片退出不再视为异常
+static std::atomic<bool> g_stopping_shards(false);
+static std::atomic<bool> g_shard_exited(false);
 
+int main(int argc, char* argv[]) {
+    // 命令行参数覆盖配置文件中的同名参数
     if (!gflags::ReadFromFlagsFile("../conf/gflags.conf", argv[0], true)) {
         LOG(ERROR) << "Failed to read gflags from file";
         return -1;
     }
 
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    // 在创建任何线程之前 fork 出其余的分片，返回值为本进程的分片编号
+    std::vector<pid_t> children;
+    const int shard_index = StartServerShards(&children);
+    if (shard_index < 0) {
+        return -1;
+    }
+
     brpc::Server server;
 
     HealthCheckServiceImpl health_check_service;
@@ -38,7 +71,7 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    RateLimitServiceImpl rate_limit_service("../conf/ratelimit.lua");
+    RateLimitServiceImpl rate_limit_service("../conf");
     if (server.AddService(&rate_limit_service,
                           brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
         LOG(ERROR) << "Failed to add RateLimit service";
@@ -47,20 +80,129 @@ int main(int argc, char* argv[]) {
 
     brpc::ServerOptions options;
     options.num_threads = FLAGS_num_threads;
+    options.reuse_port = FLAGS_server_shards > 1;
     if (server.Start(FLAGS_port, &options) != 0) {
         LOG(ERROR) << "Failed to start server";
+        StopServerShards(children);
         return -1;
     }
 
-    RegisterToConsul(rate_limit_service.service_id());
+    std::thread shard_watcher;
+    if (!children.empty()) {
+        shard_watcher = std::thread(WatchServerShards);
+    }
+
+    // 所有分片监听同一个端口，只由第一个分片注册
+    if (shard_index == 0) {
+        RegisterToConsul(rate_limit_service.service_id());
+    }
 
     server.RunUntilAskedToQuit();
 
-    DeregisterFromConsul(rate_limit_service.service_id());
+    if (shard_index == 0) {
+        DeregisterFromConsul(rate_limit_service.service_id());
+        StopServerShards(children);
+    }
+    if (shard_watcher.joinable()) {
+        shard_watcher.join();
+    }
+
+    return g_shard_exited.load() ? -1 : 0;
+}
+
+// 把第 index 个分片绑定到 cpu 核心中属于它的一段
+static void PinServerShard(int index) {
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0) {
+        return;
+    }
+    const long per_shard = std::max(cores / FLAGS_server_shards, 1L);
+    const long first = index * per_shard % cores;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (long i = first; i < first + per_shard && i < cores; ++i) {
+        CPU_SET(i, &cpus);
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        PLOG(WARNING) << "Failed to pin server shard " << index;
+        return;
+    }
+    LOG(INFO) << "Server shard " << index << " pinned to cpu " << first
+              << "-" << first + per_shard - 1;
+}
+
+int StartServerShards(std::vector<pid_t>* children) {
+    if (FLAGS_server_shards <= 1) {
+        return 0;
+    }
 
+    const pid_t parent = getpid();
+    for (int i = 1; i < FLAGS_server_shards; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            PLOG(ERROR) << "Failed to fork server shard " << i;
+            StopServerShards(*children);
+            return -1;
+        }
+        if (pid == 0) {
+            // 第一个分片退出时其余分片一起退出
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent) {
+                _exit(0);
+            }
+            if (FLAGS_pin_server_shards) {
+                PinServerShard(i);
+            }
+            return i;
+        }
+        children->push_back(pid);
+    }
+
+    if (FLAGS_pin_server_shards) {
+        PinServerShard(0);
+    }
     return 0;
 }
 
+// 回收退出的分片。任何一个分片退出（例如初始化失败）时记录原因，
+// 并让第一个分片退出，其余分片随之退出，由外部统一重启
+void WatchServerShards() {
+    while (true) {
+        int status = 0;
+        const pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // 所有分片都已回收
+            return;
+        }
+        if (g_stopping_shards.load()) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            LOG(ERROR) << "Server shard process " << pid
+                       << " killed by signal " << WTERMSIG(status);
+        } else {
+            LOG(ERROR) << "Server shard process " << pid
+                       << " exited with status " << WEXITSTATUS(status);
+        }
+        g_shard_exited.store(true);
+        brpc::AskToQuit();
+    }
+}
+
+void StopServerShards(const std::vector<pid_t>& children) {
+    g_stopping_shards.store(true);
+    for (pid_t pid : children) {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : children) {
+        waitpid(pid, nullptr, 0);
+    }
+}
+
 bool RegisterToConsul(const std::string& service_id) {
     brpc::Channel consul_channel;
     brpc::ChannelOptions options;
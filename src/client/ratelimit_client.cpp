@@ -0,0 +1,355 @@
+#include "client/ratelimit_client.h"
+
+#include <brpc/callback.h>
+#include <bthread/bthread.h>
+#include <bthread/countdown_event.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+// 直接映射的定长表，冲突时覆盖旧的 token
+class RateLimitClient::DeniedCache {
+public:
+    DeniedCache(size_t capacity, int64_t max_ms) : _max_ms(max_ms) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        _slots.resize(size);
+        _mask = size - 1;
+    }
+
+    bool Lookup(const std::string& token, int64_t cost, Result* result) {
+        const size_t index = std::hash<std::string>()(token) & _mask;
+        std::lock_guard<std::mutex> lock(_locks[index % kLockCount]);
+        const Slot& slot = _slots[index];
+        const int64_t now_ms = butil::monotonic_time_ms();
+        if (slot.token != token || now_ms >= slot.until_ms ||
+            cost < slot.cost) {
+            return false;
+        }
+
+        result->ok = true;
+        result->allowed = false;
+        result->remaining = 0;
+        result->retry_after_ms = slot.until_ms - now_ms;
+        result->cached = true;
+        return true;
+    }
+
+    // retry_after_ms 不大于 0 时无法预知什么时候能通过，不缓存
+    void Insert(const std::string& token, int64_t cost,
+                int64_t retry_after_ms) {
+        const int64_t ttl_ms = std::min(retry_after_ms, _max_ms);
+        if (ttl_ms <= 0) {
+            return;
+        }
+
+        const size_t index = std::hash<std::string>()(token) & _mask;
+        std::lock_guard<std::mutex> lock(_locks[index % kLockCount]);
+        Slot& slot = _slots[index];
+        slot.token = token;
+        slot.cost = cost;
+        slot.until_ms = butil::monotonic_time_ms() + ttl_ms;
+    }
+
+private:
+    static constexpr size_t kLockCount = 64;
+
+    struct Slot {
+        std::string token;
+        int64_t cost = 0;
+        int64_t until_ms = 0;
+    };
+
+    std::vector<Slot> _slots;
+    size_t _mask;
+    int64_t _max_ms;
+    std::mutex _locks[kLockCount];
+};
+
+static std::string coalesceKey(const std::string& token, int64_t cost,
+                               bool dry_run) {
+    std::string key = token;
+    key.push_back('\0');
+    key.append(std::to_string(cost));
+    key.push_back(dry_run ? '1' : '0');
+    return key;
+}
+
+// 合并的扣减一次扣减所有请求的 cost，试算只需要判断一次
+int64_t RateLimitClient::requestCost(const Check& check) {
+    return check.dry_run
+               ? check.cost
+               : check.cost * static_cast<int64_t>(check.callbacks.size());
+}
+
+RateLimitClient::RateLimitClient() : RateLimitClient(Options()) {}
+
+RateLimitClient::RateLimitClient(const Options& options)
+    : _options(options),
+      _stopping(false),
+      _timer_armed(false),
+      _timer(0),
+      _inflight(0) {
+    _options.max_batch_size = std::max<size_t>(_options.max_batch_size, 1);
+    if (_options.denied_cache_capacity > 0) {
+        _denied.reset(new DeniedCache(_options.denied_cache_capacity,
+                                      _options.denied_cache_max_ms));
+    }
+}
+
+RateLimitClient::~RateLimitClient() {
+    {
+        std::unique_lock<bthread::Mutex> lock(_mutex);
+        // 之后拆开重新判断的请求直接发送，不再启动定时器
+        _stopping = true;
+        if (_timer_armed && bthread_timer_del(_timer) == 0) {
+            _timer_armed = false;
+            _inflight.fetch_sub(1, std::memory_order_release);
+        }
+    }
+    flush();
+
+    while (_inflight.load(std::memory_order_acquire) > 0) {
+        bthread_usleep(1000);
+    }
+}
+
+int RateLimitClient::Init(const std::string& server,
+                          const std::string& load_balancer,
+                          const brpc::ChannelOptions* channel_options) {
+    if (_channel.Init(server.c_str(), load_balancer.c_str(),
+                      channel_options) != 0) {
+        LOG(ERROR) << "Fail to initialize channel to " << server;
+        return -1;
+    }
+    _stub.reset(new RateLimitService_Stub(&_channel));
+    return 0;
+}
+
+void RateLimitClient::CheckLimit(const std::string& token, int64_t cost,
+                                 bool dry_run, Callback callback) {
+    cost = std::max<int64_t>(cost, 1);
+
+    Result cached;
+    if (_denied && _denied->Lookup(token, cost, &cached)) {
+        callback(cached);
+        return;
+    }
+
+    Check check{token, cost, dry_run, true, {}};
+    check.callbacks.push_back(std::move(callback));
+    submit(std::move(check));
+}
+
+RateLimitClient::Result RateLimitClient::CheckLimit(const std::string& token,
+                                                    int64_t cost,
+                                                    bool dry_run) {
+    Result result;
+    bthread::CountdownEvent event(1);
+    CheckLimit(token, cost, dry_run, [&result, &event](const Result& r) {
+        result = r;
+        event.signal();
+    });
+    event.wait();
+    return result;
+}
+
+void RateLimitClient::ReleaseLimit(const std::string& token, int64_t cost,
+                                   Callback callback) {
+    Batch* batch = new Batch;
+    batch->request.set_token(token);
+    batch->request.set_cost(std::max<int64_t>(cost, 1));
+    batch->checks.push_back(Check{token, cost, false, false, {}});
+    batch->checks.back().callbacks.push_back(std::move(callback));
+
+    _inflight.fetch_add(1, std::memory_order_relaxed);
+    _stub->ReleaseLimit(&batch->cntl, &batch->request, &batch->response,
+                        brpc::NewCallback(this, &RateLimitClient::onBatchDone,
+                                          batch));
+}
+
+void RateLimitClient::submit(Check&& check) {
+    std::vector<Check> ready;
+    {
+        std::unique_lock<bthread::Mutex> lock(_mutex);
+        if (_options.coalesce && check.coalescable) {
+            std::string key =
+                coalesceKey(check.token, check.cost, check.dry_run);
+            auto it = _pending_index.find(key);
+            if (it != _pending_index.end()) {
+                auto& callbacks = _pending[it->second].callbacks;
+                for (auto& callback : check.callbacks) {
+                    callbacks.push_back(std::move(callback));
+                }
+                return;
+            }
+            _pending_index.emplace(std::move(key), _pending.size());
+        }
+        _pending.push_back(std::move(check));
+
+        if (_pending.size() >= _options.max_batch_size ||
+            _options.batch_window_us <= 0 || _stopping) {
+            ready.swap(_pending);
+            _pending_index.clear();
+            if (_timer_armed && bthread_timer_del(_timer) == 0) {
+                _timer_armed = false;
+                _inflight.fetch_sub(1, std::memory_order_release);
+            }
+        } else if (!_timer_armed) {
+            // 启动的定时器算作在途，析构时等待它的回调结束
+            _inflight.fetch_add(1, std::memory_order_relaxed);
+            if (bthread_timer_add(
+                    &_timer, butil::microseconds_from_now(
+                                 _options.batch_window_us),
+                    onTimer, this) == 0) {
+                _timer_armed = true;
+            } else {
+                _inflight.fetch_sub(1, std::memory_order_release);
+                ready.swap(_pending);
+                _pending_index.clear();
+            }
+        }
+    }
+
+    if (!ready.empty()) {
+        send(std::move(ready));
+    }
+}
+
+void RateLimitClient::onTimer(void* arg) {
+    // 定时器线程中不能做耗时操作，交给 bthread 发送
+    bthread_t tid;
+    if (bthread_start_background(&tid, nullptr, runFlush, arg) != 0) {
+        runFlush(arg);
+    }
+}
+
+void* RateLimitClient::runFlush(void* arg) {
+    RateLimitClient* client = static_cast<RateLimitClient*>(arg);
+    {
+        std::unique_lock<bthread::Mutex> lock(client->_mutex);
+        client->_timer_armed = false;
+    }
+    client->flush();
+    client->_inflight.fetch_sub(1, std::memory_order_release);
+    return nullptr;
+}
+
+void RateLimitClient::flush() {
+    std::vector<Check> ready;
+    {
+        std::unique_lock<bthread::Mutex> lock(_mutex);
+        ready.swap(_pending);
+        _pending_index.clear();
+    }
+
+    if (!ready.empty()) {
+        send(std::move(ready));
+    }
+}
+
+void RateLimitClient::send(std::vector<Check>&& checks) {
+    Batch* batch = new Batch;
+    batch->checks = std::move(checks);
+    _inflight.fetch_add(1, std::memory_order_relaxed);
+    auto done = brpc::NewCallback(this, &RateLimitClient::onBatchDone, batch);
+
+    if (batch->checks.size() == 1) {
+        const Check& check = batch->checks[0];
+        batch->request.set_token(check.token);
+        batch->request.set_cost(requestCost(check));
+        batch->request.set_dry_run(check.dry_run);
+        _stub->CheckLimit(&batch->cntl, &batch->request, &batch->response,
+                          done);
+        return;
+    }
+
+    for (const Check& check : batch->checks) {
+        RateLimitRequest* item = batch->batch_request.add_requests();
+        item->set_token(check.token);
+        item->set_cost(requestCost(check));
+        item->set_dry_run(check.dry_run);
+    }
+    _stub->CheckLimitBatch(&batch->cntl, &batch->batch_request,
+                           &batch->batch_response, done);
+}
+
+void RateLimitClient::onBatchDone(Batch* batch) {
+    std::unique_ptr<Batch> batch_guard(batch);
+    std::vector<Check>& checks = batch->checks;
+
+    std::string error_text;
+    if (batch->cntl.Failed()) {
+        error_text = batch->cntl.ErrorText();
+    } else if (checks.size() > 1 &&
+               batch->batch_response.responses_size() !=
+                   static_cast<int>(checks.size())) {
+        error_text = "Invalid batch response from ratelimit service";
+    }
+
+    if (error_text.empty()) {
+        for (size_t i = 0; i < checks.size(); ++i) {
+            finish(std::move(checks[i]),
+                   checks.size() == 1 ? batch->response
+                                      : batch->batch_response.responses(i));
+        }
+    } else {
+        Result result;
+        result.error_text = error_text;
+        for (const Check& check : checks) {
+            for (const Callback& callback : check.callbacks) {
+                callback(result);
+            }
+        }
+    }
+
+    _inflight.fetch_sub(1, std::memory_order_release);
+}
+
+void RateLimitClient::finish(Check&& check,
+                             const RateLimitResponse& response) {
+    // 批量中的单项判断失败，例如 token 没有配置
+    if (response.error_code() != 0) {
+        Result result;
+        result.error_text = response.error_text();
+        for (const Callback& callback : check.callbacks) {
+            callback(result);
+        }
+        return;
+    }
+
+    // 合并的扣减被拒绝，但剩余配额还够部分请求通过，或者合计的 cost 超过
+    // 容量而永远不能通过（单个请求并没有要求这么多），拆开逐个判断
+    if (!response.allowed() && !check.dry_run &&
+        check.callbacks.size() > 1 &&
+        (response.remaining() >= check.cost ||
+         response.retry_after_ms() < 0)) {
+        for (Callback& callback : check.callbacks) {
+            Check single{check.token, check.cost, false, false, {}};
+            single.callbacks.push_back(std::move(callback));
+            submit(std::move(single));
+        }
+        return;
+    }
+
+    Result result;
+    result.ok = true;
+    result.allowed = response.allowed();
+    result.remaining = response.remaining();
+    result.retry_after_ms = response.retry_after_ms();
+    // 等待时间是服务端按请求中的 cost 算出的，合并的扣减按合计的 cost 缓存，
+    // 不会让之后单个请求的判断等待过久
+    if (!result.allowed && _denied) {
+        _denied->Insert(check.token, requestCost(check),
+                        result.retry_after_ms);
+    }
+
+    for (const Callback& callback : check.callbacks) {
+        callback(result);
+    }
+}
@@ -0,0 +1,220 @@
+#include "client/ratelimit_stream.h"
+
+#include <butil/logging.h>
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "service/limit_stream_frame.h"
+
+static RateLimitStream::Result failure(const std::string& error_text) {
+    RateLimitStream::Result result;
+    result.error_text = error_text;
+    return result;
+}
+
+RateLimitStream::RateLimitStream()
+    : _stream(brpc::INVALID_STREAM_ID),
+      _stream_created(false),
+      _max_tokens(0),
+      _closed(true),
+      _closed_event(1) {}
+
+RateLimitStream::~RateLimitStream() {
+    if (_stream_created) {
+        brpc::StreamClose(_stream);
+        _closed_event.wait();
+    }
+}
+
+int RateLimitStream::Init(const std::string& server,
+                          const std::string& load_balancer,
+                          const brpc::ChannelOptions* channel_options) {
+    if (_channel.Init(server.c_str(), load_balancer.c_str(),
+                      channel_options) != 0) {
+        LOG(ERROR) << "Fail to initialize channel to " << server;
+        return -1;
+    }
+
+    brpc::Controller cntl;
+    brpc::StreamOptions options;
+    options.handler = this;
+    if (brpc::StreamCreate(&_stream, cntl, &options) != 0) {
+        LOG(ERROR) << "Fail to create limit stream";
+        return -1;
+    }
+    _stream_created = true;
+
+    LimitStreamRequest request;
+    LimitStreamResponse response;
+    RateLimitService_Stub stub(&_channel);
+    stub.OpenLimitStream(&cntl, &request, &response, nullptr);
+    if (cntl.Failed()) {
+        LOG(ERROR) << "Fail to open limit stream: " << cntl.ErrorText();
+        return -1;
+    }
+
+    std::lock_guard<bthread::Mutex> lock(_mutex);
+    _max_tokens = std::max(response.max_tokens(), 0);
+    _closed = false;
+    return 0;
+}
+
+void RateLimitStream::CheckLimit(const std::string& token, int64_t cost,
+                                 bool dry_run, Callback callback) {
+    send(kStreamCheck, token, cost, dry_run, std::move(callback));
+}
+
+RateLimitStream::Result RateLimitStream::CheckLimit(const std::string& token,
+                                                    int64_t cost,
+                                                    bool dry_run) {
+    Result result;
+    bthread::CountdownEvent event(1);
+    CheckLimit(token, cost, dry_run, [&result, &event](const Result& r) {
+        result = r;
+        event.signal();
+    });
+    event.wait();
+    return result;
+}
+
+void RateLimitStream::ReleaseLimit(const std::string& token, int64_t cost,
+                                   Callback callback) {
+    send(kStreamRelease, token, cost, false, std::move(callback));
+}
+
+RateLimitStream::TokenIndex::iterator RateLimitStream::defineToken(
+    const std::string& token, butil::IOBuf* message) {
+    uint32_t token_id = 0;
+    if (!_free_token_ids.empty()) {
+        token_id = _free_token_ids.back();
+        _free_token_ids.pop_back();
+    } else if (_token_ids.size() < _max_tokens) {
+        // 没有撤销过的编号时，已经分配的编号正好是 0 到 size - 1
+        token_id = _token_ids.size();
+    } else {
+        token_id = _token_lru.back().second;
+        _token_ids.erase(_token_lru.back().first);
+        _token_lru.pop_back();
+    }
+
+    _token_lru.emplace_front(token, token_id);
+    auto it = _token_ids.emplace(token, _token_lru.begin()).first;
+
+    LimitStreamFrame define = {};
+    define.type = kStreamDefineToken;
+    define.token_size = token.size();
+    define.token_id = token_id;
+    message->append(&define, sizeof(define));
+    message->append(token);
+    return it;
+}
+
+void RateLimitStream::send(uint8_t type, const std::string& token,
+                           int64_t cost, bool dry_run, Callback&& callback) {
+    std::string error_text;
+    {
+        // 持有锁写入 stream，帧的顺序与 _callbacks 的顺序一致
+        std::lock_guard<bthread::Mutex> lock(_mutex);
+        if (_closed) {
+            error_text = "Limit stream is closed";
+        } else {
+            butil::IOBuf message;
+            bool defined = false;
+            auto it = _token_ids.find(token);
+            if (it != _token_ids.end()) {
+                _token_lru.splice(_token_lru.begin(), _token_lru, it->second);
+            } else if (_max_tokens > 0 && token.size() <= UINT16_MAX) {
+                it = defineToken(token, &message);
+                defined = true;
+            }
+
+            if (it == _token_ids.end()) {
+                error_text = "Token can not be sent on limit stream";
+            } else {
+                LimitStreamFrame frame = {};
+                frame.type = type;
+                frame.flags = dry_run ? kStreamFlagDryRun : 0;
+                frame.token_id = it->second->second;
+                frame.cost = cost;
+                message.append(&frame, sizeof(frame));
+
+                const int rc = brpc::StreamWrite(_stream, message);
+                if (rc == 0) {
+                    _callbacks.push_back(std::move(callback));
+                    return;
+                }
+                if (defined) {
+                    // 服务端没有收到定义，编号上仍是被淘汰的 token 或者
+                    // 没有定义，留给之后的 token 使用
+                    _free_token_ids.push_back(it->second->second);
+                    _token_lru.erase(it->second);
+                    _token_ids.erase(it);
+                }
+                error_text = rc == EAGAIN ? "Limit stream is full"
+                                          : "Fail to write limit stream";
+            }
+        }
+    }
+    callback(failure(error_text));
+}
+
+int RateLimitStream::on_received_messages(brpc::StreamId id,
+                                          butil::IOBuf* const messages[],
+                                          size_t size) {
+    std::vector<std::pair<Callback, Result>> finished;
+    bool ok = true;
+    {
+        std::lock_guard<bthread::Mutex> lock(_mutex);
+        for (size_t i = 0; i < size && ok; ++i) {
+            butil::IOBuf* message = messages[i];
+            while (!message->empty()) {
+                LimitStreamResult frame;
+                if (message->cutn(&frame, sizeof(frame)) != sizeof(frame) ||
+                    message->size() < frame.error_size ||
+                    _callbacks.empty()) {
+                    ok = false;
+                    break;
+                }
+
+                Result result;
+                if (frame.status == kStreamFailed) {
+                    message->cutn(&result.error_text, frame.error_size);
+                } else {
+                    result.ok = true;
+                    result.allowed = frame.status == kStreamAllowed;
+                    result.remaining = frame.remaining;
+                    result.retry_after_ms = frame.retry_after_ms;
+                }
+                finished.emplace_back(std::move(_callbacks.front()),
+                                      std::move(result));
+                _callbacks.pop_front();
+            }
+        }
+    }
+
+    for (auto& item : finished) {
+        item.first(item.second);
+    }
+
+    if (!ok) {
+        LOG(ERROR) << "Malformed result on limit stream " << id;
+        brpc::StreamClose(id);
+    }
+    return 0;
+}
+
+void RateLimitStream::on_closed(brpc::StreamId id) {
+    std::deque<Callback> callbacks;
+    {
+        std::lock_guard<bthread::Mutex> lock(_mutex);
+        _closed = true;
+        callbacks.swap(_callbacks);
+    }
+    for (auto& callback : callbacks) {
+        callback(failure("Limit stream is closed"));
+    }
+    _closed_event.signal();
+}
@@ -2,28 +2,84 @@
 
 #include <brpc/channel.h>
 #include <brpc/controller.h>
+#include <butil/fast_rand.h>
+#include <butil/time.h>
 #include <gflags/gflags.h>
 
-#include <thread>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+#include "conf/config_snapshot.h"
 #include "etcd/api/etcdserverpb/rpc.pb.h"
 #include "simdjson.h"
 
-DEFINE_int32(scan_interval_seconds, 10, "Scan Etcd Ratelimit Config Interval");
+DEFINE_int32(scan_interval_seconds, 600,
+             "Interval of full scan of etcd ratelimit config");
+DEFINE_int32(config_sync_interval_ms, 500,
+             "Interval of incremental sync of etcd ratelimit config");
+DEFINE_int32(config_sync_jitter_percent, 20,
+             "Random jitter of the config sync interval, in percent");
+DEFINE_int32(config_sync_max_backoff_ms, 30000,
+             "Max interval of config sync after consecutive etcd failures");
+DEFINE_int32(etcd_timeout_ms, 3000, "Timeout of etcd requests");
+DEFINE_string(config_snapshot_file, "",
+              "Snapshot of the etcd ratelimit config used to serve before "
+              "etcd is reachable on startup, empty to disable");
+DEFINE_int32(config_snapshot_interval_seconds, 60,
+             "Min interval of writing the config snapshot");
+DEFINE_string(default_fallback, "fail",
+              "Fallback policy when redis is unavailable and the token config "
+              "does not specify one: fail, allow, deny or local");
 
-bvar::LatencyRecorder g_latency_load("config_map_load");
 bvar::LatencyRecorder g_latency_store("config_map_store");
+bvar::Adder<int64_t> g_config_miss("config_map_miss");
+bvar::Adder<int64_t> g_config_sync_fail("config_sync_fail");
 
 ConfigManager::ConfigManager(const std::string& etcd_addr,
-                             const std::string& limit_conf_prefix)
-    : _etcd_addr(etcd_addr), _limit_conf_prefix(limit_conf_prefix) {
-    _configMap.Modify(Modify, ConfigMap{});
-
-    loadInitialConfig();
+                             const std::string& limit_conf_prefix,
+                             const std::string& conf_file)
+    : _etcd_addr(etcd_addr),
+      _limit_conf_prefix(limit_conf_prefix),
+      _conf_file(conf_file),
+      _conf_file_mtime(0),
+      _revision(0),
+      _key_count(0),
+      _last_full_scan_ms(butil::monotonic_time_ms()),
+      _snapshot_dirty(false),
+      _last_snapshot_ms(0),
+      _sync_failures(0) {
+    if (!_conf_file.empty()) {
+        if (!loadConfigFile()) {
+            throw std::runtime_error("Failed to load config file " +
+                                     _conf_file);
+        }
+    } else {
+        brpc::ChannelOptions options;
+        options.protocol = "h2:grpc";
+        options.timeout_ms = FLAGS_etcd_timeout_ms;
+        _etcd_channel.reset(new brpc::Channel);
+        if (_etcd_channel->Init(_etcd_addr.c_str(), &options) != 0) {
+            LOG(ERROR) << "Failed to initialize etcd channel.";
+            throw std::runtime_error("Failed to initialize etcd channel");
+        }
+        // 有快照时直接用快照提供服务，由后台同步从快照的 revision 追上 etcd
+        if (!loadSnapshot() && !loadInitialConfig()) {
+            throw std::runtime_error("Fail to get range from etcd");
+        }
+    }
 
     startPeriodicScan();
 }
 
+ConfigManager::~ConfigManager() {
+    // 正在进行的同步可能阻塞在 etcd 请求上，等它结束之后再释放 channel
+    // 和配置表
+    _sync_task.Stop();
+}
+
 std::string ConfigManager::getPrefixRangeEnd(const std::string& prefix) {
     std::string end = prefix;
     if (!end.empty()) {
@@ -32,95 +88,537 @@ std::string ConfigManager::getPrefixRangeEnd(const std::string& prefix) {
     return end;
 }
 
-void ConfigManager::loadInitialConfig() {
-    auto new_map = ConfigMap{};
+static bool parseFallbackPolicy(std::string_view value,
+                                FallbackPolicy* policy) {
+    if (value == "fail") {
+        *policy = FallbackPolicy::kFail;
+    } else if (value == "allow") {
+        *policy = FallbackPolicy::kAllow;
+    } else if (value == "deny") {
+        *policy = FallbackPolicy::kDeny;
+    } else if (value == "local") {
+        *policy = FallbackPolicy::kLocal;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static FallbackPolicy defaultFallbackPolicy() {
+    FallbackPolicy policy = FallbackPolicy::kFail;
+    if (!parseFallbackPolicy(FLAGS_default_fallback, &policy)) {
+        LOG(ERROR) << "Unknown default_fallback: " << FLAGS_default_fallback;
+    }
+    return policy;
+}
+
+static bool parseTokenConfig(simdjson::dom::parser& parser,
+                             const std::string& token,
+                             const std::string& value,
+                             FallbackPolicy default_fallback,
+                             TokenBucketConfig* config,
+                             std::vector<std::string>* group) {
+    simdjson::dom::element doc;
+    simdjson::error_code error = parser.parse(value).get(doc);
+    if (error) {
+        LOG(ERROR) << "Failed to parse config for token " << token << ": "
+                   << simdjson::error_message(error);
+        return false;
+    }
+
+    config->fallback = default_fallback;
+    std::string_view fallback;
+    if (doc["fallback"].get(fallback) == simdjson::SUCCESS &&
+        !parseFallbackPolicy(fallback, &config->fallback)) {
+        LOG(ERROR) << "Unknown 'fallback' in config for token " << token
+                   << ": " << fallback;
+        return false;
+    }
+
+    // 限流组只列出各层的 token，各层的限流配置在各自的 token 中
+    group->clear();
+    simdjson::dom::array members;
+    if (doc["group"].get(members) == simdjson::SUCCESS) {
+        for (simdjson::dom::element member : members) {
+            std::string_view member_token;
+            if (member.get(member_token) != simdjson::SUCCESS ||
+                member_token == token) {
+                LOG(ERROR) << "Invalid 'group' in config for token " << token;
+                return false;
+            }
+            group->emplace_back(member_token);
+        }
 
-    brpc::Channel channel;
-    brpc::ChannelOptions options;
-    options.protocol = "h2:grpc";
-    if (channel.Init(_etcd_addr.c_str(), &options) != 0) {
-        LOG(ERROR) << "Failed to initialize etcd channel.";
-        throw std::runtime_error("Failed to initialize etcd channel.");
+        if (group->empty() || group->size() > kMaxLimitGroupSize) {
+            LOG(ERROR) << "'group' of token " << token << " must have 1 to "
+                       << kMaxLimitGroupSize << " members";
+            return false;
+        }
+
+        config->burst = 0;
+        config->group_size = static_cast<uint8_t>(group->size());
+        return true;
+    }
+
+    if (doc["burst"].get(config->burst) != simdjson::SUCCESS) {
+        LOG(ERROR) << "Missing 'burst' in config for token " << token;
+        return false;
+    }
+
+    std::string_view algorithm;
+    if (doc["algorithm"].get(algorithm) == simdjson::SUCCESS &&
+        !ParseLimitAlgorithm(algorithm, &config->algorithm)) {
+        LOG(ERROR) << "Unknown 'algorithm' in config for token " << token
+                   << ": " << algorithm;
+        return false;
+    }
+
+    const bool rate_based =
+        config->algorithm == LimitAlgorithm::kTokenBucket ||
+        config->algorithm == LimitAlgorithm::kGcra;
+    if (rate_based) {
+        if (doc["rate"].get(config->rate) != simdjson::SUCCESS ||
+            config->rate <= 0) {
+            LOG(ERROR) << "Missing 'rate' in config for token " << token;
+            return false;
+        }
+    } else {
+        // 滑动窗口默认 1 秒窗口，并发限制默认 60 秒后回收未释放的计数
+        config->window_ms =
+            config->algorithm == LimitAlgorithm::kConcurrency ? 60000 : 1000;
+        int64_t window_ms;
+        if (doc["window_ms"].get(window_ms) == simdjson::SUCCESS) {
+            if (window_ms <= 0) {
+                LOG(ERROR) << "Invalid 'window_ms' in config for token "
+                           << token;
+                return false;
+            }
+            config->window_ms = window_ms;
+        }
+    }
+
+    std::string_view mode;
+    if (doc["mode"].get(mode) == simdjson::SUCCESS) {
+        if (mode == "local") {
+            config->mode = LimitMode::kLocal;
+        } else if (mode == "lease") {
+            config->mode = LimitMode::kLease;
+        } else if (mode != "redis") {
+            LOG(ERROR) << "Unknown 'mode' in config for token " << token
+                       << ": " << mode;
+            return false;
+        }
+    }
+    if (config->mode == LimitMode::kLease &&
+        config->algorithm != LimitAlgorithm::kTokenBucket) {
+        LOG(ERROR) << "Lease mode only supports token_bucket, token "
+                   << token;
+        return false;
     }
 
+    config->formatScriptArgs();
+    return true;
+}
+
+bool ConfigManager::rangeEtcd(const etcdserverpb::RangeRequest& request,
+                              etcdserverpb::RangeResponse* response) {
+    brpc::Controller cntl;
+    etcdserverpb::KV::Stub etcd_stub(_etcd_channel.get());
+    etcd_stub.Range(&cntl, &request, response, nullptr);
+    if (cntl.Failed()) {
+        LOG(ERROR) << "Fail to get range from etcd: " << cntl.ErrorText();
+        return false;
+    }
+
+    return true;
+}
+
+bool ConfigManager::loadInitialConfig() {
+    auto new_map = ConfigMap{};
+
     etcdserverpb::RangeRequest range_request;
     range_request.set_key(_limit_conf_prefix);
     range_request.set_range_end(getPrefixRangeEnd(_limit_conf_prefix));
 
     etcdserverpb::RangeResponse range_response;
-    brpc::Controller cntl;
-
-    etcdserverpb::KV::Stub etcd_stub(&channel);
-    etcd_stub.Range(&cntl, &range_request, &range_response, nullptr);
-    if (cntl.Failed()) {
-        LOG(ERROR) << "Fail to get range from etcd: " << cntl.ErrorText();
-        throw std::runtime_error("Fail to get range from etcd: " +
-                                 cntl.ErrorText());
+    if (!rangeEtcd(range_request, &range_response)) {
+        return false;
     }
 
+    FallbackPolicy default_fallback = defaultFallbackPolicy();
+    simdjson::dom::parser parser;
+
+    new_map.reserve(range_response.kvs_size());
     for (int i = 0; i < range_response.kvs_size(); ++i) {
         const auto& kv = range_response.kvs(i);
-        std::string full_key = kv.key();
+        const std::string& full_key = kv.key();
         if (full_key.size() <= _limit_conf_prefix.size()) continue;
         std::string token = full_key.substr(_limit_conf_prefix.size());
-        std::string value = kv.value();
-
-        simdjson::dom::parser parser;
-        simdjson::dom::element doc;
-        simdjson::error_code error = parser.parse(value).get(doc);
-        if (error) {
-            LOG(ERROR) << "Failed to parse config for token " << token << ": "
-                       << simdjson::error_message(error);
-            continue;
-        }
 
         TokenBucketConfig config;
-        if (doc["burst"].get(config.burst) != simdjson::SUCCESS) {
-            LOG(ERROR) << "Missing 'burst' in config for token " << token;
+        std::vector<std::string> group;
+        if (!parseTokenConfig(parser, token, kv.value(), default_fallback,
+                              &config, &group)) {
             continue;
         }
 
-        if (doc["rate"].get(config.rate) != simdjson::SUCCESS) {
-            LOG(ERROR) << "Missing 'rate' in config for token " << token;
-            continue;
+        new_map.insert_or_assign(token, config, group);
+    }
+
+    butil::Timer timer;
+    timer.start();
+    Replace replace{&new_map};
+    _configMap.ModifyWithForeground(replace);
+    timer.stop();
+    g_latency_store << timer.n_elapsed();
+
+    _revision = range_response.header().revision();
+    _key_count = range_response.count();
+    _snapshot_dirty = true;
+    return true;
+}
+
+bool ConfigManager::loadSnapshot() {
+    if (FLAGS_config_snapshot_file.empty()) {
+        return false;
+    }
+
+    butil::Timer timer;
+    timer.start();
+    ConfigSnapshotMeta meta;
+    auto new_map = ConfigMap{};
+    if (!LoadConfigSnapshot(FLAGS_config_snapshot_file, &meta, &new_map)) {
+        return false;
+    }
+    if (meta.prefix != _limit_conf_prefix) {
+        LOG(WARNING) << "Ignore config snapshot of prefix " << meta.prefix;
+        return false;
+    }
+
+    const size_t size = new_map.size();
+    Replace replace{&new_map};
+    _configMap.ModifyWithForeground(replace);
+    timer.stop();
+
+    _revision = meta.revision;
+    _key_count = meta.key_count;
+    LOG(INFO) << "Loaded " << size << " token configs at etcd revision "
+              << meta.revision << " from snapshot "
+              << FLAGS_config_snapshot_file << " in " << timer.m_elapsed()
+              << "ms";
+    return true;
+}
+
+void ConfigManager::saveSnapshot() {
+    if (FLAGS_config_snapshot_file.empty() || !_conf_file.empty() ||
+        !_snapshot_dirty) {
+        return;
+    }
+    const int64_t now_ms = butil::monotonic_time_ms();
+    if (_last_snapshot_ms != 0 &&
+        now_ms - _last_snapshot_ms <
+            static_cast<int64_t>(FLAGS_config_snapshot_interval_seconds) *
+                1000) {
+        return;
+    }
+    _last_snapshot_ms = now_ms;
+
+    // 只在编码时持有读锁，写文件时不影响配置更新
+    std::string data;
+    {
+        butil::DoublyBufferedData<ConfigMap>::ScopedPtr currentMap;
+        if (_configMap.Read(&currentMap) != 0) {
+            LOG(ERROR) << "Failed to Read configMap";
+            return;
         }
+        ConfigSnapshotMeta meta;
+        meta.prefix = _limit_conf_prefix;
+        meta.revision = _revision;
+        meta.key_count = _key_count;
+        EncodeConfigSnapshot(meta, *currentMap, &data);
+    }
+
+    if (WriteConfigSnapshot(FLAGS_config_snapshot_file, data)) {
+        _snapshot_dirty = false;
+        LOG(INFO) << "Saved config snapshot at etcd revision " << _revision
+                  << ", " << data.size() << " bytes";
+    }
+}
+
+static int64_t fileMtime(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+           st.st_mtim.tv_nsec;
+}
+
+bool ConfigManager::loadConfigFile() {
+    const int64_t mtime = fileMtime(_conf_file);
+
+    simdjson::dom::parser file_parser;
+    simdjson::dom::object tokens;
+    simdjson::error_code error = file_parser.load(_conf_file).get(tokens);
+    if (error) {
+        LOG(ERROR) << "Failed to load config file " << _conf_file << ": "
+                   << simdjson::error_message(error);
+        return false;
+    }
 
-        new_map.emplace(token, config);
+    FallbackPolicy default_fallback = defaultFallbackPolicy();
+    simdjson::dom::parser parser;
+    auto new_map = ConfigMap{};
+    for (auto field : tokens) {
+        std::string token(field.key);
+        TokenBucketConfig config;
+        std::vector<std::string> group;
+        if (!parseTokenConfig(parser, token, simdjson::minify(field.value),
+                              default_fallback, &config, &group)) {
+            continue;
+        }
+        new_map.insert_or_assign(token, config, group);
     }
 
     butil::Timer timer;
     timer.start();
-    _configMap.Modify(Modify, new_map);
+    Replace replace{&new_map};
+    _configMap.ModifyWithForeground(replace);
     timer.stop();
     g_latency_store << timer.n_elapsed();
+
+    _conf_file_mtime = mtime;
+    LOG(INFO) << "Loaded ratelimit config from " << _conf_file;
+    return true;
 }
 
-void ConfigManager::startPeriodicScan() {
-    std::thread([this] {
-        while (true) {
-            std::this_thread::sleep_for(
-                std::chrono::seconds(FLAGS_scan_interval_seconds));
-            loadInitialConfig();
+bool ConfigManager::syncConfigFile() {
+    const int64_t mtime = fileMtime(_conf_file);
+    if (mtime == _conf_file_mtime) {
+        return true;
+    }
+
+    // 文件正在写入或者内容有误时保留当前配置，等待下一次修改
+    if (!loadConfigFile()) {
+        LOG(WARNING) << "Keep the current config of " << _conf_file;
+        _conf_file_mtime = mtime;
+        return false;
+    }
+    return true;
+}
+
+bool ConfigManager::syncIncrementalConfig() {
+    const std::string range_end = getPrefixRangeEnd(_limit_conf_prefix);
+
+    // 只取 key 数量和当前 revision，revision 不变说明配置没有变更
+    etcdserverpb::RangeRequest count_request;
+    count_request.set_key(_limit_conf_prefix);
+    count_request.set_range_end(range_end);
+    count_request.set_count_only(true);
+
+    etcdserverpb::RangeResponse count_response;
+    if (!rangeEtcd(count_request, &count_response)) {
+        return false;
+    }
+
+    const int64_t revision = count_response.header().revision();
+    if (revision == _revision) {
+        return true;
+    }
+
+    if (revision < _revision) {
+        LOG(WARNING) << "Etcd revision goes backwards from " << _revision
+                     << " to " << revision;
+        return false;
+    }
+
+    // 拉取上次同步之后修改过的 key
+    etcdserverpb::RangeRequest changed_request;
+    changed_request.set_key(_limit_conf_prefix);
+    changed_request.set_range_end(range_end);
+    changed_request.set_revision(revision);
+    changed_request.set_min_mod_revision(_revision + 1);
+
+    etcdserverpb::RangeResponse changed_response;
+    if (!rangeEtcd(changed_request, &changed_response)) {
+        return false;
+    }
+
+    FallbackPolicy default_fallback = defaultFallbackPolicy();
+    simdjson::dom::parser parser;
+    ConfigDelta delta;
+    int64_t created = 0;
+
+    for (int i = 0; i < changed_response.kvs_size(); ++i) {
+        const auto& kv = changed_response.kvs(i);
+        if (kv.create_revision() > _revision) {
+            ++created;
+        }
+
+        const std::string& full_key = kv.key();
+        if (full_key.size() <= _limit_conf_prefix.size()) continue;
+        std::string token = full_key.substr(_limit_conf_prefix.size());
+
+        ParsedConfig parsed;
+        if (parseTokenConfig(parser, token, kv.value(), default_fallback,
+                             &parsed.first, &parsed.second)) {
+            delta.emplace_back(std::move(token), std::move(parsed));
+        } else {
+            delta.emplace_back(std::move(token), std::nullopt);
         }
-    }).detach();
+    }
+
+    // key 数量比预期少说明有 key 被删除，拉取 key 列表找出被删除的 token
+    if (count_response.count() < _key_count + created) {
+        etcdserverpb::RangeRequest keys_request;
+        keys_request.set_key(_limit_conf_prefix);
+        keys_request.set_range_end(range_end);
+        keys_request.set_revision(revision);
+        keys_request.set_keys_only(true);
+
+        etcdserverpb::RangeResponse keys_response;
+        if (!rangeEtcd(keys_request, &keys_response)) {
+            return false;
+        }
+
+        std::unordered_set<std::string_view> alive_tokens;
+        for (int i = 0; i < keys_response.kvs_size(); ++i) {
+            std::string_view full_key = keys_response.kvs(i).key();
+            if (full_key.size() <= _limit_conf_prefix.size()) continue;
+            alive_tokens.insert(full_key.substr(_limit_conf_prefix.size()));
+        }
+
+        butil::DoublyBufferedData<ConfigMap>::ScopedPtr currentMap;
+        if (_configMap.Read(&currentMap) != 0) {
+            LOG(ERROR) << "Failed to Read configMap";
+            return false;
+        }
+        for (const auto& entry : *currentMap) {
+            if (alive_tokens.find(entry.token) == alive_tokens.end()) {
+                delta.emplace_back(entry.token, std::nullopt);
+            }
+        }
+    }
+
+    if (!delta.empty()) {
+        butil::Timer timer;
+        timer.start();
+        _configMap.Modify(ApplyDelta, delta);
+        timer.stop();
+        g_latency_store << timer.n_elapsed();
+        LOG(INFO) << "Applied " << delta.size()
+                  << " config changes at etcd revision " << revision;
+        _snapshot_dirty = true;
+    }
+
+    _revision = revision;
+    _key_count = count_response.count();
+    return true;
+}
+
+bool ConfigManager::sync() {
+    if (!_conf_file.empty()) {
+        // 文件内容有误时等待下一次修改，不需要退避
+        syncConfigFile();
+        return true;
+    }
+
+    const int64_t now_ms = butil::monotonic_time_ms();
+    if (now_ms - _last_full_scan_ms <
+            static_cast<int64_t>(FLAGS_scan_interval_seconds) * 1000 &&
+        syncIncrementalConfig()) {
+        return true;
+    }
+
+    if (!loadInitialConfig()) {
+        return false;
+    }
+    _last_full_scan_ms = now_ms;
+    return true;
 }
 
-bool ConfigManager::getTokenBucketConfig(const std::string& token,
+int64_t ConfigManager::nextSyncDelayMs() const {
+    int64_t delay_ms = std::max(FLAGS_config_sync_interval_ms, 1);
+    // etcd 选主等故障期间避免所有实例按固定间隔反复重试
+    if (_sync_failures > 0) {
+        const int64_t max_ms =
+            std::max<int64_t>(FLAGS_config_sync_max_backoff_ms, delay_ms);
+        delay_ms = std::min(delay_ms << std::min(_sync_failures, 16), max_ms);
+    }
+
+    // 抖动使各实例的同步时间错开，不会同时访问 etcd
+    const int64_t jitter = delay_ms * FLAGS_config_sync_jitter_percent / 100;
+    if (jitter > 0) {
+        delay_ms += static_cast<int64_t>(
+                        butil::fast_rand_less_than(2 * jitter + 1)) -
+                    jitter;
+    }
+    return std::max<int64_t>(delay_ms, 1);
+}
+
+void ConfigManager::startPeriodicScan() {
+    _sync_task.Start(
+        "config sync", [this] { return nextSyncDelayMs(); },
+        [this] {
+            syncOnce();
+            return true;
+        });
+}
+
+void ConfigManager::syncOnce() {
+    if (sync()) {
+        _sync_failures = 0;
+        saveSnapshot();
+    } else {
+        ++_sync_failures;
+        g_config_sync_fail << 1;
+        LOG_EVERY_SECOND(WARNING)
+            << "Failed to sync config from etcd " << _sync_failures
+            << " times in a row, keep the current config";
+    }
+}
+
+bool ConfigManager::getTokenBucketConfig(std::string_view token,
                                          TokenBucketConfig& config) {
-    butil::Timer timer;
-    timer.start();
     butil::DoublyBufferedData<ConfigMap>::ScopedPtr currentMap;
-    if (_configMap.Read(&currentMap)) {
+    if (_configMap.Read(&currentMap) != 0) {
         LOG(ERROR) << "Failed to Read configMap: " << token;
         return false;
     }
-    timer.stop();
-    g_latency_load << timer.n_elapsed();
-    auto iter = currentMap->find(token);
-    if (iter == currentMap->end()) {
-        LOG(ERROR) << "Token not found: " << token;
+    const TokenConfigEntry* entry = currentMap->find(token);
+    if (entry == nullptr) {
+        g_config_miss << 1;
         return false;
     }
-    config = iter->second;
+    config = entry->config;
+    return true;
+}
+
+bool ConfigManager::getLimitGroup(std::string_view token,
+                                  std::vector<LimitGroupMember>* members) {
+    butil::DoublyBufferedData<ConfigMap>::ScopedPtr currentMap;
+    if (_configMap.Read(&currentMap) != 0) {
+        LOG(ERROR) << "Failed to Read configMap: " << token;
+        return false;
+    }
+
+    const TokenConfigEntry* entry = currentMap->find(token);
+    if (entry == nullptr || entry->group.empty()) {
+        g_config_miss << 1;
+        return false;
+    }
+
+    members->resize(entry->group.size());
+    for (size_t i = 0; i < entry->group.size(); ++i) {
+        const TokenConfigEntry* member = currentMap->find(entry->group[i]);
+        // 限流组不能嵌套
+        if (member == nullptr || !member->group.empty()) {
+            LOG_EVERY_SECOND(WARNING) << "Invalid member " << entry->group[i]
+                                      << " in limit group " << token;
+            return false;
+        }
+        (*members)[i].token = member->token;
+        (*members)[i].config = member->config;
+    }
     return true;
 }
\ No newline at end of file
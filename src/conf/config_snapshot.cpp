@@ -0,0 +1,315 @@
+#include "conf/config_snapshot.h"
+
+#include <butil/crc32c.h>
+#include <butil/fd_guard.h>
+#include <butil/logging.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+const char kSnapshotMagic[4] = {'R', 'L', 'C', 'S'};
+// 记录格式变化时递增，旧版本的快照直接丢弃
+const uint32_t kSnapshotVersion = 1;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    // 文件头之后所有内容的 crc32c
+    uint32_t checksum;
+    uint32_t prefix_size;
+    int64_t revision;
+    int64_t key_count;
+    uint64_t entry_count;
+    uint64_t payload_size;
+};
+
+// 后面依次跟着 token 和限流组各层的 token，每层为 2 字节长度加内容
+struct SnapshotRecord {
+    int64_t burst;
+    int64_t rate;
+    int64_t window_ms;
+    uint16_t token_size;
+    uint8_t algorithm;
+    uint8_t mode;
+    uint8_t fallback;
+    uint8_t group_size;
+    uint8_t reserved[2];
+};
+
+static_assert(std::is_trivially_copyable<SnapshotHeader>::value &&
+                  std::is_trivially_copyable<SnapshotRecord>::value,
+              "Snapshot layout must be trivially copyable");
+static_assert(sizeof(SnapshotRecord) == 32, "Unexpected record size");
+
+struct MappedFile {
+    void* addr;
+    size_t size;
+
+    ~MappedFile() { munmap(addr, size); }
+};
+
+template <typename T>
+void appendPod(std::string* data, const T& value) {
+    data->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// 调用方保证 value 不超过 UINT16_MAX 字节
+void appendString(std::string* data, const std::string& value) {
+    appendPod(data, static_cast<uint16_t>(value.size()));
+    data->append(value);
+}
+
+// 带边界检查地顺序读取 mmap 的内容
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size)
+        : _data(data), _end(data + size) {}
+
+    template <typename T>
+    bool readPod(T* value) {
+        if (static_cast<size_t>(_end - _data) < sizeof(T)) {
+            return false;
+        }
+        memcpy(value, _data, sizeof(T));
+        _data += sizeof(T);
+        return true;
+    }
+
+    bool readString(size_t size, std::string_view* value) {
+        if (static_cast<size_t>(_end - _data) < size) {
+            return false;
+        }
+        *value = std::string_view(_data, size);
+        _data += size;
+        return true;
+    }
+
+    bool done() const { return _data == _end; }
+
+private:
+    const char* _data;
+    const char* _end;
+};
+
+bool decodeRecord(SnapshotReader* reader, std::string_view* token,
+                  TokenBucketConfig* config, std::vector<std::string>* group) {
+    SnapshotRecord record;
+    if (!reader->readPod(&record) ||
+        !reader->readString(record.token_size, token) ||
+        record.algorithm >= kLimitAlgorithmCount ||
+        record.mode > static_cast<uint8_t>(LimitMode::kLease) ||
+        record.fallback > static_cast<uint8_t>(FallbackPolicy::kLocal) ||
+        record.group_size > kMaxLimitGroupSize) {
+        return false;
+    }
+
+    config->burst = record.burst;
+    config->rate = record.rate;
+    config->window_ms = record.window_ms;
+    config->algorithm = static_cast<LimitAlgorithm>(record.algorithm);
+    config->mode = static_cast<LimitMode>(record.mode);
+    config->fallback = static_cast<FallbackPolicy>(record.fallback);
+    config->group_size = record.group_size;
+    config->formatScriptArgs();
+
+    group->resize(record.group_size);
+    for (auto& member : *group) {
+        uint16_t size;
+        std::string_view member_token;
+        if (!reader->readPod(&size) ||
+            !reader->readString(size, &member_token)) {
+            return false;
+        }
+        member.assign(member_token);
+    }
+    return true;
+}
+
+}    // namespace
+
+void EncodeConfigSnapshot(const ConfigSnapshotMeta& meta,
+                          const TokenConfigTable& table, std::string* data) {
+    data->clear();
+    data->reserve(sizeof(SnapshotHeader) + meta.prefix.size() +
+                  table.size() * (sizeof(SnapshotRecord) + 32));
+    data->resize(sizeof(SnapshotHeader));
+    data->append(meta.prefix);
+
+    uint64_t entry_count = 0;
+    for (const auto& entry : table) {
+        // 长度前缀只有 2 字节，超出长度的 token 无法作为 etcd 配置写入，
+        // 这里直接跳过，限流组中引用了这样的 token 时同样跳过
+        if (entry.token.size() > UINT16_MAX ||
+            std::any_of(entry.group.begin(), entry.group.end(),
+                        [](const std::string& member) {
+                            return member.size() > UINT16_MAX;
+                        })) {
+            LOG(WARNING) << "Skip config of token too long for snapshot";
+            continue;
+        }
+
+        SnapshotRecord record;
+        memset(&record, 0, sizeof(record));
+        record.burst = entry.config.burst;
+        record.rate = entry.config.rate;
+        record.window_ms = entry.config.window_ms;
+        record.token_size = static_cast<uint16_t>(entry.token.size());
+        record.algorithm = static_cast<uint8_t>(entry.config.algorithm);
+        record.mode = static_cast<uint8_t>(entry.config.mode);
+        record.fallback = static_cast<uint8_t>(entry.config.fallback);
+        record.group_size = static_cast<uint8_t>(entry.group.size());
+        appendPod(data, record);
+        data->append(entry.token);
+        for (const auto& member : entry.group) {
+            appendString(data, member);
+        }
+        ++entry_count;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.prefix_size = static_cast<uint32_t>(meta.prefix.size());
+    header.revision = meta.revision;
+    header.key_count = meta.key_count;
+    header.entry_count = entry_count;
+    header.payload_size = data->size() - sizeof(SnapshotHeader);
+    header.checksum = butil::crc32c::Value(data->data() + sizeof(header),
+                                           header.payload_size);
+    memcpy(&(*data)[0], &header, sizeof(header));
+}
+
+bool WriteConfigSnapshot(const std::string& path, const std::string& data) {
+    const std::string tmp_path = path + ".tmp";
+    {
+        butil::fd_guard fd(
+            open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (fd < 0) {
+            PLOG(ERROR) << "Failed to open " << tmp_path;
+            return false;
+        }
+
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                PLOG(ERROR) << "Failed to write " << tmp_path;
+                return false;
+            }
+            written += n;
+        }
+
+        if (fsync(fd) != 0) {
+            PLOG(ERROR) << "Failed to fsync " << tmp_path;
+            return false;
+        }
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        PLOG(ERROR) << "Failed to rename " << tmp_path << " to " << path;
+        return false;
+    }
+
+    // 重命名写入目录项之后才持久化，掉电后不会回到旧的快照
+    const size_t slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos
+                                ? "."
+                                : slash == 0 ? "/" : path.substr(0, slash);
+    butil::fd_guard dir_fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY));
+    if (dir_fd < 0 || fsync(dir_fd) != 0) {
+        PLOG(ERROR) << "Failed to fsync directory " << dir;
+        return false;
+    }
+    return true;
+}
+
+bool LoadConfigSnapshot(const std::string& path, ConfigSnapshotMeta* meta,
+                        TokenConfigTable* table) {
+    butil::fd_guard fd(open(path.c_str(), O_RDONLY));
+    if (fd < 0) {
+        PLOG(WARNING) << "Failed to open config snapshot " << path;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        LOG(WARNING) << "Invalid config snapshot " << path;
+        return false;
+    }
+
+    const size_t size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(WARNING) << "Failed to mmap config snapshot " << path;
+        return false;
+    }
+    MappedFile mapped{addr, size};
+    // 顺序读取整个文件
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    const char* data = static_cast<const char*>(addr);
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0 ||
+        header.version != kSnapshotVersion ||
+        header.payload_size != size - sizeof(header) ||
+        header.entry_count > header.payload_size / sizeof(SnapshotRecord)) {
+        LOG(WARNING) << "Invalid or incompatible config snapshot " << path;
+        return false;
+    }
+
+    data += sizeof(header);
+    if (butil::crc32c::Value(data, header.payload_size) != header.checksum) {
+        LOG(WARNING) << "Checksum mismatch of config snapshot " << path;
+        return false;
+    }
+
+    SnapshotReader reader(data, header.payload_size);
+    std::string_view prefix;
+    if (!reader.readString(header.prefix_size, &prefix)) {
+        LOG(WARNING) << "Invalid config snapshot " << path;
+        return false;
+    }
+
+    TokenConfigTable new_table;
+    new_table.reserve(header.entry_count);
+    TokenBucketConfig config;
+    std::string_view token;
+    std::vector<std::string> group;
+    for (uint64_t i = 0; i < header.entry_count; ++i) {
+        if (!decodeRecord(&reader, &token, &config, &group)) {
+            LOG(WARNING) << "Invalid record " << i << " in config snapshot "
+                         << path;
+            return false;
+        }
+        new_table.insert_or_assign(token, config, group);
+    }
+    if (!reader.done()) {
+        LOG(WARNING) << "Trailing data in config snapshot " << path;
+        return false;
+    }
+
+    meta->prefix.assign(prefix);
+    meta->revision = header.revision;
+    meta->key_count = header.key_count;
+    table->swap(new_table);
+    return true;
+}
@@ -0,0 +1,122 @@
+#include "conf/token_config_table.h"
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+uint64_t TokenConfigTable::Hash(std::string_view token) {
+    uint64_t hash = std::hash<std::string_view>()(token);
+    // 0 和 1 用来标记空槽位和已删除的槽位
+    return hash < 2 ? hash + 2 : hash;
+}
+
+size_t TokenConfigTable::findSlot(std::string_view token, uint64_t hash) const {
+    if (_slots.empty()) {
+        return _slots.size();
+    }
+
+    const size_t mask = _slots.size() - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+        const Slot& slot = _slots[pos];
+        if (slot.hash == kEmpty) {
+            return _slots.size();
+        }
+        if (slot.hash == hash && _entries[slot.index].token == token) {
+            return pos;
+        }
+    }
+}
+
+const TokenConfigEntry* TokenConfigTable::find(std::string_view token) const {
+    size_t pos = findSlot(token, Hash(token));
+    if (pos == _slots.size()) {
+        return nullptr;
+    }
+    return &_entries[_slots[pos].index];
+}
+
+void TokenConfigTable::insert_or_assign(
+    std::string_view token, const TokenBucketConfig& config,
+    const std::vector<std::string>& group) {
+    uint64_t hash = Hash(token);
+    size_t pos = findSlot(token, hash);
+    if (pos != _slots.size()) {
+        _entries[_slots[pos].index].config = config;
+        _entries[_slots[pos].index].group = group;
+        return;
+    }
+
+    // 负载因子（包含已删除的槽位）保持在 1/2 以下
+    if ((_entries.size() + _deleted + 1) * 2 > _slots.size()) {
+        rehash(std::max<size_t>(_slots.size(), (_entries.size() + 1) * 2));
+    }
+
+    const size_t mask = _slots.size() - 1;
+    pos = hash & mask;
+    while (_slots[pos].hash != kEmpty && _slots[pos].hash != kDeleted) {
+        pos = (pos + 1) & mask;
+    }
+
+    if (_slots[pos].hash == kDeleted) {
+        --_deleted;
+    }
+    _slots[pos].hash = hash;
+    _slots[pos].index = static_cast<uint32_t>(_entries.size());
+    _entries.push_back(
+        TokenConfigEntry{std::string(token), hash, config, group});
+}
+
+bool TokenConfigTable::erase(std::string_view token) {
+    size_t pos = findSlot(token, Hash(token));
+    if (pos == _slots.size()) {
+        return false;
+    }
+
+    uint32_t index = _slots[pos].index;
+    _slots[pos].hash = kDeleted;
+    ++_deleted;
+
+    // 把最后一个条目挪到被删除的位置，保持条目连续存放
+    uint32_t last = static_cast<uint32_t>(_entries.size() - 1);
+    if (index != last) {
+        size_t last_pos = findSlot(_entries[last].token, _entries[last].hash);
+        _slots[last_pos].index = index;
+        _entries[index] = std::move(_entries[last]);
+    }
+    _entries.pop_back();
+    return true;
+}
+
+void TokenConfigTable::reserve(size_t size) {
+    if (size * 2 > _slots.size()) {
+        rehash(size * 2);
+    }
+    _entries.reserve(size);
+}
+
+void TokenConfigTable::swap(TokenConfigTable& other) {
+    _slots.swap(other._slots);
+    _entries.swap(other._entries);
+    std::swap(_deleted, other._deleted);
+}
+
+void TokenConfigTable::rehash(size_t capacity) {
+    size_t new_size = 16;
+    while (new_size < capacity) {
+        new_size <<= 1;
+    }
+
+    std::vector<Slot> slots(new_size);
+    const size_t mask = new_size - 1;
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        size_t pos = _entries[i].hash & mask;
+        while (slots[pos].hash != kEmpty) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].hash = _entries[i].hash;
+        slots[pos].index = static_cast<uint32_t>(i);
+    }
+
+    _slots.swap(slots);
+    _deleted = 0;
+}
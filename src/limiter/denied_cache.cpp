@@ -0,0 +1,113 @@
+#include "limiter/denied_cache.h"
+
+#include <bvar/bvar.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+DEFINE_int32(denied_cache_max_ms, 1000,
+             "Max time a token rejected by redis is rejected locally");
+
+bvar::Adder<int64_t> g_denied_cache_hit("denied_cache_hit");
+
+namespace {
+
+constexpr int kCostBits = 20;
+constexpr uint64_t kCostMax = (1ULL << kCostBits) - 1;
+
+// key 的高 48 位为 token 哈希，低 16 位为写入序号，奇数表示正在写入
+constexpr int kSeqBits = 16;
+constexpr uint64_t kSeqMask = (1ULL << kSeqBits) - 1;
+
+}    // namespace
+
+DeniedCache::DeniedCache(size_t capacity) : _mask(0) {
+    if (capacity == 0) {
+        return;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    _slots.reset(new Slot[size]);
+    _mask = size - 1;
+}
+
+uint64_t DeniedCache::hash(std::string_view token) {
+    uint64_t hash = std::hash<std::string_view>()(token) & ~kSeqMask;
+    return hash == 0 ? 1ULL << kSeqBits : hash;
+}
+
+uint64_t DeniedCache::nowMs() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - epoch);
+    return static_cast<uint64_t>(elapsed.count());
+}
+
+bool DeniedCache::Lookup(std::string_view token, int64_t cost,
+                         LimitDecision* decision) {
+    if (!_slots) {
+        return false;
+    }
+
+    const uint64_t token_hash = hash(token);
+    Slot& slot = _slots[(token_hash >> kSeqBits) & _mask];
+    const uint64_t key = slot.key.load(std::memory_order_acquire);
+    if ((key & ~kSeqMask) != token_hash || (key & 1) != 0) {
+        return false;
+    }
+    uint64_t state = slot.state.load(std::memory_order_acquire);
+    // 读取 state 期间槽位被写入过，序号会变化
+    if (slot.key.load(std::memory_order_acquire) != key) {
+        return false;
+    }
+
+    const uint64_t until_ms = state >> kCostBits;
+    const uint64_t now_ms = nowMs();
+    if (now_ms >= until_ms ||
+        static_cast<uint64_t>(cost) < (state & kCostMax)) {
+        return false;
+    }
+
+    decision->allowed = false;
+    decision->remaining = 0;
+    decision->retry_after_ms = static_cast<int64_t>(until_ms - now_ms);
+    g_denied_cache_hit << 1;
+    return true;
+}
+
+void DeniedCache::Insert(std::string_view token, int64_t cost,
+                         const LimitDecision& decision) {
+    if (!_slots || decision.allowed || decision.retry_after_ms <= 0 ||
+        cost <= 0 || static_cast<uint64_t>(cost) > kCostMax) {
+        return;
+    }
+
+    // 限制缓存时间，配置调大之后尽快生效
+    const int64_t ttl_ms = std::min<int64_t>(decision.retry_after_ms,
+                                             FLAGS_denied_cache_max_ms);
+    if (ttl_ms <= 0) {
+        return;
+    }
+
+    const uint64_t token_hash = hash(token);
+    Slot& slot = _slots[(token_hash >> kSeqBits) & _mask];
+    const uint64_t until_ms = nowMs() + static_cast<uint64_t>(ttl_ms);
+    // 把序号改成奇数取得槽位，其他线程正在写入时放弃这次记录。
+    // 读者在 state 前后两次读到的 key 相同且序号为偶数才使用 state
+    uint64_t key = slot.key.load(std::memory_order_relaxed);
+    if ((key & 1) != 0 ||
+        !slot.key.compare_exchange_strong(key, key + 1,
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed)) {
+        return;
+    }
+    slot.state.store((until_ms << kCostBits) | static_cast<uint64_t>(cost),
+                     std::memory_order_release);
+    slot.key.store(token_hash | ((key + 2) & kSeqMask),
+                   std::memory_order_release);
+}
@@ -0,0 +1,152 @@
+#include "limiter/hot_key_detector.h"
+
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+DEFINE_int64(hot_key_min_qps, 1000,
+             "Tokens whose qps on this instance reaches this value are "
+             "treated as hot keys, 0 to disable hot key detection");
+DEFINE_int32(hot_key_top_k, 16, "Max number of hot keys");
+DEFINE_int32(hot_key_sample_rate, 16,
+             "Count one of every N requests for hot key detection");
+DEFINE_int32(hot_key_counters, 1024,
+             "Number of tokens tracked by the hot key sketch");
+DEFINE_int32(hot_key_interval_ms, 1000, "Interval of hot key detection");
+
+bvar::Adder<int64_t> g_hot_key_promoted("hot_key_promoted");
+bvar::Adder<int64_t> g_hot_key_demoted("hot_key_demoted");
+
+namespace {
+
+size_t replaceHotSet(std::unordered_map<std::string, int64_t>& bg,
+                     const std::unordered_map<std::string, int64_t>& hot) {
+    bg = hot;
+    return 1;
+}
+
+}    // namespace
+
+HotKeyDetector::HotKeyDetector()
+    : _sketch(FLAGS_hot_key_counters),
+      _hot_count(0),
+      _last_refresh_ms(butil::monotonic_time_ms()),
+      _hot_keys_status("hot_keys", describe, this) {}
+
+void HotKeyDetector::Start() {
+    if (FLAGS_hot_key_min_qps <= 0) {
+        return;
+    }
+
+    _refresher.Start(
+        "hot key detection", [] { return FLAGS_hot_key_interval_ms; },
+        [this] {
+            refresh();
+            return true;
+        });
+}
+
+void HotKeyDetector::Record(const std::string& token) {
+    if (FLAGS_hot_key_min_qps <= 0) {
+        return;
+    }
+    const int32_t sample_rate = std::max(FLAGS_hot_key_sample_rate, 1);
+    if (sample_rate > 1 && butil::fast_rand_less_than(sample_rate) != 0) {
+        return;
+    }
+    _sketch.Add(token);
+}
+
+bool HotKeyDetector::IsHot(const std::string& token) {
+    if (_hot_count.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    butil::DoublyBufferedData<HotSet>::ScopedPtr hot;
+    if (_hot.Read(&hot) != 0) {
+        return false;
+    }
+    return hot->find(token) != hot->end();
+}
+
+void HotKeyDetector::refresh() {
+    const int64_t now_ms = butil::monotonic_time_ms();
+    const int64_t elapsed_ms = std::max<int64_t>(now_ms - _last_refresh_ms, 1);
+    _last_refresh_ms = now_ms;
+
+    // 按计数下界估算本周期的 qps，每个周期重新计数
+    const int64_t sample_rate = std::max(FLAGS_hot_key_sample_rate, 1);
+    std::vector<std::pair<int64_t, std::string>> candidates;
+    _sketch.Drain(&candidates);
+    for (auto& candidate : candidates) {
+        candidate.first = candidate.first * sample_rate * 1000 / elapsed_ms;
+    }
+
+    HotSet old_hot;
+    {
+        butil::DoublyBufferedData<HotSet>::ScopedPtr hot;
+        if (_hot.Read(&hot) == 0) {
+            old_hot = *hot;
+        }
+    }
+
+    HotSet new_hot;
+    for (const auto& candidate : candidates) {
+        if (new_hot.size() >= static_cast<size_t>(FLAGS_hot_key_top_k) ||
+            candidate.first < FLAGS_hot_key_min_qps / 2) {
+            break;
+        }
+        // 新的热点需要达到阈值，已有的热点降到阈值一半以下才移除
+        if (candidate.first >= FLAGS_hot_key_min_qps ||
+            old_hot.count(candidate.second) != 0) {
+            new_hot.emplace(candidate.second, candidate.first);
+        }
+    }
+
+    for (const auto& kv : new_hot) {
+        if (old_hot.count(kv.first) == 0) {
+            g_hot_key_promoted << 1;
+            LOG(INFO) << "Token " << kv.first << " becomes a hot key, qps "
+                      << kv.second;
+        }
+    }
+    for (const auto& kv : old_hot) {
+        if (new_hot.count(kv.first) == 0) {
+            g_hot_key_demoted << 1;
+            LOG(INFO) << "Token " << kv.first << " is no longer a hot key";
+        }
+    }
+
+    if (new_hot.empty() && old_hot.empty()) {
+        return;
+    }
+    _hot.Modify(replaceHotSet, new_hot);
+    _hot_count.store(new_hot.size(), std::memory_order_relaxed);
+}
+
+void HotKeyDetector::describe(std::ostream& os, void* arg) {
+    HotKeyDetector* detector = static_cast<HotKeyDetector*>(arg);
+    butil::DoublyBufferedData<HotSet>::ScopedPtr hot;
+    if (detector->_hot.Read(&hot) != 0) {
+        return;
+    }
+
+    std::vector<std::pair<int64_t, std::string>> keys;
+    for (const auto& kv : *hot) {
+        keys.emplace_back(kv.second, kv.first);
+    }
+    std::sort(keys.begin(), keys.end(),
+              [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i > 0) {
+            os << ' ';
+        }
+        os << keys[i].second << ':' << keys[i].first;
+    }
+}
@@ -0,0 +1,632 @@
+#include "limiter/local_bucket_table.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+
+namespace {
+
+constexpr uint64_t kTokenScale = 1000;
+// 超过的 cost 直接拒绝，各算法中 cost 参与的乘法和加法不会溢出
+constexpr int64_t kMaxCost = std::numeric_limits<uint32_t>::max();
+
+// 滑动窗口状态: 高 24 位为窗口编号，中间 20 位为上一个窗口计数，
+// 低 20 位为当前窗口计数
+constexpr int kWindowCountBits = 20;
+constexpr uint64_t kWindowCountMax = (1ULL << kWindowCountBits) - 1;
+constexpr uint64_t kWindowIdMask = (1ULL << 24) - 1;
+
+// 槽位 key 的布局
+constexpr int kExpireBits = 23;
+constexpr uint64_t kExpireMask = (1ULL << kExpireBits) - 1;
+constexpr uint64_t kReferenced = 1ULL << kExpireBits;
+constexpr int kFingerprintShift = kExpireBits + 1;
+constexpr uint64_t kFingerprintMask = ~((1ULL << kFingerprintShift) - 1);
+
+// 与 ratelimit.lua 一致的过期时间（秒）
+constexpr int64_t kBucketTtl = 1800;
+constexpr int64_t kDeniedTtl = 600;
+constexpr int64_t kDeniedRenewBelow = 300;
+// 新建的桶在第一次续期之前的过期时间，只被试算过的 token 很快就能回收
+constexpr int64_t kInitialTtl = 2;
+
+// 状态中能表示的最大配额：令牌桶的剩余令牌数为 32 位的千分之一令牌，
+// 滑动窗口的计数为 20 位，更大的 burst 会被截断到这个值
+inline int64_t maxCostOf(const TokenBucketConfig& config) {
+    int64_t limit = kMaxCost;
+    if (config.algorithm == LimitAlgorithm::kTokenBucket) {
+        limit = kMaxCost / static_cast<int64_t>(kTokenScale);
+    } else if (config.algorithm == LimitAlgorithm::kSlidingWindow) {
+        limit = static_cast<int64_t>(kWindowCountMax);
+    }
+    return std::min(config.burst, limit);
+}
+
+inline uint64_t fingerprintOf(uint64_t hash) {
+    uint64_t fingerprint = hash & kFingerprintMask;
+    return fingerprint == 0 ? 1ULL << kFingerprintShift : fingerprint;
+}
+
+// 距离过期还有多少秒，23 位时间戳回绕安全
+inline int32_t secondsUntil(uint64_t key, uint32_t now) {
+    uint32_t diff = (static_cast<uint32_t>(key) - now) & kExpireMask;
+    return static_cast<int32_t>(diff << (32 - kExpireBits)) >>
+           (32 - kExpireBits);
+}
+
+inline bool isExpired(uint64_t key, uint32_t now) {
+    return secondsUntil(key, now) <= 0;
+}
+
+inline uint64_t withExpire(uint64_t key, uint32_t expire) {
+    return (key & ~kExpireMask) | (expire & kExpireMask);
+}
+
+// 向上取整到秒
+inline int64_t ceilSeconds(int64_t ms) { return (ms + 999) / 1000; }
+
+inline uint64_t pack(uint64_t tokens, uint32_t ts) {
+    return (tokens << 32) | ts;
+}
+
+inline uint64_t packWindow(uint64_t id, uint64_t prev, uint64_t cur) {
+    return ((id & kWindowIdMask) << (2 * kWindowCountBits)) |
+           (prev << kWindowCountBits) | cur;
+}
+
+// 有一层永远不会通过时整组也不会通过
+void mergeGroupDecision(LimitDecision* decision, const LimitDecision& member) {
+    decision->remaining = std::min(decision->remaining, member.remaining);
+    if (member.allowed) {
+        return;
+    }
+    decision->allowed = false;
+    if (member.retry_after_ms < 0 || decision->retry_after_ms < 0) {
+        decision->retry_after_ms = -1;
+    } else {
+        decision->retry_after_ms =
+            std::max(decision->retry_after_ms, member.retry_after_ms);
+    }
+}
+
+const std::chrono::steady_clock::time_point& epoch() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return epoch;
+}
+
+}    // namespace
+
+LocalBucketTable::LocalBucketTable(size_t capacity) {
+    size_t sets_per_shard = 1;
+    while (sets_per_shard * kWays * kShardCount < capacity) {
+        sets_per_shard <<= 1;
+    }
+
+    for (auto& shard : _shards) {
+        shard.sets.reset(new Set[sets_per_shard]);
+        shard.mask = sets_per_shard - 1;
+    }
+    _capacity = sets_per_shard * kWays * kShardCount;
+}
+
+uint32_t LocalBucketTable::nowMs() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - epoch());
+    // 时间戳为 0 表示桶尚未初始化
+    uint32_t now = static_cast<uint32_t>(elapsed.count());
+    return now == 0 ? 1 : now;
+}
+
+uint64_t LocalBucketTable::nowUs() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch());
+    return static_cast<uint64_t>(elapsed.count()) + 1;
+}
+
+uint32_t LocalBucketTable::nowSeconds() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now() - epoch());
+    return static_cast<uint32_t>(elapsed.count()) & kExpireMask;
+}
+
+LocalBucketTable::Slot* LocalBucketTable::findOrInsert(
+    std::string_view token, LimitAlgorithm algorithm,
+    uint64_t* fingerprint_out) {
+    // 同一个 token 切换算法后状态格式不同，不能复用原来的桶
+    uint64_t hash = std::hash<std::string_view>()(token) +
+                    static_cast<uint64_t>(algorithm) * 0x9E3779B97F4A7C15ULL;
+
+    Shard& shard = _shards[hash % kShardCount];
+    Set& set = shard.sets[(hash / kShardCount) & shard.mask];
+    const uint64_t fingerprint = fingerprintOf(hash);
+    const uint32_t now = nowSeconds();
+    *fingerprint_out = fingerprint;
+
+    // 命中没有过期的桶时只设置访问位，不加锁
+    for (Slot& slot : set.slots) {
+        uint64_t key = slot.key.load(std::memory_order_acquire);
+        if ((key & kFingerprintMask) != fingerprint) {
+            continue;
+        }
+        if (isExpired(key, now)) {
+            break;
+        }
+        if ((key & kReferenced) == 0) {
+            slot.key.fetch_or(kReferenced, std::memory_order_relaxed);
+        }
+        return &slot;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Slot* slot = nullptr;
+    for (Slot& candidate : set.slots) {
+        uint64_t key = candidate.key.load(std::memory_order_relaxed);
+        if ((key & kFingerprintMask) == fingerprint) {
+            slot = &candidate;
+            break;
+        }
+    }
+
+    if (slot == nullptr) {
+        slot = evict(&shard, &set, now);
+    } else if (!isExpired(slot->key.load(std::memory_order_relaxed), now)) {
+        // 其他线程刚刚插入或者重置了这个桶
+        return slot;
+    } else {
+        _expirations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 过期的桶与脚本中不存在的 key 一样按新建处理
+    dropLog(slot);
+    slot->state.store(0, std::memory_order_relaxed);
+    slot->key.store(withExpire(fingerprint | kReferenced, now + kInitialTtl),
+                    std::memory_order_release);
+    return slot;
+}
+
+LocalBucketTable::Slot* LocalBucketTable::evict(Shard* shard, Set* set,
+                                                uint32_t now) {
+    for (Slot& slot : set->slots) {
+        if (slot.key.load(std::memory_order_relaxed) == 0) {
+            return &slot;
+        }
+    }
+
+    for (Slot& slot : set->slots) {
+        if (isExpired(slot.key.load(std::memory_order_relaxed), now)) {
+            _expirations.fetch_add(1, std::memory_order_relaxed);
+            return &slot;
+        }
+    }
+
+    // 清除访问位直到找到最近没有被访问的桶，并发的查找可能重新设置访问位，
+    // 最多转两圈
+    Slot* victim = nullptr;
+    for (size_t i = 0; i < 2 * kWays; ++i) {
+        victim = &set->slots[shard->hand++ % kWays];
+        uint64_t key = victim->key.load(std::memory_order_relaxed);
+        if ((key & kReferenced) == 0) {
+            break;
+        }
+        victim->key.fetch_and(~kReferenced, std::memory_order_relaxed);
+    }
+    _evictions.fetch_add(1, std::memory_order_relaxed);
+    return victim;
+}
+
+void LocalBucketTable::renew(Slot* slot, uint64_t fingerprint,
+                             const TokenBucketConfig& config,
+                             const LimitDecision& decision) {
+    const uint32_t now = nowSeconds();
+    uint64_t key = slot->key.load(std::memory_order_relaxed);
+
+    int64_t ttl = 0;
+    if (config.algorithm == LimitAlgorithm::kTokenBucket) {
+        if (decision.allowed) {
+            ttl = kBucketTtl;
+        } else if (secondsUntil(key, now) < kDeniedRenewBelow) {
+            ttl = kDeniedTtl;
+        }
+    } else if (decision.allowed) {
+        // 其他脚本只在通过时写入，过期时间为状态失效所需的时间
+        switch (config.algorithm) {
+        case LimitAlgorithm::kGcra:
+            ttl = config.rate > 0
+                      ? ceilSeconds(config.burst * 1000 / config.rate)
+                      : 0;
+            break;
+        case LimitAlgorithm::kSlidingWindow:
+            ttl = ceilSeconds(config.window_ms * 2);
+            break;
+        default:
+            ttl = ceilSeconds(config.window_ms);
+            break;
+        }
+    }
+    if (ttl <= 0) {
+        return;
+    }
+
+    // 秒级精度，不缩短过期时间，同一个桶每秒最多写一次
+    ttl = std::min<int64_t>(ttl + 1, kExpireMask >> 1);
+    // 槽位已经分配给其他 token 时不再续期
+    while ((key & kFingerprintMask) == fingerprint &&
+           secondsUntil(key, now) < ttl) {
+        if (slot->key.compare_exchange_weak(
+                key, withExpire(key, now + static_cast<uint32_t>(ttl)),
+                std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+void LocalBucketTable::dropLog(const Slot* slot) {
+    if (!_has_logs.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    LogShard& shard = _log_shards[reinterpret_cast<uintptr_t>(slot) /
+                                  sizeof(Slot) % kShardCount];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.logs.erase(slot);
+}
+
+void LocalBucketTable::TryAcquire(std::string_view token,
+                                  const TokenBucketConfig& config,
+                                  int64_t cost, bool dry_run,
+                                  LimitDecision* decision) {
+    // cost 超过容量（包括被截断后的容量）时永远不会通过，在进入各算法的
+    // 无符号运算之前拒绝，否则调用方传入的超大 cost 会回绕成很小的值而被
+    // 放行。这时按试算 1 个单位得到剩余配额，不修改任何状态
+    const bool oversized = cost > maxCostOf(config);
+    if (oversized) {
+        cost = 1;
+    }
+
+    Slot* slot = nullptr;
+    uint64_t fingerprint = 0;
+    do {
+        slot = findOrInsert(token, config.algorithm, &fingerprint);
+        acquire(slot, config, cost, dry_run || oversized, decision);
+    } while (!ownedBy(slot, fingerprint));
+
+    if (oversized) {
+        decision->allowed = false;
+        decision->retry_after_ms = -1;
+        return;
+    }
+    if (!dry_run) {
+        renew(slot, fingerprint, config, *decision);
+    }
+}
+
+void LocalBucketTable::acquire(Slot* slot, const TokenBucketConfig& config,
+                               int64_t cost, bool dry_run,
+                               LimitDecision* decision) {
+    *decision = LimitDecision();
+    switch (config.algorithm) {
+    case LimitAlgorithm::kGcra:
+        acquireGcra(slot, config, cost, dry_run, decision);
+        break;
+    case LimitAlgorithm::kSlidingWindow:
+        acquireSlidingWindow(slot, config, cost, dry_run, decision);
+        break;
+    case LimitAlgorithm::kSlidingWindowLog:
+        acquireSlidingWindowLog(slot, config, cost, dry_run, decision);
+        break;
+    case LimitAlgorithm::kConcurrency:
+        acquireConcurrency(slot, config, cost, dry_run, decision);
+        break;
+    case LimitAlgorithm::kTokenBucket:
+    default:
+        acquireTokenBucket(slot, config, cost, dry_run, decision);
+        break;
+    }
+}
+
+bool LocalBucketTable::ownedBy(const Slot* slot, uint64_t fingerprint) {
+    return (slot->key.load(std::memory_order_acquire) & kFingerprintMask) ==
+           fingerprint;
+}
+
+void LocalBucketTable::TryAcquireGroup(
+    const std::vector<LimitGroupMember>& group, int64_t cost, bool dry_run,
+    LimitDecision* decision) {
+    *decision = LimitDecision();
+    decision->allowed = true;
+    decision->remaining = std::numeric_limits<int64_t>::max();
+    for (const auto& member : group) {
+        LimitDecision member_decision;
+        TryAcquire(member.token, member.config, cost, true, &member_decision);
+        mergeGroupDecision(decision, member_decision);
+    }
+
+    if (!decision->allowed || dry_run) {
+        return;
+    }
+
+    decision->remaining = std::numeric_limits<int64_t>::max();
+    for (const auto& member : group) {
+        LimitDecision member_decision;
+        TryAcquire(member.token, member.config, cost, false, &member_decision);
+        decision->remaining =
+            std::min(decision->remaining, member_decision.remaining);
+    }
+}
+
+void LocalBucketTable::Release(std::string_view token,
+                               const TokenBucketConfig& config,
+                               int64_t cost) {
+    if (config.algorithm != LimitAlgorithm::kConcurrency || cost <= 0) {
+        return;
+    }
+
+    Slot* slot = nullptr;
+    uint64_t fingerprint = 0;
+    do {
+        slot = findOrInsert(token, config.algorithm, &fingerprint);
+        uint64_t inflight = slot->state.load(std::memory_order_relaxed);
+        while (inflight != 0) {
+            uint64_t next = inflight > static_cast<uint64_t>(cost)
+                                ? inflight - static_cast<uint64_t>(cost)
+                                : 0;
+            if (slot->state.compare_exchange_weak(
+                    inflight, next, std::memory_order_acq_rel,
+                    std::memory_order_relaxed)) {
+                break;
+            }
+        }
+    } while (!ownedBy(slot, fingerprint));
+}
+
+void LocalBucketTable::acquireTokenBucket(Slot* slot,
+                                          const TokenBucketConfig& config,
+                                          int64_t cost, bool dry_run,
+                                          LimitDecision* decision) {
+    // rate 个令牌每秒，即 rate 个千分之一令牌每毫秒
+    const uint64_t refill_per_ms =
+        static_cast<uint64_t>(std::max<int64_t>(config.rate, 0));
+    const uint64_t capacity = std::min<uint64_t>(
+        static_cast<uint64_t>(std::max<int64_t>(config.burst, 0)) *
+            kTokenScale,
+        std::numeric_limits<uint32_t>::max());
+    const uint64_t need = static_cast<uint64_t>(cost) * kTokenScale;
+    const uint32_t now = nowMs();
+
+    uint64_t old_state = slot->state.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t tokens = capacity;
+        uint32_t ts = now;
+        if (old_state != 0) {
+            tokens = std::min<uint64_t>(old_state >> 32, capacity);
+            ts = static_cast<uint32_t>(old_state);
+            // 32 位毫秒时间戳回绕安全，桶闲置超过约 24 天才会失真
+            int32_t delta = static_cast<int32_t>(now - ts);
+            if (delta > 0) {
+                uint64_t missing = capacity - tokens;
+                if (refill_per_ms > 0 &&
+                    static_cast<uint64_t>(delta) >=
+                        (missing + refill_per_ms - 1) / refill_per_ms) {
+                    tokens = capacity;
+                } else {
+                    tokens += static_cast<uint64_t>(delta) * refill_per_ms;
+                }
+                ts = now;
+            }
+        }
+
+        decision->allowed = tokens >= need;
+        if (decision->allowed && !dry_run) {
+            tokens -= need;
+        }
+        decision->remaining = static_cast<int64_t>(tokens / kTokenScale);
+        if (!decision->allowed && refill_per_ms > 0) {
+            decision->retry_after_ms = static_cast<int64_t>(
+                (need - tokens + refill_per_ms - 1) / refill_per_ms);
+        }
+
+        uint64_t new_state = pack(tokens, ts);
+        if (dry_run || new_state == old_state) {
+            return;
+        }
+
+        if (slot->state.compare_exchange_weak(old_state, new_state,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+void LocalBucketTable::acquireGcra(Slot* slot, const TokenBucketConfig& config,
+                                   int64_t cost, bool dry_run,
+                                   LimitDecision* decision) {
+    if (config.rate <= 0) {
+        return;
+    }
+
+    const uint64_t interval = std::max<uint64_t>(
+        1000000 / static_cast<uint64_t>(config.rate), 1);
+    const uint64_t tolerance =
+        interval * static_cast<uint64_t>(std::max<int64_t>(config.burst, 0));
+    const uint64_t increment = interval * static_cast<uint64_t>(cost);
+    const uint64_t now = nowUs();
+
+    uint64_t tat = slot->state.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t start = std::max(tat, now);
+        uint64_t new_tat = start + increment;
+        if (new_tat - now > tolerance) {
+            decision->allowed = false;
+            decision->remaining = static_cast<int64_t>(
+                (now + tolerance - std::min(start, now + tolerance)) /
+                interval);
+            decision->retry_after_ms = static_cast<int64_t>(
+                (new_tat - now - tolerance + 999) / 1000);
+            return;
+        }
+
+        decision->allowed = true;
+        if (dry_run) {
+            decision->remaining =
+                static_cast<int64_t>((now + tolerance - start) / interval);
+            return;
+        }
+
+        if (slot->state.compare_exchange_weak(tat, new_tat,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+            decision->remaining =
+                static_cast<int64_t>((now + tolerance - new_tat) / interval);
+            return;
+        }
+    }
+}
+
+void LocalBucketTable::acquireSlidingWindow(Slot* slot,
+                                            const TokenBucketConfig& config,
+                                            int64_t cost, bool dry_run,
+                                            LimitDecision* decision) {
+    if (config.window_ms <= 0) {
+        return;
+    }
+
+    const uint64_t window_ms = static_cast<uint64_t>(config.window_ms);
+    const uint32_t now = nowMs();
+    const uint64_t window_id = (now / window_ms) & kWindowIdMask;
+    // 当前窗口已经过去的比例，按千分比计算
+    const uint64_t elapsed = (now % window_ms) * 1000 / window_ms;
+    const uint64_t max_count = std::min<uint64_t>(
+        static_cast<uint64_t>(std::max<int64_t>(config.burst, 0)),
+        kWindowCountMax);
+    const uint64_t need = static_cast<uint64_t>(cost);
+
+    uint64_t old_state = slot->state.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t id = old_state >> (2 * kWindowCountBits);
+        uint64_t prev = (old_state >> kWindowCountBits) & kWindowCountMax;
+        uint64_t cur = old_state & kWindowCountMax;
+        if (old_state == 0) {
+            prev = 0;
+            cur = 0;
+        } else if (id != window_id) {
+            prev = id == ((window_id - 1) & kWindowIdMask) ? cur : 0;
+            cur = 0;
+        }
+
+        uint64_t estimated = (prev * (1000 - elapsed) + 999) / 1000 + cur;
+        if (estimated + need > max_count) {
+            decision->allowed = false;
+            decision->remaining = static_cast<int64_t>(
+                max_count - std::min(estimated, max_count));
+            // 等到上一个窗口的权重衰减到足够小，否则至少等到下一个窗口
+            if (cur + need <= max_count && prev > 0) {
+                uint64_t room = max_count - cur - need;
+                uint64_t target = 1000 - std::min<uint64_t>(
+                                             room * 1000 / prev, 1000);
+                decision->retry_after_ms = static_cast<int64_t>(
+                    (std::max(target, elapsed) - elapsed) * window_ms / 1000 +
+                    1);
+            } else {
+                decision->retry_after_ms =
+                    static_cast<int64_t>(window_ms - now % window_ms);
+            }
+            return;
+        }
+
+        decision->allowed = true;
+        if (dry_run) {
+            decision->remaining =
+                static_cast<int64_t>(max_count - estimated);
+            return;
+        }
+
+        uint64_t new_state = packWindow(window_id, prev, cur + need);
+        if (slot->state.compare_exchange_weak(old_state, new_state,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+            decision->remaining =
+                static_cast<int64_t>(max_count - estimated - need);
+            return;
+        }
+    }
+}
+
+void LocalBucketTable::acquireSlidingWindowLog(
+    const Slot* slot, const TokenBucketConfig& config, int64_t cost,
+    bool dry_run, LimitDecision* decision) {
+    const uint32_t now = nowMs();
+    const size_t limit_count =
+        static_cast<size_t>(std::max<int64_t>(config.burst, 0));
+    const size_t need = static_cast<size_t>(cost);
+
+    LogShard& shard = _log_shards[reinterpret_cast<uintptr_t>(slot) /
+                                  sizeof(Slot) % kShardCount];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!_has_logs.load(std::memory_order_relaxed)) {
+        _has_logs.store(true, std::memory_order_relaxed);
+    }
+    std::deque<uint32_t>& log = shard.logs[slot];
+    while (!log.empty() &&
+           static_cast<int64_t>(static_cast<uint32_t>(now - log.front())) >=
+               config.window_ms) {
+        log.pop_front();
+    }
+
+    if (log.size() + need > limit_count) {
+        decision->allowed = false;
+        decision->remaining =
+            static_cast<int64_t>(limit_count - std::min(log.size(),
+                                                        limit_count));
+        if (need <= limit_count) {
+            // 等到最早的若干条记录移出窗口
+            uint32_t oldest = log[log.size() + need - limit_count - 1];
+            decision->retry_after_ms =
+                config.window_ms -
+                static_cast<int64_t>(static_cast<uint32_t>(now - oldest));
+        }
+        return;
+    }
+
+    decision->allowed = true;
+    if (!dry_run) {
+        log.insert(log.end(), need, now);
+    }
+    decision->remaining = static_cast<int64_t>(limit_count - log.size());
+}
+
+void LocalBucketTable::acquireConcurrency(Slot* slot,
+                                          const TokenBucketConfig& config,
+                                          int64_t cost, bool dry_run,
+                                          LimitDecision* decision) {
+    const uint64_t max_inflight =
+        static_cast<uint64_t>(std::max<int64_t>(config.burst, 0));
+    const uint64_t need = static_cast<uint64_t>(cost);
+
+    uint64_t inflight = slot->state.load(std::memory_order_relaxed);
+    while (true) {
+        if (inflight + need > max_inflight) {
+            // 并发数何时释放无法预知
+            decision->allowed = false;
+            decision->remaining = static_cast<int64_t>(
+                max_inflight - std::min(inflight, max_inflight));
+            return;
+        }
+
+        decision->allowed = true;
+        if (dry_run) {
+            decision->remaining =
+                static_cast<int64_t>(max_inflight - inflight);
+            return;
+        }
+
+        if (slot->state.compare_exchange_weak(inflight, inflight + need,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+            decision->remaining =
+                static_cast<int64_t>(max_inflight - inflight - need);
+            return;
+        }
+    }
+}
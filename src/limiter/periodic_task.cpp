@@ -0,0 +1,83 @@
+#include "limiter/periodic_task.h"
+
+#include <bthread/bthread.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+bool PeriodicTask::Start(const char* name,
+                         std::function<int64_t()> interval_ms,
+                         std::function<bool()> fn) {
+    std::lock_guard<bthread::Mutex> lock(_mutex);
+    _stopped = false;
+    if (_running) {
+        // 不能替换正在执行的 fn，这一次结束后由 run 继续调度
+        _restart = true;
+        return true;
+    }
+    _name = name;
+    _interval_ms = std::move(interval_ms);
+    _fn = std::move(fn);
+    return _scheduled || scheduleLocked();
+}
+
+void PeriodicTask::Stop() {
+    std::unique_lock<bthread::Mutex> lock(_mutex);
+    _stopped = true;
+    _restart = false;
+    // 定时器还没有到期时直接删除，否则等待这一次执行结束
+    if (_scheduled && bthread_timer_del(_timer) == 0) {
+        _scheduled = false;
+    }
+    while (_scheduled) {
+        _cond.wait(lock);
+    }
+}
+
+bool PeriodicTask::scheduleLocked() {
+    const int64_t interval_ms = std::max<int64_t>(_interval_ms(), 1);
+    if (bthread_timer_add(&_timer, butil::milliseconds_from_now(interval_ms),
+                          onTimer, this) != 0) {
+        LOG(ERROR) << "Failed to schedule " << _name << " timer";
+        _scheduled = false;
+        return false;
+    }
+    _scheduled = true;
+    return true;
+}
+
+void PeriodicTask::onTimer(void* arg) {
+    // 不在定时器线程中执行，避免耽误其他定时器
+    bthread_t tid;
+    if (bthread_start_background(&tid, nullptr, run, arg) != 0) {
+        run(arg);
+    }
+}
+
+void* PeriodicTask::run(void* arg) {
+    PeriodicTask* task = static_cast<PeriodicTask*>(arg);
+    {
+        std::lock_guard<bthread::Mutex> lock(task->_mutex);
+        if (task->_stopped) {
+            task->_scheduled = false;
+            task->_cond.notify_all();
+            return nullptr;
+        }
+        task->_running = true;
+    }
+
+    const bool again = task->_fn();
+
+    std::lock_guard<bthread::Mutex> lock(task->_mutex);
+    task->_running = false;
+    const bool restart = task->_restart;
+    task->_restart = false;
+    if (task->_stopped || !(again || restart) || !task->scheduleLocked()) {
+        task->_scheduled = false;
+        task->_cond.notify_all();
+    }
+    return nullptr;
+}
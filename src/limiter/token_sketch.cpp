@@ -0,0 +1,54 @@
+#include "limiter/token_sketch.h"
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+TokenSketch::TokenSketch(size_t capacity)
+    : _shard_capacity(std::max<size_t>(capacity / kShardCount, 1)) {}
+
+void TokenSketch::Add(const std::string& token) {
+    Shard& shard = _shards[std::hash<std::string>()(token) % kShardCount];
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto iter = shard.counters.find(token);
+    if (iter != shard.counters.end()) {
+        ++iter->second.count;
+        return;
+    }
+
+    if (shard.counters.size() < _shard_capacity) {
+        shard.counters[token].count = 1;
+        return;
+    }
+
+    // 替换计数最小的 token，新 token 继承它的计数。长尾 token 多时大部分
+    // 采样都会走到这里，复用被替换的节点和其中 token 的内存，不分配内存
+    auto min_iter = std::min_element(
+        shard.counters.begin(), shard.counters.end(),
+        [](const auto& a, const auto& b) {
+            return a.second.count < b.second.count;
+        });
+    auto node = shard.counters.extract(min_iter);
+    node.mapped().error = node.mapped().count;
+    ++node.mapped().count;
+    node.key() = token;
+    shard.counters.insert(std::move(node));
+}
+
+void TokenSketch::Drain(std::vector<std::pair<int64_t, std::string>>* counts) {
+    counts->clear();
+    for (auto& shard : _shards) {
+        std::unordered_map<std::string, Counter> counters;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            counters.swap(shard.counters);
+        }
+        for (auto& kv : counters) {
+            counts->emplace_back(kv.second.count - kv.second.error, kv.first);
+        }
+    }
+
+    std::sort(counts->begin(), counts->end(),
+              [](const auto& a, const auto& b) { return a.first > b.first; });
+}
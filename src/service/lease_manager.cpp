@@ -0,0 +1,293 @@
+#include "service/lease_manager.h"
+
+#include <brpc/callback.h>
+#include <bvar/bvar.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+
+DEFINE_int32(lease_ttl_ms, 1000,
+             "Lifetime of the tokens reserved from redis in lease mode");
+DEFINE_int64(lease_min_size, 1, "Min number of tokens reserved per lease");
+DEFINE_int64(lease_max_size, 10000, "Max number of tokens reserved per lease");
+
+bvar::Adder<int64_t> g_lease_local_pass("lease_local_pass");
+bvar::Adder<int64_t> g_lease_refill("lease_refill");
+bvar::Adder<int64_t> g_lease_granted("lease_granted");
+bvar::Adder<int64_t> g_lease_returned("lease_returned");
+
+LeaseManager::LeaseManager(RedisShardSet* redis_shards)
+    : _redis_shards(redis_shards) {}
+
+LeaseManager::~LeaseManager() {
+    // 回收会遍历 _shards 并归还租约，等它结束之后再释放
+    _sweep_task.Stop();
+}
+
+void LeaseManager::Start(const std::string& lease_script_sha1,
+                         bool packed_state, DegradeFunc degrade) {
+    _lease_script_sha1 = lease_script_sha1;
+    _packed_arg = packed_state ? "1" : "0";
+    _degrade = std::move(degrade);
+
+    _sweep_task.Start("lease sweep", [] { return FLAGS_lease_ttl_ms; },
+                      [this] {
+                          sweep();
+                          return true;
+                      });
+}
+
+LeaseManager::Lease* LeaseManager::findLease(const std::string& token,
+                                             bool create) {
+    Shard& shard = _shards[std::hash<std::string>()(token) % kShardCount];
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto iter = shard.leases.find(token);
+        if (iter != shard.leases.end()) {
+            return iter->second.get();
+        }
+    }
+
+    if (!create) {
+        return nullptr;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto& lease = shard.leases[token];
+    if (!lease) {
+        lease.reset(new Lease);
+        lease->token = token;
+    }
+    return lease.get();
+}
+
+bool LeaseManager::consume(Lease* lease, int64_t cost, int64_t now_us,
+                           int64_t* remaining_after) {
+    if (now_us >= lease->expire_us.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    int64_t remaining = lease->remaining.load(std::memory_order_relaxed);
+    while (remaining >= cost) {
+        if (lease->remaining.compare_exchange_weak(remaining, remaining - cost,
+                                                   std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed)) {
+            lease->consumed.fetch_add(cost, std::memory_order_relaxed);
+            *remaining_after = remaining - cost;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LeaseManager::TryConsume(const std::string& token, int64_t cost,
+                              int64_t* remaining) {
+    Lease* lease = findLease(token, false);
+    if (lease == nullptr) {
+        return false;
+    }
+
+    if (!consume(lease, cost, butil::monotonic_time_us(), remaining)) {
+        return false;
+    }
+
+    g_lease_local_pass << 1;
+    return true;
+}
+
+int64_t LeaseManager::leaseSize(Lease* lease, const TokenBucketConfig& config,
+                                int64_t now_us) {
+    // 根据两次续租之间本地消耗的令牌数估算 qps，租约大小为一个租期内的预计消耗量
+    if (lease->last_refill_us > 0 && now_us > lease->last_refill_us) {
+        double observed =
+            lease->consumed.exchange(0, std::memory_order_relaxed) * 1000000.0 /
+            (now_us - lease->last_refill_us);
+        lease->qps = lease->qps == 0 ? observed : (lease->qps + observed) / 2;
+    }
+    lease->last_refill_us = now_us;
+
+    int64_t size = static_cast<int64_t>(lease->qps * FLAGS_lease_ttl_ms / 1000);
+    size = std::max(size, FLAGS_lease_min_size);
+    size = std::min({size, FLAGS_lease_max_size, config.burst});
+    return size;
+}
+
+void LeaseManager::Acquire(const std::string& token,
+                           const TokenBucketConfig& config, int64_t cost,
+                           brpc::Controller* cntl,
+                           ::RateLimitResponse* response,
+                           ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+
+    int64_t now_us = butil::monotonic_time_us();
+    Lease* lease = findLease(token, true);
+    int64_t remaining = 0;
+    if (consume(lease, cost, now_us, &remaining)) {
+        response->set_allowed(true);
+        response->set_remaining(remaining);
+        g_lease_local_pass << 1;
+        return;
+    }
+
+    std::unique_lock<bthread::Mutex> lock(lease->mutex);
+    if (consume(lease, cost, now_us, &remaining)) {
+        response->set_allowed(true);
+        response->set_remaining(remaining);
+        g_lease_local_pass << 1;
+        return;
+    }
+
+    // 同一个 token 同时只有一个续租请求，其余请求等待续租结果
+    lease->waiters.push_back(
+        Waiter{cost, cntl, response, done_guard.release()});
+    lease->config = config;
+    if (lease->refilling) {
+        return;
+    }
+    lease->refilling = true;
+
+    int64_t give_back = 0;
+    if (now_us >= lease->expire_us.load(std::memory_order_acquire)) {
+        give_back = lease->remaining.exchange(0, std::memory_order_acq_rel);
+    }
+    int64_t want = std::max(leaseSize(lease, config, now_us), cost);
+    lock.unlock();
+
+    RefillCall* call = new RefillCall;
+    call->lease = lease;
+    call->shard = _redis_shards->Route(token);
+    call->timer.start();
+
+    brpc::RedisRequest redis_req;
+    redis_req.AddCommand("EVALSHA %s 1 %s %lld %lld %lld %lld %s",
+                         _lease_script_sha1.c_str(), token.c_str(),
+                         config.burst, config.rate, want, give_back,
+                         _packed_arg);
+
+    g_lease_refill << 1;
+    g_lease_returned << give_back;
+
+    auto callback =
+        brpc::NewCallback(this, &LeaseManager::onRefillComplete, call);
+    call->shard->channel()->CallMethod(nullptr, &call->redis_cntl, &redis_req,
+                                       &call->redis_response, callback);
+}
+
+void LeaseManager::onRefillComplete(RefillCall* call) {
+    std::unique_ptr<RefillCall> call_guard(call);
+    Lease* lease = call->lease;
+
+    call->timer.stop();
+
+    std::string error_text;
+    int64_t granted = 0;
+    if (call->redis_cntl.Failed()) {
+        error_text = "Failed to call redis: " + call->redis_cntl.ErrorText();
+    } else if (call->redis_response.reply_size() == 0) {
+        error_text = "Invalid response from redis";
+    } else if (call->redis_response.reply(0).type() !=
+               brpc::REDIS_REPLY_INTEGER) {
+        call->shard->OnReplyError(call->redis_response.reply(0));
+        error_text = "Invalid response type from redis";
+    } else {
+        granted = call->redis_response.reply(0).integer();
+    }
+    call->shard->OnCallEnd(!error_text.empty(), call->timer.u_elapsed());
+
+    std::vector<Waiter> waiters;
+    TokenBucketConfig config;
+    {
+        std::unique_lock<bthread::Mutex> lock(lease->mutex);
+        lease->refilling = false;
+        waiters.swap(lease->waiters);
+        config = lease->config;
+
+        int64_t available =
+            lease->remaining.exchange(0, std::memory_order_acq_rel) + granted;
+        if (error_text.empty()) {
+            for (auto& waiter : waiters) {
+                bool allowed = available >= waiter.cost;
+                if (allowed) {
+                    available -= waiter.cost;
+                    lease->consumed.fetch_add(waiter.cost,
+                                              std::memory_order_relaxed);
+                }
+                waiter.response->set_allowed(allowed);
+                waiter.response->set_remaining(available);
+            }
+            lease->expire_us.store(
+                butil::monotonic_time_us() + FLAGS_lease_ttl_ms * 1000L,
+                std::memory_order_release);
+        }
+        lease->remaining.store(available, std::memory_order_release);
+    }
+
+    g_lease_granted << granted;
+
+    // 与不使用租约的判断一样，redis 调用失败时按 fallback 策略降级
+    for (auto& waiter : waiters) {
+        if (!error_text.empty() &&
+            !(_degrade && _degrade(lease->token, config, waiter.cost,
+                                   waiter.response))) {
+            waiter.cntl->SetFailed(error_text);
+        }
+        waiter.done->Run();
+    }
+}
+
+void LeaseManager::sweep() {
+    int64_t now_us = butil::monotonic_time_us();
+    // 按 token 所在的分片分别发送
+    std::vector<brpc::RedisRequest> redis_reqs(_redis_shards->size());
+
+    // 把过期租约中没有用完的令牌归还给 redis
+    for (auto& shard : _shards) {
+        std::shared_lock<std::shared_mutex> shard_lock(shard.mutex);
+        for (auto& kv : shard.leases) {
+            Lease* lease = kv.second.get();
+            std::unique_lock<bthread::Mutex> lock(lease->mutex);
+            if (lease->refilling ||
+                now_us < lease->expire_us.load(std::memory_order_acquire)) {
+                continue;
+            }
+
+            int64_t give_back =
+                lease->remaining.exchange(0, std::memory_order_acq_rel);
+            if (give_back <= 0) {
+                continue;
+            }
+
+            RedisShard* redis_shard = _redis_shards->Route(lease->token);
+            redis_reqs[redis_shard->index()].AddCommand(
+                "EVALSHA %s 1 %s %lld %lld 0 %lld %s",
+                _lease_script_sha1.c_str(), lease->token.c_str(),
+                lease->config.burst, lease->config.rate, give_back,
+                _packed_arg);
+            g_lease_returned << give_back;
+        }
+    }
+
+    for (size_t i = 0; i < redis_reqs.size(); ++i) {
+        if (redis_reqs[i].command_size() == 0) {
+            continue;
+        }
+
+        brpc::Controller* redis_cntl = new brpc::Controller;
+        brpc::RedisResponse* redis_resp = new brpc::RedisResponse;
+        auto callback = brpc::NewCallback(&LeaseManager::onSweepComplete,
+                                          redis_cntl, redis_resp);
+        _redis_shards->shard(i)->channel()->CallMethod(
+            nullptr, redis_cntl, &redis_reqs[i], redis_resp, callback);
+    }
+}
+
+void LeaseManager::onSweepComplete(brpc::Controller* redis_cntl,
+                                   brpc::RedisResponse* redis_response) {
+    std::unique_ptr<brpc::Controller> redis_cntl_guard(redis_cntl);
+    std::unique_ptr<brpc::RedisResponse> redis_resp_guard(redis_response);
+
+    if (redis_cntl->Failed()) {
+        LOG(WARNING) << "Failed to return lease tokens to redis: "
+                     << redis_cntl->ErrorText();
+    }
+}
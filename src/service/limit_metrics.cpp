@@ -0,0 +1,116 @@
+#include "service/limit_metrics.h"
+
+#include <butil/fast_rand.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+DEFINE_int32(metrics_top_tokens, 20,
+             "Number of tokens exported with their own decision counters");
+DEFINE_int32(metrics_sample_rate, 16,
+             "Count one of every N decisions when ranking tokens by volume");
+DEFINE_int32(metrics_interval_ms, 10000,
+             "Interval of re-selecting the tokens exported by volume");
+
+namespace {
+
+const char* const kErrorNames[] = {
+    "config_not_found", "invalid_group", "breaker_open",
+    "redis_failed",     "invalid_reply", "overloaded",
+};
+static_assert(sizeof(kErrorNames) / sizeof(kErrorNames[0]) ==
+                  static_cast<size_t>(LimitError::kCount),
+              "kErrorNames must match LimitError");
+
+const char kOtherToken[] = "other";
+
+}    // namespace
+
+LimitMetrics::LimitMetrics()
+    : _config_lookup("limit_stage_config_lookup"),
+      _redis("limit_stage_redis"),
+      _callback("limit_stage_callback"),
+      _errors("limit_errors", {"type"}),
+      _decisions("limit_token_decisions", {"token", "outcome"}),
+      _sketch(std::max(FLAGS_metrics_top_tokens, 1) * 16) {
+    for (size_t i = 0; i < static_cast<size_t>(LimitError::kCount); ++i) {
+        _error_counters[i] = _errors.get_stats({kErrorNames[i]});
+    }
+    _other.pass = _decisions.get_stats({kOtherToken, "pass"});
+    _other.reject = _decisions.get_stats({kOtherToken, "reject"});
+}
+
+void LimitMetrics::Start() {
+    if (FLAGS_metrics_top_tokens <= 0) {
+        return;
+    }
+
+    _refresher.Start(
+        "metrics", [] { return FLAGS_metrics_interval_ms; },
+        [this] {
+            refresh();
+            return true;
+        });
+}
+
+size_t LimitMetrics::replaceTopTokens(TopTokens& bg, const TopTokens& top) {
+    bg = top;
+    return 1;
+}
+
+void LimitMetrics::RecordDecision(const std::string& token, bool allowed) {
+    const int32_t sample_rate = std::max(FLAGS_metrics_sample_rate, 1);
+    if (FLAGS_metrics_top_tokens > 0 &&
+        (sample_rate == 1 || butil::fast_rand_less_than(sample_rate) == 0)) {
+        _sketch.Add(token);
+    }
+
+    // 计数器在所有读者离开旧表之后才会被删除，只能在 Read 期间使用
+    butil::DoublyBufferedData<TopTokens>::ScopedPtr top;
+    if (_top_tokens.Read(&top) != 0) {
+        return;
+    }
+    auto iter = top->find(token);
+    const TokenCounters& counters =
+        iter == top->end() ? _other : iter->second;
+    *(allowed ? counters.pass : counters.reject) << 1;
+}
+
+void LimitMetrics::refresh() {
+    std::vector<std::pair<int64_t, std::string>> counts;
+    _sketch.Drain(&counts);
+    if (counts.size() > static_cast<size_t>(FLAGS_metrics_top_tokens)) {
+        counts.resize(FLAGS_metrics_top_tokens);
+    }
+
+    TopTokens old_top;
+    {
+        butil::DoublyBufferedData<TopTokens>::ScopedPtr top;
+        if (_top_tokens.Read(&top) == 0) {
+            old_top = *top;
+        }
+    }
+
+    TopTokens new_top;
+    for (const auto& count : counts) {
+        if (count.second == kOtherToken) {
+            continue;
+        }
+        TokenCounters counters;
+        counters.pass = _decisions.get_stats({count.second, "pass"});
+        counters.reject = _decisions.get_stats({count.second, "reject"});
+        new_top.emplace(count.second, counters);
+    }
+
+    _top_tokens.Modify(replaceTopTokens, new_top);
+
+    // Modify 返回后所有读者都已经看到新表，可以删除不再导出的计数器
+    for (const auto& kv : old_top) {
+        if (new_top.count(kv.first) == 0) {
+            _decisions.delete_stats({kv.first, "pass"});
+            _decisions.delete_stats({kv.first, "reject"});
+        }
+    }
+}
@@ -0,0 +1,308 @@
+#include "service/limit_stream.h"
+
+#include <brpc/errno.pb.h>
+#include <butil/logging.h>
+#include <butil/object_pool.h>
+#include <bvar/bvar.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "service/ratelimit_service_impl.h"
+
+DEFINE_int32(stream_max_tokens, 65536,
+             "Max number of tokens a limit stream can define");
+DEFINE_int32(stream_max_pending, 16384,
+             "Max number of decisions on a limit stream not yet written "
+             "back, beyond which the stream stops reading new frames");
+DEFINE_int32(stream_idle_timeout_s, 600,
+             "Close limit streams without any frame for this long, 0 to "
+             "never close");
+
+bvar::Adder<int64_t> g_limit_streams("limit_streams");
+bvar::Adder<int64_t> g_stream_decisions("limit_stream_decisions");
+
+// 一个判断帧的上下文，从 butil::ObjectPool 中获取，自身作为 CheckLimit 的
+// done。对象复用时请求中 token 的内存也一起复用
+class LimitStream::Call : public ::google::protobuf::Closure {
+public:
+    void Run() override {
+        LimitStreamResult result = {};
+        result.token_id = token_id;
+        std::string error_text;
+        if (cntl.Failed()) {
+            result.status = kStreamFailed;
+            result.remaining = cntl.ErrorCode();
+            error_text = cntl.ErrorText();
+        } else {
+            result.status =
+                response.allowed() ? kStreamAllowed : kStreamDenied;
+            result.remaining = response.remaining();
+            result.retry_after_ms = response.retry_after_ms();
+        }
+
+        LimitStream* owner = stream;
+        owner->complete(seq, result, std::move(error_text));
+
+        cntl.Reset();
+        request.Clear();
+        response.Clear();
+        stream = nullptr;
+        butil::return_object(this);
+        owner->unref();
+    }
+
+    LimitStream* stream = nullptr;
+    uint64_t seq = 0;
+    uint32_t token_id = 0;
+    brpc::Controller cntl;
+    ::RateLimitRequest request;
+    ::RateLimitResponse response;
+};
+
+LimitStream::LimitStream(RateLimitServiceImpl* service)
+    : _service(service),
+      _stream(brpc::INVALID_STREAM_ID),
+      _refs(1),
+      _first_seq(0),
+      _unsent_count(0),
+      _receiving(false),
+      _waiting_writable(false),
+      _closed(false) {}
+
+LimitStream::~LimitStream() = default;
+
+int LimitStream::Accept(RateLimitServiceImpl* service,
+                        brpc::Controller* cntl,
+                        ::LimitStreamResponse* response) {
+    LimitStream* stream = new LimitStream(service);
+    brpc::StreamOptions options;
+    options.handler = stream;
+    options.idle_timeout_ms = FLAGS_stream_idle_timeout_s > 0
+                                  ? FLAGS_stream_idle_timeout_s * 1000L
+                                  : -1;
+    if (brpc::StreamAccept(&stream->_stream, *cntl, &options) != 0) {
+        delete stream;
+        return -1;
+    }
+
+    g_limit_streams << 1;
+    response->set_max_tokens(FLAGS_stream_max_tokens);
+    return 0;
+}
+
+int LimitStream::on_received_messages(brpc::StreamId id,
+                                      butil::IOBuf* const messages[],
+                                      size_t size) {
+    {
+        std::lock_guard<bthread::Mutex> lock(_mutex);
+        _receiving = true;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < size && ok; ++i) {
+        ok = handleMessage(messages[i]);
+    }
+
+    {
+        std::lock_guard<bthread::Mutex> lock(_mutex);
+        _receiving = false;
+        flushLocked();
+    }
+
+    if (!ok) {
+        LOG_EVERY_SECOND(WARNING)
+            << "Malformed frame on limit stream " << id << ", closing it";
+        brpc::StreamClose(id);
+    }
+    return 0;
+}
+
+void LimitStream::on_idle_timeout(brpc::StreamId id) {
+    LOG(INFO) << "Limit stream " << id << " is idle, closing it";
+    brpc::StreamClose(id);
+}
+
+void LimitStream::on_closed(brpc::StreamId id) {
+    {
+        std::lock_guard<bthread::Mutex> lock(_mutex);
+        _closed = true;
+        _cond.notify_all();
+    }
+    g_limit_streams << -1;
+    unref();
+}
+
+bool LimitStream::handleMessage(butil::IOBuf* message) {
+    const uint32_t max_tokens = std::max(FLAGS_stream_max_tokens, 0);
+    while (!message->empty()) {
+        LimitStreamFrame frame;
+        if (message->cutn(&frame, sizeof(frame)) != sizeof(frame)) {
+            return false;
+        }
+
+        switch (frame.type) {
+        case kStreamDefineToken:
+            if (frame.token_id >= max_tokens ||
+                message->size() < frame.token_size) {
+                return false;
+            }
+            if (frame.token_id >= _tokens.size()) {
+                _tokens.resize(frame.token_id + 1);
+            }
+            _tokens[frame.token_id].clear();
+            message->cutn(&_tokens[frame.token_id], frame.token_size);
+            break;
+        case kStreamCheck:
+        case kStreamRelease:
+            handleCheck(frame);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+void LimitStream::handleCheck(const LimitStreamFrame& frame) {
+    uint64_t seq = 0;
+    if (!reserve(&seq)) {
+        return;
+    }
+    g_stream_decisions << 1;
+
+    if (frame.token_id >= _tokens.size() || _tokens[frame.token_id].empty()) {
+        fail(seq, frame.token_id, brpc::EREQUEST,
+             "Token id " + std::to_string(frame.token_id) +
+                 " is not defined on the stream");
+        return;
+    }
+
+    Call* call = butil::get_object<Call>();
+    if (call == nullptr) {
+        fail(seq, frame.token_id, brpc::EINTERNAL,
+             "Failed to allocate stream call");
+        return;
+    }
+    call->stream = this;
+    call->seq = seq;
+    call->token_id = frame.token_id;
+    call->request.set_token(_tokens[frame.token_id]);
+    // cost 与 unary 请求一样原样交给 CheckLimit：小于等于 0 时按 1 处理，
+    // 超过 burst 的 cost 在 LocalBucketTable 和 lua 脚本中直接拒绝，
+    // 不会进入无符号运算
+    call->request.set_cost(frame.cost);
+    call->request.set_dry_run(frame.flags & kStreamFlagDryRun);
+
+    _refs.fetch_add(1, std::memory_order_relaxed);
+    if (frame.type == kStreamRelease) {
+        _service->ReleaseLimit(&call->cntl, &call->request, &call->response,
+                               call);
+    } else {
+        _service->CheckLimit(&call->cntl, &call->request, &call->response,
+                             call);
+    }
+}
+
+bool LimitStream::reserve(uint64_t* seq) {
+    const size_t max_pending = std::max(FLAGS_stream_max_pending, 1);
+    std::unique_lock<bthread::Mutex> lock(_mutex);
+    while (!_closed && _pending.size() + _unsent_count >= max_pending) {
+        // 先写出已经完成的结果，再等待判断完成或者客户端读取
+        _receiving = false;
+        flushLocked();
+        if (_pending.size() + _unsent_count < max_pending) {
+            break;
+        }
+        _cond.wait(lock);
+    }
+    _receiving = true;
+    if (_closed) {
+        return false;
+    }
+
+    _pending.emplace_back();
+    *seq = _first_seq + _pending.size() - 1;
+    return true;
+}
+
+void LimitStream::complete(uint64_t seq, const LimitStreamResult& result,
+                           std::string error_text) {
+    std::lock_guard<bthread::Mutex> lock(_mutex);
+    Pending& pending = _pending[seq - _first_seq];
+    pending.done = true;
+    pending.result = result;
+    pending.error_text = std::move(error_text);
+
+    while (!_pending.empty() && _pending.front().done) {
+        Pending& front = _pending.front();
+        if (front.error_text.size() > UINT16_MAX) {
+            front.error_text.resize(UINT16_MAX);
+        }
+        front.result.error_size = front.error_text.size();
+        _unsent.append(&front.result, sizeof(front.result));
+        _unsent.append(front.error_text);
+        ++_unsent_count;
+        _pending.pop_front();
+        ++_first_seq;
+    }
+
+    if (!_receiving) {
+        flushLocked();
+    }
+}
+
+void LimitStream::fail(uint64_t seq, uint32_t token_id, int error_code,
+                       const std::string& error_text) {
+    LimitStreamResult result = {};
+    result.status = kStreamFailed;
+    result.token_id = token_id;
+    result.remaining = error_code;
+    complete(seq, result, error_text);
+}
+
+void LimitStream::flushLocked() {
+    if (_unsent.empty() || _waiting_writable) {
+        return;
+    }
+
+    if (!_closed) {
+        const int rc = brpc::StreamWrite(_stream, _unsent);
+        if (rc == EAGAIN) {
+            // 客户端读得慢，stream 缓冲已满，可写时再写出
+            _waiting_writable = true;
+            _refs.fetch_add(1, std::memory_order_relaxed);
+            brpc::StreamWait(_stream, nullptr, onWritable, this);
+            return;
+        }
+        if (rc != 0) {
+            LOG_EVERY_SECOND(WARNING)
+                << "Failed to write limit stream " << _stream << ": " << rc;
+        }
+    }
+
+    // stream 关闭后的结果直接丢弃
+    _unsent.clear();
+    _unsent_count = 0;
+    _cond.notify_all();
+}
+
+void LimitStream::onWritable(brpc::StreamId id, void* arg, int error_code) {
+    LimitStream* stream = static_cast<LimitStream*>(arg);
+    {
+        std::lock_guard<bthread::Mutex> lock(stream->_mutex);
+        stream->_waiting_writable = false;
+        if (error_code != 0) {
+            stream->_closed = true;
+        }
+        stream->flushLocked();
+    }
+    stream->unref();
+}
+
+void LimitStream::unref() {
+    if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
@@ -1,94 +1,397 @@
 #include "service/ratelimit_service_impl.h"
 
+#include <butil/object_pool.h>
+#include <bvar/bvar.h>
+
+#include <unistd.h>
+
+#include <algorithm>
 #include <fstream>
 
+#include "service/limit_stream.h"
+
 DEFINE_string(etcd_address, "127.0.0.1:2379", "Etcd server address");
 DEFINE_string(limit_conf_prefix, "conf/ratelimit/",
               "RateLimiter config prefix");
-DEFINE_string(redis_address, "127.0.0.1:6379", "Redis server address");
-DEFINE_string(redis_password, "", "Redis server password");
+DEFINE_string(limit_conf_file, "",
+              "Load token configs from this json file instead of etcd");
+DEFINE_string(limit_backend, "redis",
+              "Where limit state is kept: redis, or memory to decide in "
+              "process without redis");
+DEFINE_string(redis_state_encoding, "hash",
+              "How token bucket state is kept in redis: hash (tokens and "
+              "last_refill fields), or packed (one binary string written "
+              "with a single SET PX)");
+DEFINE_int32(memory_backend_capacity, 1 << 20,
+             "Max number of tokens kept by the memory backend, 16 bytes "
+             "each, inactive tokens are evicted beyond it");
+DEFINE_string(redis_address, "127.0.0.1:6379",
+              "Redis server address, comma separated for multiple shards");
+DEFINE_bool(redis_cluster, false,
+            "Treat redis_address as a Redis Cluster seed node and route "
+            "tokens by cluster slot");
+DEFINE_int32(local_bucket_capacity, 65536,
+             "Max number of tokens limited in process with mode=local, "
+             "inactive tokens are evicted beyond it");
+DEFINE_int32(denied_cache_capacity, 65536,
+             "Number of slots caching tokens rejected by redis until their "
+             "retry time, 0 to disable");
+DECLARE_int32(breaker_probe_interval_ms);
+
+DEFINE_int32(degrade_num_instances, 1,
+             "Number of ratelimit instances sharing a token when the redis "
+             "breaker is open and the token falls back to local limiting");
 
 bvar::LatencyRecorder g_latency_pass("limit_pass");
 bvar::LatencyRecorder g_latency_reject("limit_reject");
+bvar::LatencyRecorder g_latency_batch("limit_batch");
+bvar::Adder<int64_t> g_local_pass("local_limit_pass");
+bvar::Adder<int64_t> g_local_reject("local_limit_reject");
+bvar::Adder<int64_t> g_limit_degraded("limit_degraded");
 
-RateLimitServiceImpl::RateLimitServiceImpl(const std::string& limit_script)
-    : _conf_manager(FLAGS_etcd_address, FLAGS_limit_conf_prefix) {
-    brpc::ChannelOptions options;
-    options.protocol = brpc::PROTOCOL_REDIS;
-    options.max_retry = 3;
-    options.connect_timeout_ms = 500;
+static void appendLimitCommand(brpc::RedisRequest* request,
+                               const std::string& lua_script_sha1,
+                               const std::string& token,
+                               const TokenBucketConfig& config, int64_t cost,
+                               bool dry_run) {
+    RedisIntArg cost_arg;
+    cost_arg.set(cost);
 
-    if (_redis_channel.Init(FLAGS_redis_address.c_str(), &options) != 0) {
-        LOG(ERROR) << "Fail to initialize redis channel";
-        throw std::runtime_error("Fail to initialize redis channel");
+    const butil::StringPiece components[] = {
+        "EVALSHA",
+        lua_script_sha1,
+        "1",
+        token,
+        butil::StringPiece(config.script_args[0].data,
+                           config.script_args[0].size),
+        butil::StringPiece(config.script_args[1].data,
+                           config.script_args[1].size),
+        butil::StringPiece(cost_arg.data, cost_arg.size),
+        dry_run ? "1" : "0",
+    };
+    request->AddCommandByComponents(components, arraysize(components));
+}
+
+// KEYS 为各层的 token，ARGV = {cost, dry_run, 各层的 {算法, 参数1, 参数2}}，
+// packed_state 时令牌桶的算法名为 token_bucket_packed
+static void appendGroupCommand(brpc::RedisRequest* request,
+                               const std::string& lua_script_sha1,
+                               const std::vector<LimitGroupMember>& group,
+                               int64_t cost, bool dry_run,
+                               bool packed_state) {
+    RedisIntArg num_keys;
+    num_keys.set(static_cast<int64_t>(group.size()));
+    RedisIntArg cost_arg;
+    cost_arg.set(cost);
+
+    butil::StringPiece components[5 + 4 * kMaxLimitGroupSize];
+    size_t n = 0;
+    components[n++] = "EVALSHA";
+    components[n++] = lua_script_sha1;
+    components[n++] = butil::StringPiece(num_keys.data, num_keys.size);
+    for (const auto& member : group) {
+        components[n++] = member.token;
+    }
+    components[n++] = butil::StringPiece(cost_arg.data, cost_arg.size);
+    components[n++] = dry_run ? "1" : "0";
+    for (const auto& member : group) {
+        const TokenBucketConfig& config = member.config;
+        components[n++] =
+            packed_state && config.algorithm == LimitAlgorithm::kTokenBucket
+                ? "token_bucket_packed"
+                : GetLimitAlgorithmInfo(config.algorithm).name;
+        components[n++] = butil::StringPiece(config.script_args[0].data,
+                                             config.script_args[0].size);
+        components[n++] = butil::StringPiece(config.script_args[1].data,
+                                             config.script_args[1].size);
     }
+    request->AddCommandByComponents(components, n);
+}
 
-    if (!FLAGS_redis_password.empty()) {
-        brpc::Controller cnt;
-        brpc::RedisRequest req;
-        brpc::RedisResponse resp;
+// 限流脚本返回 {是否允许, 剩余配额, 重试等待时间}
+static bool parseLimitReply(const brpc::RedisReply& reply,
+                            LimitDecision* decision) {
+    if (!reply.is_array() || reply.size() < 3 || !reply[0].is_integer() ||
+        !reply[1].is_integer() || !reply[2].is_integer()) {
+        return false;
+    }
 
-        req.AddCommand("AUTH " + FLAGS_redis_password);
-        _redis_channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+    decision->allowed = reply[0].integer() != 0;
+    decision->remaining = reply[1].integer();
+    decision->retry_after_ms = reply[2].integer();
+    return true;
+}
 
-        if (cnt.Failed()) {
-            LOG(ERROR) << "Failed to authenticate redis: " << cnt.ErrorText();
-            throw std::runtime_error("Failed to authenticate redis");
+static void setDecision(::RateLimitResponse* response,
+                        const LimitDecision& decision) {
+    response->set_allowed(decision.allowed);
+    response->set_remaining(decision.remaining);
+    response->set_retry_after_ms(decision.retry_after_ms);
+}
+
+// CheckLimitBatch 中单项判断失败，不影响其余各项
+static void setItemError(::RateLimitResponse* response, int error_code,
+                         const std::string& error_text) {
+    response->Clear();
+    response->set_error_code(error_code);
+    response->set_error_text(error_text);
+}
+
+// 降级到本地限流时按实例数均分配额
+static TokenBucketConfig localDegradeConfig(const TokenBucketConfig& config) {
+    TokenBucketConfig local_config = config;
+    int64_t instances = std::max(FLAGS_degrade_num_instances, 1);
+    local_config.burst = std::max<int64_t>(config.burst / instances, 1);
+    local_config.rate = std::max<int64_t>(config.rate / instances, 1);
+    return local_config;
+}
+
+// 单次 CheckLimit 调用的上下文，从 butil::ObjectPool 的线程本地缓存中获取，
+// 自身作为 redis 调用的 done，稳态下每次判断不需要分配堆内存
+class CheckLimitCall : public RedisBatcher::Call,
+                       public ::google::protobuf::Closure {
+public:
+    static CheckLimitCall* New(RateLimitServiceImpl* service,
+                               RedisShard* shard, const std::string& token,
+                               const TokenBucketConfig& config, int64_t cost,
+                               bool dry_run, brpc::Controller* cntl,
+                               ::RateLimitResponse* response,
+                               ::google::protobuf::Closure* done) {
+        CheckLimitCall* call = butil::get_object<CheckLimitCall>();
+        if (call == nullptr) {
+            return nullptr;
         }
 
-        if (resp.reply_size() == 0 ||
-            resp.reply(0).type() != brpc::REDIS_REPLY_STATUS) {
-            LOG(ERROR) << "Invalid response from redis";
-            throw std::runtime_error("Invalid response from redis");
+        call->_service = service;
+        call->_shard = shard;
+        call->_token = &token;
+        call->_config = config;
+        call->_cost = cost;
+        call->_dry_run = dry_run;
+        call->_cntl = cntl;
+        call->_response = response;
+        call->_done = done;
+        call->_timer.start();
+        return call;
+    }
+
+    void set_shard(RedisShard* shard) { _shard = shard; }
+
+    // 已经占用了分片的并发，收到回复时归还
+    void set_admitted() { _admitted = true; }
+
+    // 限流组的各层，由调用方填充
+    std::vector<LimitGroupMember>* mutable_group() { return &_group; }
+
+    // 直接发送或者批量发送器真正发送时调用
+    void AppendCommand(brpc::RedisRequest* request) override {
+        _redis_timer.start();
+        if (_config.group_size > 0) {
+            appendGroupCommand(request, _service->_group_script_sha1, _group,
+                               _cost, _dry_run, _service->_packed_state);
+            return;
         }
+        appendLimitCommand(request,
+                           _service->scriptSha1(_config.algorithm), *_token,
+                           _config, _cost, _dry_run);
+    }
 
-        if (resp.reply(0).data() != "OK") {
-            LOG(ERROR) << "Failed to authenticate redis: "
-                       << resp.reply(0).data();
-            throw std::runtime_error("Failed to authenticate redis");
+    // 开启批量发送时交给分片的 RedisBatcher，否则直接发送
+    void Send() {
+        if (_shard->batcher() != nullptr) {
+            _shard->batcher()->Submit(this);
+            return;
         }
+
+        AppendCommand(&_redis_request);
+        _shard->channel()->CallMethod(nullptr, &_redis_cntl, &_redis_request,
+                                      &_redis_response, this);
     }
 
-    std::ifstream ifs(limit_script, std::ios::in | std::ios::binary);
-    if (!ifs) {
-        LOG(ERROR) << "Failed to open ratelimit.lua";
-        throw std::runtime_error("Failed to open ratelimit.lua");
+    // 直接发送时 redis 调用完成的回调
+    void Run() override {
+        const brpc::RedisReply* reply = nullptr;
+        if (_redis_response.reply_size() > 0) {
+            reply = &_redis_response.reply(0);
+        }
+        OnReply(&_redis_cntl, reply);
     }
 
-    std::ostringstream oss;
-    oss << ifs.rdbuf();
-    std::string lua_script = oss.str();
+    void OnReply(brpc::Controller* redis_cntl,
+                 const brpc::RedisReply* reply) override {
+        std::unique_ptr<CheckLimitCall, Recycler> self_guard(this);
+        if (_admitted) {
+            _shard->Release(1);
+        }
 
-    {
-        brpc::Controller cnt;
-        brpc::RedisRequest req;
-        brpc::RedisResponse resp;
+        _timer.stop();
+        _redis_timer.stop();
+        LimitMetrics& metrics = _service->_metrics;
+        metrics.RecordRedis(_redis_timer.n_elapsed());
 
-        req.AddCommand("SCRIPT LOAD %b", lua_script.data(), lua_script.size());
-        _redis_channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+        butil::Timer callback_timer;
+        callback_timer.start();
+        handleReply(redis_cntl, reply);
+        // done 中完成响应的序列化和发送，之后不能再访问请求和响应
+        _done->Run();
+        callback_timer.stop();
+        metrics.RecordCallback(callback_timer.n_elapsed());
+    }
 
-        if (cnt.Failed()) {
-            LOG(ERROR) << "Failed to load lua script: " << cnt.ErrorText();
-            exit(EXIT_FAILURE);
+    struct Recycler {
+        // _group 保留在对象中复用已分配的内存，只在 group_size 大于 0 时使用
+        void operator()(CheckLimitCall* call) const {
+            call->_redis_request.Clear();
+            call->_redis_response.Clear();
+            call->_redis_cntl.Reset();
+            call->_shard = nullptr;
+            call->_admitted = false;
+            call->_token = nullptr;
+            call->_cntl = nullptr;
+            call->_response = nullptr;
+            call->_done = nullptr;
+            butil::return_object(call);
         }
+    };
 
-        if (resp.reply_size() == 0 ||
-            resp.reply(0).type() != brpc::REDIS_REPLY_STRING) {
-            LOG(ERROR) << "Invalid response from redis";
-            exit(EXIT_FAILURE);
+private:
+    void handleReply(brpc::Controller* redis_cntl,
+                     const brpc::RedisReply* reply) {
+        LimitDecision decision;
+        bool failed = redis_cntl->Failed() || reply == nullptr ||
+                      !parseLimitReply(*reply, &decision);
+        _shard->OnCallEnd(failed, _timer.u_elapsed());
+        if (failed && reply != nullptr) {
+            _shard->OnReplyError(*reply);
         }
 
-        _lua_script_sha1 = resp.reply(0).data().as_string();
-        LOG(INFO) << "Lua script loaded: " << _lua_script_sha1;
+        if (failed) {
+            bool degraded =
+                _config.group_size > 0
+                    ? _service->degradeGroup(_group, _config, _cost, _dry_run,
+                                             &decision)
+                    : _service->degrade(*_token, _config, _cost, _dry_run,
+                                        &decision);
+            if (degraded) {
+                finish(decision);
+                return;
+            }
+
+            if (redis_cntl->Failed()) {
+                _service->_metrics.RecordError(LimitError::kRedisFailed);
+                _cntl->SetFailed("Failed to call redis: " +
+                                 redis_cntl->ErrorText());
+            } else {
+                _service->_metrics.RecordError(LimitError::kInvalidReply);
+                _cntl->SetFailed(reply == nullptr
+                                     ? "Invalid response from redis"
+                                     : "Invalid response type from redis");
+            }
+            return;
+        }
+
+        finish(decision);
+        if (decision.allowed) {
+            g_latency_pass << _timer.n_elapsed();
+        } else {
+            _service->_denied_cache.Insert(*_token, _cost, decision);
+            g_latency_reject << _timer.n_elapsed();
+        }
+    }
+
+    // 释放并发计数不是一次限流判断，不计入判断结果
+    void finish(const LimitDecision& decision) {
+        if (_cost < 0) {
+            setDecision(_response, decision);
+        } else {
+            _service->finishDecision(*_token, decision, _response);
+        }
+    }
+
+    RateLimitServiceImpl* _service = nullptr;
+    RedisShard* _shard = nullptr;
+    bool _admitted = false;
+    // 指向 RPC 请求中的 token，在 done 被调用之前一直有效
+    const std::string* _token = nullptr;
+    TokenBucketConfig _config;
+    std::vector<LimitGroupMember> _group;
+    int64_t _cost = 0;
+    bool _dry_run = false;
+    butil::Timer _timer;
+    // 从发送到收到 redis 回复的耗时，不包括在批量发送器中排队的时间
+    butil::Timer _redis_timer;
+    brpc::RedisRequest _redis_request;
+    brpc::Controller _redis_cntl;
+    brpc::RedisResponse _redis_response;
+    brpc::Controller* _cntl = nullptr;
+    ::RateLimitResponse* _response = nullptr;
+    ::google::protobuf::Closure* _done = nullptr;
+};
+
+RateLimitServiceImpl::RateLimitServiceImpl(const std::string& script_dir)
+    : _lease_manager(&_redis_shards),
+      _conf_manager(FLAGS_etcd_address, FLAGS_limit_conf_prefix,
+                    FLAGS_limit_conf_file),
+      _local_buckets(FLAGS_local_bucket_capacity),
+      _denied_cache(FLAGS_denied_cache_capacity) {
+    _metrics.Start();
+    if (FLAGS_limit_backend == "memory") {
+        _memory_buckets.reset(
+            new LocalBucketTable(FLAGS_memory_backend_capacity));
+        _service_id =
+            "ratelimit_service_instance_memory_" + std::to_string(getpid());
+        LOG(INFO) << "Using memory backend, Service ID: " << _service_id;
+        return;
+    }
+    if (FLAGS_limit_backend != "redis") {
+        throw std::runtime_error("Unknown limit_backend: " +
+                                 FLAGS_limit_backend);
+    }
+
+    if (FLAGS_redis_state_encoding != "hash" &&
+        FLAGS_redis_state_encoding != "packed") {
+        throw std::runtime_error("Unknown redis_state_encoding: " +
+                                 FLAGS_redis_state_encoding);
     }
+    _packed_state = FLAGS_redis_state_encoding == "packed";
+
+    _redis_shards.Init(FLAGS_redis_address, FLAGS_redis_cluster);
+
+    for (const auto& info : kLimitAlgorithms) {
+        // 两种格式的令牌桶脚本都能读取 hash 格式的状态，切换到 packed 时
+        // 不需要迁移，切换回 hash 之前需要等 packed 的 key 过期
+        const char* script =
+            _packed_state && info.algorithm == LimitAlgorithm::kTokenBucket
+                ? "ratelimit_packed.lua"
+                : info.script;
+        _lua_script_sha1[static_cast<size_t>(info.algorithm)] =
+            loadLuaScript(script_dir + "/" + script);
+    }
+    _group_script_sha1 = loadLuaScript(script_dir + "/ratelimit_group.lua");
+    _lease_manager.Start(
+        loadLuaScript(script_dir + "/ratelimit_lease.lua"), _packed_state,
+        [this](const std::string& token, const TokenBucketConfig& config,
+               int64_t cost, ::RateLimitResponse* response) {
+            LimitDecision decision;
+            if (!degrade(token, config, cost, false, &decision)) {
+                _metrics.RecordError(LimitError::kRedisFailed);
+                return false;
+            }
+            finishDecision(token, decision, response);
+            return true;
+        });
+    _hot_keys.Start();
 
     {
+        // 集群模式下需要发送到 key 所在的分片
+        brpc::Channel* channel =
+            _redis_shards.Route("ratelimit_service_id")->channel();
         brpc::Controller cnt;
         brpc::RedisRequest req;
         brpc::RedisResponse resp;
 
         req.AddCommand("SETNX ratelimit_service_id 0");
-        _redis_channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+        channel->CallMethod(nullptr, &cnt, &req, &resp, nullptr);
 
         if (cnt.Failed()) {
             LOG(ERROR) << "Failed to set unique service ID: "
@@ -99,7 +402,7 @@ RateLimitServiceImpl::RateLimitServiceImpl(const std::string& limit_script)
         cnt.Reset();
         req.Clear();
         req.AddCommand("INCR ratelimit_service_id");
-        _redis_channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+        channel->CallMethod(nullptr, &cnt, &req, &resp, nullptr);
 
         if (cnt.Failed()) {
             LOG(ERROR) << "Failed to increment unique service ID: "
@@ -119,6 +422,26 @@ RateLimitServiceImpl::RateLimitServiceImpl(const std::string& limit_script)
     }
 }
 
+std::string RateLimitServiceImpl::loadLuaScript(const std::string& path) {
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        LOG(ERROR) << "Failed to open " << path;
+        throw std::runtime_error("Failed to open " + path);
+    }
+
+    std::ostringstream oss;
+    oss << ifs.rdbuf();
+
+    std::string sha1;
+    if (!_redis_shards.LoadScript(oss.str(), &sha1)) {
+        LOG(ERROR) << "Failed to load lua script " << path;
+        exit(EXIT_FAILURE);
+    }
+
+    LOG(INFO) << "Lua script " << path << " loaded: " << sha1;
+    return sha1;
+}
+
 void RateLimitServiceImpl::CheckLimit(
     ::google::protobuf::RpcController* cntl_base,
     const ::RateLimitRequest* request, ::RateLimitResponse* response,
@@ -128,65 +451,603 @@ void RateLimitServiceImpl::CheckLimit(
 
     brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
 
-    std::string token = request->token();
+    const std::string& token = request->token();
 
     TokenBucketConfig config;
-    if (!_conf_manager.getTokenBucketConfig(token, config)) {
+    butil::Timer lookup_timer;
+    lookup_timer.start();
+    bool found = _conf_manager.getTokenBucketConfig(token, config);
+    lookup_timer.stop();
+    _metrics.RecordConfigLookup(lookup_timer.n_elapsed());
+    if (!found) {
+        _metrics.RecordError(LimitError::kConfigNotFound);
         cntl_base->SetFailed("Token config not found in etcd: " + token);
         return;
     }
 
-    butil::Timer* timer = new butil::Timer;
-    brpc::Controller* redis_cntl = new brpc::Controller;
-    brpc::RedisResponse* redis_resp = new brpc::RedisResponse;
+    int64_t cost = request->cost() > 0 ? request->cost() : 1;
+    const bool dry_run = request->dry_run();
 
-    timer->start();
+    if (_memory_buckets) {
+        LimitDecision decision;
+        std::string error_text;
+        if (checkInMemory(token, config, cost, dry_run, &decision,
+                          &error_text)) {
+            finishDecision(token, decision, response);
+        } else {
+            cntl->SetFailed(error_text);
+        }
+        return;
+    }
+
+    // redis 刚拒绝过的 token 在下一次有配额之前直接在本地拒绝
+    if (config.mode != LimitMode::kLocal) {
+        LimitDecision decision;
+        if (_denied_cache.Lookup(token, cost, &decision)) {
+            finishDecision(token, decision, response);
+            return;
+        }
+    }
+
+    if (config.group_size > 0) {
+        checkLimitGroup(token, config, cost, dry_run, cntl, response,
+                        done_guard.release());
+        return;
+    }
 
-    brpc::RedisRequest redis_req;
-    redis_req.AddCommand("EVALSHA %s 1 %s %lld %lld", _lua_script_sha1.c_str(),
-                         token.c_str(), config.burst, config.rate);
+    if (config.mode == LimitMode::kLocal) {
+        LimitDecision decision;
+        _local_buckets.TryAcquire(token, config, cost, dry_run, &decision);
+        finishDecision(token, decision, response);
+        if (decision.allowed) {
+            g_local_pass << 1;
+        } else {
+            g_local_reject << 1;
+        }
+        return;
+    }
 
-    auto callback = brpc::NewCallback(
-        &RateLimitServiceImpl::onRedisCallComplete, timer, redis_cntl, redis_resp,
-        cntl, response, done_guard.release());
+    applyHotKey(token, &config);
+
+    RedisShard* shard = _redis_shards.Route(token);
+    if (shard->IsOpen()) {
+        shed(token, config, nullptr, cost, dry_run, false, cntl, response);
+        return;
+    }
 
-    _redis_channel.CallMethod(nullptr, redis_cntl, &redis_req, redis_resp,
-                              callback);
+    // 试算时不动用租约，直接按 redis 中的令牌桶判断
+    if (config.mode == LimitMode::kLease && !dry_run) {
+        _lease_manager.Acquire(token, config, cost, cntl, response,
+                               done_guard.release());
+        return;
+    }
+
+    // redis 变慢时在途的调用不再无限堆积
+    if (!shard->TryAcquire(1)) {
+        shed(token, config, nullptr, cost, dry_run, true, cntl, response);
+        return;
+    }
+
+    CheckLimitCall* call = CheckLimitCall::New(
+        this, shard, token, config, cost, dry_run, cntl, response, done);
+    if (call == nullptr) {
+        shard->Release(1);
+        cntl->SetFailed("Failed to allocate CheckLimit call");
+        return;
+    }
+    call->set_admitted();
+    done_guard.release();
+    call->Send();
+}
+
+bool RateLimitServiceImpl::checkInMemory(const std::string& token,
+                                         const TokenBucketConfig& config,
+                                         int64_t cost, bool dry_run,
+                                         LimitDecision* decision,
+                                         std::string* error_text) {
+    if (config.group_size > 0) {
+        std::vector<LimitGroupMember> group;
+        if (!_conf_manager.getLimitGroup(token, &group)) {
+            _metrics.RecordError(LimitError::kInvalidGroup);
+            *error_text = "Invalid limit group config: " + token;
+            return false;
+        }
+        _memory_buckets->TryAcquireGroup(group, cost, dry_run, decision);
+    } else if (cost < 0) {
+        _memory_buckets->Release(token, config, -cost);
+        *decision = LimitDecision();
+        decision->allowed = true;
+    } else {
+        _memory_buckets->TryAcquire(token, config, cost, dry_run, decision);
+    }
+    return true;
+}
+
+void RateLimitServiceImpl::finishDecision(const std::string& token,
+                                          const LimitDecision& decision,
+                                          ::RateLimitResponse* response) {
+    setDecision(response, decision);
+    _metrics.RecordDecision(token, decision.allowed);
+}
+
+void RateLimitServiceImpl::applyHotKey(const std::string& token,
+                                       TokenBucketConfig* config) {
+    // 租约只支持令牌桶，其他算法的热点 token 仍然走 redis
+    if (config->mode != LimitMode::kRedis ||
+        config->algorithm != LimitAlgorithm::kTokenBucket) {
+        return;
+    }
+
+    _hot_keys.Record(token);
+    if (_hot_keys.IsHot(token)) {
+        config->mode = LimitMode::kLease;
+    }
 }
 
-void RateLimitServiceImpl::onRedisCallComplete(butil::Timer* timer,
-    brpc::Controller* redis_cntl, brpc::RedisResponse* redis_response,
-    brpc::Controller* cntl, ::RateLimitResponse* response,
+void RateLimitServiceImpl::checkLimitGroup(
+    const std::string& token, const TokenBucketConfig& config, int64_t cost,
+    bool dry_run, brpc::Controller* cntl, ::RateLimitResponse* response,
     ::google::protobuf::Closure* done) {
-    std::unique_ptr<butil::Timer> timer_guard(timer);
-    std::unique_ptr<brpc::Controller> redis_cntl_guard(redis_cntl);
-    std::unique_ptr<brpc::RedisResponse> redis_resp_guard(redis_response);
     brpc::ClosureGuard done_guard(done);
 
-    if (redis_cntl->Failed()) {
-        cntl->SetFailed("Failed to call redis: " + redis_cntl->ErrorText());
+    std::unique_ptr<CheckLimitCall, CheckLimitCall::Recycler> call(
+        CheckLimitCall::New(this, nullptr, token, config, cost, dry_run, cntl,
+                            response, done));
+    if (!call) {
+        cntl->SetFailed("Failed to allocate CheckLimit call");
         return;
     }
 
-    if (redis_response->reply_size() == 0) {
-        cntl->SetFailed("Invalid response from redis");
+    std::vector<LimitGroupMember>* group = call->mutable_group();
+    if (!_conf_manager.getLimitGroup(token, group)) {
+        _metrics.RecordError(LimitError::kInvalidGroup);
+        cntl->SetFailed("Invalid limit group config in etcd: " + token);
         return;
     }
 
-    const auto& reply = redis_response->reply(0);
+    std::string error_text;
+    RedisShard* shard = routeLimitGroup(token, *group, &error_text);
+    if (shard == nullptr) {
+        _metrics.RecordError(LimitError::kInvalidGroup);
+        cntl->SetFailed(error_text);
+        return;
+    }
 
-    if (reply.type() != brpc::REDIS_REPLY_INTEGER) {
-        cntl->SetFailed("Invalid response type from redis");
+    const bool open = shard->IsOpen();
+    if (open || !shard->TryAcquire(1)) {
+        shed(token, config, group, cost, dry_run, !open, cntl, response);
         return;
     }
 
-    timer->stop();
+    call->set_shard(shard);
+    call->set_admitted();
+    done_guard.release();
+    call.release()->Send();
+}
 
-    if (reply.integer() == 0) {
-        response->set_allowed(false);
-        g_latency_reject << timer->n_elapsed();
+void RateLimitServiceImpl::shed(const std::string& token,
+                                const TokenBucketConfig& config,
+                                const std::vector<LimitGroupMember>* group,
+                                int64_t cost, bool dry_run, bool overloaded,
+                                brpc::Controller* cntl,
+                                ::RateLimitResponse* response) {
+    LimitDecision decision;
+    bool degraded =
+        group == nullptr
+            ? degrade(token, config, cost, dry_run, &decision)
+            : degradeGroup(*group, config, cost, dry_run, &decision);
+    if (degraded) {
+        finishDecision(token, decision, response);
+        return;
+    }
+
+    if (overloaded) {
+        // 客户端收到 ELIMIT 后不应立即重试
+        _metrics.RecordError(LimitError::kOverloaded);
+        cntl->SetFailed(brpc::ELIMIT, "Redis shard is overloaded");
     } else {
+        _metrics.RecordError(LimitError::kBreakerOpen);
+        cntl->SetFailed("Redis circuit breaker is open");
+    }
+}
+
+RedisShard* RateLimitServiceImpl::routeLimitGroup(
+    const std::string& token, const std::vector<LimitGroupMember>& group,
+    std::string* error_text) const {
+    for (const auto& member : group) {
+        if (!GetLimitAlgorithmInfo(member.config.algorithm).groupable) {
+            *error_text = "Algorithm of " + member.token +
+                          " is not supported in limit group " + token;
+            return nullptr;
+        }
+    }
+
+    // 一次脚本调用只能访问同一个分片上的 key，集群模式下还必须在同一个
+    // 槽位上，各层的 token 需要使用相同的 {hash tag}
+    const std::string& first = group[0].token;
+    RedisShard* shard = _redis_shards.Route(first);
+    for (size_t i = 1; i < group.size(); ++i) {
+        const std::string& member = group[i].token;
+        if (_redis_shards.Route(member) != shard ||
+            (_redis_shards.cluster() &&
+             RedisShardSet::ClusterSlot(member) !=
+                 RedisShardSet::ClusterSlot(first))) {
+            *error_text = "Members of limit group " + token +
+                          " are not on the same redis slot, use a common "
+                          "{hash tag} in their tokens";
+            return nullptr;
+        }
+    }
+    return shard;
+}
+
+bool RateLimitServiceImpl::degradeGroup(
+    const std::vector<LimitGroupMember>& group,
+    const TokenBucketConfig& config, int64_t cost, bool dry_run,
+    LimitDecision* decision) {
+    if (config.fallback != FallbackPolicy::kLocal) {
+        return degrade(std::string(), config, cost, dry_run, decision);
+    }
+
+    // 本地扣减不是原子的，降级期间可以接受
+    std::vector<LimitGroupMember> local_group(group);
+    for (auto& member : local_group) {
+        member.config = localDegradeConfig(member.config);
+    }
+    _local_buckets.TryAcquireGroup(local_group, cost, dry_run, decision);
+
+    g_limit_degraded << 1;
+    return true;
+}
+
+bool RateLimitServiceImpl::degrade(const std::string& token,
+                                   const TokenBucketConfig& config,
+                                   int64_t cost, bool dry_run,
+                                   LimitDecision* decision) {
+    // 按实例数均分配额，在本地限流
+    TokenBucketConfig local_config = config;
+    if (config.fallback == FallbackPolicy::kLocal) {
+        local_config = localDegradeConfig(config);
+    }
+
+    *decision = LimitDecision();
+    if (cost < 0) {
+        if (config.fallback == FallbackPolicy::kFail) {
+            return false;
+        }
+        if (config.fallback == FallbackPolicy::kLocal && !dry_run) {
+            _local_buckets.Release(token, local_config, -cost);
+        }
+        decision->allowed = true;
+        g_limit_degraded << 1;
+        return true;
+    }
+
+    switch (config.fallback) {
+        case FallbackPolicy::kAllow:
+            decision->allowed = true;
+            break;
+        case FallbackPolicy::kDeny:
+            // 熔断器下一次探测之后再重试
+            decision->allowed = false;
+            decision->retry_after_ms = FLAGS_breaker_probe_interval_ms;
+            break;
+        case FallbackPolicy::kLocal:
+            _local_buckets.TryAcquire(token, local_config, cost, dry_run,
+                                      decision);
+            break;
+        default:
+            return false;
+    }
+
+    g_limit_degraded << 1;
+    return true;
+}
+
+void RateLimitServiceImpl::ReleaseLimit(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::RateLimitRequest* request, ::RateLimitResponse* response,
+    ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+
+    brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+
+    const std::string& token = request->token();
+
+    TokenBucketConfig config;
+    if (!_conf_manager.getTokenBucketConfig(token, config)) {
+        cntl->SetFailed("Token config not found in etcd: " + token);
+        return;
+    }
+
+    if (config.algorithm != LimitAlgorithm::kConcurrency) {
+        cntl->SetFailed("Token is not a concurrency limit: " + token);
+        return;
+    }
+
+    int64_t cost = request->cost() > 0 ? request->cost() : 1;
+
+    if (_memory_buckets) {
+        LimitDecision decision;
+        std::string error_text;
+        checkInMemory(token, config, -cost, false, &decision, &error_text);
+        setDecision(response, decision);
+        return;
+    }
+
+    if (config.mode == LimitMode::kLocal) {
+        _local_buckets.Release(token, config, cost);
         response->set_allowed(true);
-        g_latency_pass << timer->n_elapsed();
+        return;
+    }
+
+    RedisShard* shard = _redis_shards.Route(token);
+    if (shard->IsOpen()) {
+        LimitDecision decision;
+        if (degrade(token, config, -cost, false, &decision)) {
+            setDecision(response, decision);
+        } else {
+            cntl->SetFailed("Redis circuit breaker is open");
+        }
+        return;
+    }
+
+    // 并发限制脚本中 cost 为负数表示释放
+    CheckLimitCall* call = CheckLimitCall::New(
+        this, shard, token, config, -cost, false, cntl, response, done);
+    if (call == nullptr) {
+        cntl->SetFailed("Failed to allocate ReleaseLimit call");
+        return;
     }
+    done_guard.release();
+    call->Send();
+}
+
+void RateLimitServiceImpl::OpenLimitStream(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::LimitStreamRequest* request, ::LimitStreamResponse* response,
+    ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+
+    brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+    if (LimitStream::Accept(this, cntl, response) != 0) {
+        cntl->SetFailed(brpc::EREQUEST, "Failed to accept limit stream");
+    }
+}
+
+void RateLimitServiceImpl::CheckLimitBatch(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::RateLimitBatchRequest* request, ::RateLimitBatchResponse* response,
+    ::google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+
+    // 每个分片一个 pipeline，只为用到的分片创建
+    std::vector<std::unique_ptr<BatchShardCall>> shard_calls(
+        _redis_shards.size());
+    int num_shard_calls = 0;
+
+    // 单项失败时在对应的响应中设置错误码，不影响其余各项，
+    // 已经扣减的判断不会因为整个请求失败而被调用方重试
+    for (int i = 0; i < request->requests_size(); ++i) {
+        const auto& item = request->requests(i);
+        auto* result = response->add_responses();
+
+        TokenBucketConfig config;
+        butil::Timer lookup_timer;
+        lookup_timer.start();
+        bool found = _conf_manager.getTokenBucketConfig(item.token(), config);
+        lookup_timer.stop();
+        _metrics.RecordConfigLookup(lookup_timer.n_elapsed());
+        if (!found) {
+            _metrics.RecordError(LimitError::kConfigNotFound);
+            setItemError(result, brpc::EREQUEST,
+                         "Token config not found in etcd: " + item.token());
+            continue;
+        }
+
+        int64_t cost = item.cost() > 0 ? item.cost() : 1;
+        const bool dry_run = item.dry_run();
+
+        if (_memory_buckets) {
+            LimitDecision decision;
+            std::string error_text;
+            if (!checkInMemory(item.token(), config, cost, dry_run, &decision,
+                               &error_text)) {
+                setItemError(result, brpc::EINTERNAL, error_text);
+                continue;
+            }
+            finishDecision(item.token(), decision, result);
+            continue;
+        }
+
+        if (config.mode != LimitMode::kLocal) {
+            LimitDecision decision;
+            if (_denied_cache.Lookup(item.token(), cost, &decision)) {
+                finishDecision(item.token(), decision, result);
+                continue;
+            }
+        }
+
+        if (config.group_size == 0) {
+            applyHotKey(item.token(), &config);
+        }
+
+        if (config.mode == LimitMode::kLocal) {
+            LimitDecision decision;
+            _local_buckets.TryAcquire(item.token(), config, cost, dry_run,
+                                      &decision);
+            finishDecision(item.token(), decision, result);
+            continue;
+        } else if (config.mode == LimitMode::kLease && !dry_run) {
+            // 租约不足时不等待续租，直接走 redis 令牌桶
+            int64_t remaining = 0;
+            if (_lease_manager.TryConsume(item.token(), cost, &remaining)) {
+                result->set_allowed(true);
+                result->set_remaining(remaining);
+                continue;
+            }
+        }
+
+        std::vector<LimitGroupMember> group;
+        RedisShard* shard = nullptr;
+        if (config.group_size > 0) {
+            if (!_conf_manager.getLimitGroup(item.token(), &group)) {
+                _metrics.RecordError(LimitError::kInvalidGroup);
+                setItemError(result, brpc::EREQUEST,
+                             "Invalid limit group config in etcd: " +
+                                 item.token());
+                continue;
+            }
+            std::string error_text;
+            shard = routeLimitGroup(item.token(), group, &error_text);
+            if (shard == nullptr) {
+                _metrics.RecordError(LimitError::kInvalidGroup);
+                setItemError(result, brpc::EREQUEST, error_text);
+                continue;
+            }
+        } else {
+            shard = _redis_shards.Route(item.token());
+        }
+
+        if (shard->IsOpen()) {
+            LimitDecision decision;
+            bool degraded =
+                group.empty()
+                    ? degrade(item.token(), config, cost, dry_run, &decision)
+                    : degradeGroup(group, config, cost, dry_run, &decision);
+            if (!degraded) {
+                _metrics.RecordError(LimitError::kBreakerOpen);
+                setItemError(result, brpc::EINTERNAL,
+                             "Redis circuit breaker is open");
+                continue;
+            }
+            finishDecision(item.token(), decision, result);
+            continue;
+        }
+
+        auto& shard_call = shard_calls[shard->index()];
+        if (!shard_call) {
+            shard_call.reset(new BatchShardCall);
+            shard_call->shard = shard;
+            ++num_shard_calls;
+        }
+        if (group.empty()) {
+            appendLimitCommand(&shard_call->redis_request,
+                               scriptSha1(config.algorithm), item.token(),
+                               config, cost, dry_run);
+        } else {
+            appendGroupCommand(&shard_call->redis_request, _group_script_sha1,
+                               group, cost, dry_run, _packed_state);
+        }
+        shard_call->entries.push_back(BatchEntry{
+            i, &item.token(), config, cost, dry_run, std::move(group)});
+    }
+
+    if (num_shard_calls == 0) {
+        return;
+    }
+
+    BatchCall* batch_call = new BatchCall;
+    batch_call->timer.start();
+    batch_call->pending.store(num_shard_calls, std::memory_order_relaxed);
+    batch_call->response = response;
+    batch_call->done = done_guard.release();
+
+    for (auto& shard_call_guard : shard_calls) {
+        if (!shard_call_guard) {
+            continue;
+        }
+
+        BatchShardCall* shard_call = shard_call_guard.release();
+        shard_call->batch = batch_call;
+        // 分片过载时不发送，这一分片上的判断直接按降级策略处理
+        if (!shard_call->shard->TryAcquire(shard_call->entries.size())) {
+            shard_call->shed = true;
+            onRedisBatchCallComplete(shard_call);
+            continue;
+        }
+        shard_call->timer.start();
+        auto callback = brpc::NewCallback(
+            this, &RateLimitServiceImpl::onRedisBatchCallComplete, shard_call);
+        shard_call->shard->channel()->CallMethod(
+            nullptr, &shard_call->redis_cntl, &shard_call->redis_request,
+            &shard_call->redis_response, callback);
+    }
+}
+
+void RateLimitServiceImpl::onRedisBatchCallComplete(
+    BatchShardCall* shard_call) {
+    std::unique_ptr<BatchShardCall> shard_call_guard(shard_call);
+    BatchCall* batch_call = shard_call->batch;
+
+    ::RateLimitBatchResponse* response = batch_call->response;
+    const auto& redis_response = shard_call->redis_response;
+    const auto& entries = shard_call->entries;
+
+    std::string error_text;
+    if (shard_call->shed) {
+        error_text = "Redis shard is overloaded";
+    } else {
+        shard_call->shard->Release(entries.size());
+        shard_call->timer.stop();
+        _metrics.RecordRedis(shard_call->timer.n_elapsed());
+
+        if (shard_call->redis_cntl.Failed()) {
+            _metrics.RecordError(LimitError::kRedisFailed);
+            error_text =
+                "Failed to call redis: " + shard_call->redis_cntl.ErrorText();
+        } else if (redis_response.reply_size() !=
+                   static_cast<int>(entries.size())) {
+            _metrics.RecordError(LimitError::kInvalidReply);
+            error_text = "Invalid response from redis";
+        }
+        shard_call->shard->OnCallEnd(!error_text.empty(),
+                                     shard_call->timer.u_elapsed());
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const auto& entry = entries[i];
+        auto* result = response->mutable_responses(entry.index);
+
+        LimitDecision decision;
+        if (error_text.empty()) {
+            const brpc::RedisReply& reply = redis_response.reply(i);
+            if (parseLimitReply(reply, &decision)) {
+                _denied_cache.Insert(*entry.token, entry.cost, decision);
+                finishDecision(*entry.token, decision, result);
+                continue;
+            }
+            _metrics.RecordError(LimitError::kInvalidReply);
+            shard_call->shard->OnReplyError(reply);
+        }
+
+        bool degraded =
+            entry.group.empty()
+                ? degrade(*entry.token, entry.config, entry.cost,
+                          entry.dry_run, &decision)
+                : degradeGroup(entry.group, entry.config, entry.cost,
+                               entry.dry_run, &decision);
+        if (!degraded) {
+            if (shard_call->shed) {
+                _metrics.RecordError(LimitError::kOverloaded);
+            }
+            setItemError(result,
+                         shard_call->shed ? brpc::ELIMIT : brpc::EINTERNAL,
+                         error_text.empty() ? "Invalid response type from redis"
+                                            : error_text);
+            continue;
+        }
+        finishDecision(*entry.token, decision, result);
+    }
+
+    // 最后一个完成的分片负责结束整个请求
+    if (batch_call->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    std::unique_ptr<BatchCall> batch_call_guard(batch_call);
+    brpc::ClosureGuard done_guard(batch_call->done);
+
+    batch_call->timer.stop();
+    g_latency_batch << batch_call->timer.n_elapsed();
 }
\ No newline at end of file
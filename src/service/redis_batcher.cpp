@@ -0,0 +1,139 @@
+#include "service/redis_batcher.h"
+
+#include <brpc/callback.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+
+bvar::LatencyRecorder g_redis_batch_size("redis_batch_size");
+bvar::LatencyRecorder g_redis_batch_queue_delay("redis_batch_queue_delay");
+
+RedisBatcher::RedisBatcher(brpc::Channel* channel, int64_t window_us,
+                           size_t max_batch_size)
+    : _channel(channel),
+      _window_us(window_us),
+      _max_batch_size(max_batch_size > 0 ? max_batch_size : 1),
+      _timer_armed(false),
+      _timer(0),
+      _running_flushes(0) {
+    _pending.reserve(_max_batch_size);
+}
+
+RedisBatcher::~RedisBatcher() {
+    std::unique_lock<bthread::Mutex> lock(_mutex);
+    if (_timer_armed && bthread_timer_del(_timer) == 0) {
+        _timer_armed = false;
+    }
+    // 定时器已经触发时 runFlush 还持有 this，等它结束
+    while (_timer_armed || _running_flushes > 0) {
+        _flush_done.wait(lock);
+    }
+    lock.unlock();
+    flush();
+}
+
+void RedisBatcher::Submit(Call* call) {
+    call->_enqueue_us = butil::cpuwide_time_us();
+
+    CallList* ready = nullptr;
+    {
+        std::unique_lock<bthread::Mutex> lock(_mutex);
+        _pending.push_back(call);
+
+        if (_pending.size() >= _max_batch_size) {
+            ready = new CallList;
+            ready->reserve(_max_batch_size);
+            ready->swap(_pending);
+            if (_timer_armed && bthread_timer_del(_timer) == 0) {
+                _timer_armed = false;
+            }
+        } else if (!_timer_armed) {
+            if (bthread_timer_add(&_timer,
+                                  butil::microseconds_from_now(_window_us),
+                                  onTimer, this) == 0) {
+                _timer_armed = true;
+            } else {
+                ready = new CallList;
+                ready->swap(_pending);
+            }
+        }
+    }
+
+    if (ready != nullptr) {
+        send(ready);
+    }
+}
+
+void RedisBatcher::onTimer(void* arg) {
+    // 定时器线程中不能做耗时操作，交给 bthread 发送
+    bthread_t tid;
+    if (bthread_start_background(&tid, nullptr, runFlush, arg) != 0) {
+        runFlush(arg);
+    }
+}
+
+void* RedisBatcher::runFlush(void* arg) {
+    RedisBatcher* batcher = static_cast<RedisBatcher*>(arg);
+    {
+        std::unique_lock<bthread::Mutex> lock(batcher->_mutex);
+        batcher->_timer_armed = false;
+        ++batcher->_running_flushes;
+    }
+    batcher->flush();
+
+    std::unique_lock<bthread::Mutex> lock(batcher->_mutex);
+    --batcher->_running_flushes;
+    batcher->_flush_done.notify_all();
+    return nullptr;
+}
+
+void RedisBatcher::flush() {
+    CallList* ready = new CallList;
+    {
+        std::unique_lock<bthread::Mutex> lock(_mutex);
+        ready->swap(_pending);
+        _pending.reserve(_max_batch_size);
+    }
+
+    if (ready->empty()) {
+        delete ready;
+        return;
+    }
+
+    send(ready);
+}
+
+void RedisBatcher::send(CallList* calls) {
+    brpc::RedisRequest redis_req;
+    int64_t now_us = butil::cpuwide_time_us();
+    for (Call* call : *calls) {
+        call->AppendCommand(&redis_req);
+        g_redis_batch_queue_delay << now_us - call->_enqueue_us;
+    }
+    g_redis_batch_size << static_cast<int64_t>(calls->size());
+
+    brpc::Controller* redis_cntl = new brpc::Controller;
+    brpc::RedisResponse* redis_resp = new brpc::RedisResponse;
+
+    auto callback = brpc::NewCallback(&RedisBatcher::onBatchComplete,
+                                      redis_cntl, redis_resp, calls);
+
+    _channel->CallMethod(nullptr, redis_cntl, &redis_req, redis_resp,
+                         callback);
+}
+
+void RedisBatcher::onBatchComplete(brpc::Controller* redis_cntl,
+                                   brpc::RedisResponse* redis_response,
+                                   CallList* calls) {
+    std::unique_ptr<brpc::Controller> redis_cntl_guard(redis_cntl);
+    std::unique_ptr<brpc::RedisResponse> redis_resp_guard(redis_response);
+    std::unique_ptr<CallList> calls_guard(calls);
+
+    for (size_t i = 0; i < calls->size(); ++i) {
+        const brpc::RedisReply* reply = nullptr;
+        if (!redis_cntl->Failed() &&
+            static_cast<int>(i) < redis_response->reply_size()) {
+            reply = &redis_response->reply(i);
+        }
+        (*calls)[i]->OnReply(redis_cntl, reply);
+    }
+}
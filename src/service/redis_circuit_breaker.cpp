@@ -0,0 +1,132 @@
+#include "service/redis_circuit_breaker.h"
+
+#include <brpc/redis.h>
+#include <butil/time.h>
+#include <gflags/gflags.h>
+
+DEFINE_int32(breaker_window_ms, 1000,
+             "Time window to compute redis error and slow call ratio");
+DEFINE_int32(breaker_min_calls, 20,
+             "Min number of redis calls in a window before breaker can trip");
+DEFINE_double(breaker_error_ratio, 0.5,
+              "Trip the breaker when redis error ratio reaches this value");
+DEFINE_int32(breaker_slow_call_us, 50000,
+             "Redis calls slower than this are counted as slow calls");
+DEFINE_double(breaker_slow_ratio, 0.5,
+              "Trip the breaker when redis slow call ratio reaches this value");
+DEFINE_int32(breaker_probe_interval_ms, 500,
+             "Interval to probe redis while the breaker is open");
+
+bvar::Adder<int64_t> g_breaker_trips("redis_breaker_trips");
+bvar::Adder<int64_t> g_breaker_recoveries("redis_breaker_recoveries");
+
+RedisCircuitBreaker::RedisCircuitBreaker(brpc::Channel* channel,
+                                         const std::string& name)
+    : _channel(channel),
+      _open(false),
+      _window_start_us(butil::monotonic_time_us()),
+      _calls(0),
+      _errors(0),
+      _slow_calls(0),
+      _open_status(name, getOpenStatus, this) {}
+
+int RedisCircuitBreaker::getOpenStatus(void* arg) {
+    return static_cast<RedisCircuitBreaker*>(arg)->IsOpen() ? 1 : 0;
+}
+
+RedisCircuitBreaker::~RedisCircuitBreaker() {
+    _probe_task.Stop();
+}
+
+void RedisCircuitBreaker::resetWindow(int64_t now_us) {
+    _calls.store(0, std::memory_order_relaxed);
+    _errors.store(0, std::memory_order_relaxed);
+    _slow_calls.store(0, std::memory_order_relaxed);
+    _window_start_us.store(now_us, std::memory_order_release);
+}
+
+void RedisCircuitBreaker::OnCallEnd(bool failed, int64_t latency_us) {
+    if (IsOpen()) {
+        return;
+    }
+
+    int64_t calls = _calls.fetch_add(1, std::memory_order_relaxed) + 1;
+    int64_t errors = _errors.load(std::memory_order_relaxed);
+    int64_t slow_calls = _slow_calls.load(std::memory_order_relaxed);
+    if (failed) {
+        errors = _errors.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    if (latency_us >= FLAGS_breaker_slow_call_us) {
+        slow_calls = _slow_calls.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    if (calls >= FLAGS_breaker_min_calls &&
+        (errors >= calls * FLAGS_breaker_error_ratio ||
+         slow_calls >= calls * FLAGS_breaker_slow_ratio)) {
+        trip();
+        return;
+    }
+
+    int64_t now_us = butil::monotonic_time_us();
+    int64_t window_start_us = _window_start_us.load(std::memory_order_acquire);
+    if (now_us - window_start_us >= FLAGS_breaker_window_ms * 1000L &&
+        _window_start_us.compare_exchange_strong(window_start_us, now_us)) {
+        resetWindow(now_us);
+    }
+}
+
+void RedisCircuitBreaker::trip() {
+    bool expected = false;
+    if (!_open.compare_exchange_strong(expected, true)) {
+        return;
+    }
+
+    g_breaker_trips << 1;
+    LOG(ERROR) << "Redis circuit breaker " << _open_status.name()
+               << " is open, calls=" << _calls.load()
+               << ", errors=" << _errors.load()
+               << ", slow_calls=" << _slow_calls.load();
+
+    if (!_probe_task.Start(
+            "redis probe", [] { return FLAGS_breaker_probe_interval_ms; },
+            [this] { return probeOnce(); })) {
+        resetWindow(butil::monotonic_time_us());
+        _open.store(false);
+    }
+}
+
+bool RedisCircuitBreaker::probeOnce() {
+    if (!probe()) {
+        return true;
+    }
+
+    resetWindow(butil::monotonic_time_us());
+    _open.store(false);
+    g_breaker_recoveries << 1;
+    LOG(INFO) << "Redis circuit breaker " << _open_status.name()
+              << " is closed";
+    return false;
+}
+
+bool RedisCircuitBreaker::probe() {
+    brpc::Controller cntl;
+    brpc::RedisRequest req;
+    brpc::RedisResponse resp;
+
+    cntl.set_timeout_ms(FLAGS_breaker_probe_interval_ms);
+    cntl.set_max_retry(0);
+    req.AddCommand("PING");
+    _channel->CallMethod(nullptr, &cntl, &req, &resp, nullptr);
+
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Redis probe failed: " << cntl.ErrorText();
+        return false;
+    }
+
+    if (resp.reply_size() == 0 || resp.reply(0).is_error()) {
+        LOG(WARNING) << "Redis probe got invalid response";
+        return false;
+    }
+
+    return cntl.latency_us() < FLAGS_breaker_slow_call_us;
+}
@@ -0,0 +1,142 @@
+#include "service/redis_concurrency_limiter.h"
+
+#include <butil/time.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <cmath>
+
+DEFINE_bool(redis_adaptive_concurrency, true,
+            "Shed redis calls beyond an adaptive per shard concurrency limit");
+DEFINE_int32(redis_initial_concurrency, 256,
+             "Initial concurrency limit of each redis shard");
+DEFINE_int32(redis_min_concurrency, 16,
+             "Min concurrency limit of each redis shard");
+DEFINE_int32(redis_max_concurrency, 4096,
+             "Max concurrency limit of each redis shard");
+DEFINE_int32(redis_concurrency_window_ms, 100,
+             "Sample window to update the redis concurrency limit");
+DEFINE_int32(redis_concurrency_min_samples, 20,
+             "Min number of redis calls in a window to update the limit");
+DEFINE_double(redis_concurrency_tolerance, 1.5,
+              "Latency over no-load latency tolerated before the limit "
+              "shrinks");
+DEFINE_double(redis_concurrency_smoothing, 0.2,
+              "Weight of each window when updating the limit");
+
+namespace {
+
+// 失败时上限的退让比例
+const double kFailureBackoff = 0.9;
+// 窗口平均耗时高于无负载耗时时，后者每个窗口向前者靠近的比例，
+// 跟上 redis 持续的耗时变化
+const double kNoloadDrift = 0.01;
+
+}    // namespace
+
+RedisConcurrencyLimiter::RedisConcurrencyLimiter(const std::string& name)
+    : _limit(FLAGS_redis_initial_concurrency),
+      _inflight(0),
+      _window_start_us(butil::monotonic_time_us()),
+      _samples(0),
+      _latency_sum_us(0),
+      _failures(0),
+      _max_inflight(0),
+      _estimated_limit(FLAGS_redis_initial_concurrency),
+      _noload_latency_us(0),
+      _limit_status(name + "_concurrency_limit", getLimit, this),
+      _inflight_status(name + "_inflight", getInflight, this) {
+    _shed.expose(name + "_shed");
+}
+
+int64_t RedisConcurrencyLimiter::getLimit(void* arg) {
+    return static_cast<RedisConcurrencyLimiter*>(arg)->limit();
+}
+
+int64_t RedisConcurrencyLimiter::getInflight(void* arg) {
+    return static_cast<RedisConcurrencyLimiter*>(arg)->inflight();
+}
+
+bool RedisConcurrencyLimiter::TryAcquire(int64_t n) {
+    const int64_t inflight =
+        _inflight.fetch_add(n, std::memory_order_relaxed) + n;
+    if (FLAGS_redis_adaptive_concurrency && inflight > n &&
+        inflight > limit()) {
+        _inflight.fetch_sub(n, std::memory_order_relaxed);
+        _shed << n;
+        return false;
+    }
+
+    int64_t max_inflight = _max_inflight.load(std::memory_order_relaxed);
+    while (inflight > max_inflight &&
+           !_max_inflight.compare_exchange_weak(max_inflight, inflight,
+                                                std::memory_order_relaxed)) {
+    }
+    return true;
+}
+
+void RedisConcurrencyLimiter::Release(int64_t n) {
+    _inflight.fetch_sub(n, std::memory_order_relaxed);
+}
+
+void RedisConcurrencyLimiter::OnCallEnd(bool failed, int64_t latency_us) {
+    _samples.fetch_add(1, std::memory_order_relaxed);
+    if (failed) {
+        _failures.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        _latency_sum_us.fetch_add(latency_us, std::memory_order_relaxed);
+    }
+
+    const int64_t window_us = FLAGS_redis_concurrency_window_ms * 1000L;
+    int64_t now_us = butil::monotonic_time_us();
+    int64_t window_start_us = _window_start_us.load(std::memory_order_acquire);
+    if (now_us - window_start_us >= window_us &&
+        _samples.load(std::memory_order_relaxed) >=
+            FLAGS_redis_concurrency_min_samples &&
+        _window_start_us.compare_exchange_strong(window_start_us, now_us)) {
+        updateLimit();
+    }
+}
+
+void RedisConcurrencyLimiter::updateLimit() {
+    const int64_t samples = _samples.exchange(0, std::memory_order_relaxed);
+    const int64_t latency_sum_us =
+        _latency_sum_us.exchange(0, std::memory_order_relaxed);
+    const int64_t failures = _failures.exchange(0, std::memory_order_relaxed);
+    const int64_t max_inflight = _max_inflight.exchange(
+        _inflight.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    double new_limit = _estimated_limit;
+    if (failures > 0) {
+        new_limit = _estimated_limit * kFailureBackoff;
+    } else if (samples > 0) {
+        const double latency_us =
+            std::max<double>(static_cast<double>(latency_sum_us) / samples, 1);
+        if (_noload_latency_us <= 0 || latency_us < _noload_latency_us) {
+            _noload_latency_us = latency_us;
+        } else {
+            _noload_latency_us +=
+                (latency_us - _noload_latency_us) * kNoloadDrift;
+        }
+
+        const double gradient = std::clamp(
+            FLAGS_redis_concurrency_tolerance * _noload_latency_us /
+                latency_us,
+            0.5, 1.0);
+        new_limit = _estimated_limit * gradient + std::sqrt(_estimated_limit);
+        // 请求量没有用到一半上限时不继续放大，避免空闲时上限无限增长
+        if (max_inflight * 2 < _estimated_limit) {
+            new_limit = std::min(new_limit, _estimated_limit);
+        }
+    }
+
+    const double smoothing =
+        std::clamp(FLAGS_redis_concurrency_smoothing, 0.01, 1.0);
+    _estimated_limit = std::clamp(
+        _estimated_limit * (1 - smoothing) + new_limit * smoothing,
+        static_cast<double>(FLAGS_redis_min_concurrency),
+        static_cast<double>(std::max(FLAGS_redis_max_concurrency,
+                                     FLAGS_redis_min_concurrency)));
+    _limit.store(static_cast<int64_t>(_estimated_limit),
+                 std::memory_order_relaxed);
+}
@@ -0,0 +1,203 @@
+#include "service/redis_shard.h"
+
+#include <brpc/policy/redis_authenticator.h>
+#include <bthread/bthread.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <cstring>
+
+DEFINE_string(redis_password, "", "Redis server password");
+DEFINE_int32(redis_timeout_ms, 500, "Timeout of each redis call");
+DEFINE_int32(redis_connect_timeout_ms, 500, "Timeout to connect redis");
+DEFINE_int32(redis_max_retry, 3, "Max retries of each redis call");
+DEFINE_string(redis_connection_type, "single",
+              "Connections to each redis shard: single (one multiplexed "
+              "connection), pooled (brpc connection pool) or per_worker "
+              "(each worker thread sticks to one of -redis_connections)");
+DEFINE_int32(redis_connections, 4,
+             "Number of connections to each redis shard in per_worker mode");
+DEFINE_bool(redis_batch_enabled, false,
+            "Merge concurrent CheckLimit calls into pipelined redis requests");
+DEFINE_int32(redis_batch_window_us, 50,
+             "Max time a CheckLimit call waits for its redis batch");
+DEFINE_int32(redis_batch_max_size, 64,
+             "Max number of commands in one redis batch");
+
+static std::string shardName(size_t index) {
+    return "redis_shard_" + std::to_string(index);
+}
+
+RedisShard::RedisShard(size_t index, const std::string& address)
+    : _index(index),
+      _address(address),
+      _breaker(&_channel, shardName(index) + "_breaker_open"),
+      _concurrency(shardName(index)),
+      _reloading(false) {
+    const std::string name = shardName(index);
+    _latency.expose(name);
+    _errors.expose(name + "_error");
+    _script_reloads.expose(name + "_script_reload");
+}
+
+RedisShard::~RedisShard() = default;
+
+size_t RedisShard::workerIndex() {
+    static std::atomic<size_t> next_index{0};
+    thread_local size_t index =
+        next_index.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+bool RedisShard::InitChannel(brpc::Channel* channel,
+                             const std::string& address,
+                             const std::string& connection_group) {
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_REDIS;
+    options.max_retry = FLAGS_redis_max_retry;
+    options.timeout_ms = FLAGS_redis_timeout_ms;
+    options.connect_timeout_ms = FLAGS_redis_connect_timeout_ms;
+    options.connection_type =
+        FLAGS_redis_connection_type == "pooled" ? "pooled" : "single";
+    options.connection_group = connection_group;
+    if (!FLAGS_redis_password.empty()) {
+        // 连接池和断线重连新建的连接都需要认证
+        static brpc::policy::RedisAuthenticator authenticator(
+            FLAGS_redis_password);
+        options.auth = &authenticator;
+    }
+
+    if (channel->Init(address.c_str(), &options) != 0) {
+        LOG(ERROR) << "Fail to initialize redis channel to " << address;
+        return false;
+    }
+
+    return true;
+}
+
+bool RedisShard::Init() {
+    const std::string& type = FLAGS_redis_connection_type;
+    if (type != "single" && type != "pooled" && type != "per_worker") {
+        LOG(ERROR) << "Unknown redis_connection_type: " << type;
+        return false;
+    }
+
+    const bool per_worker = type == "per_worker";
+    const int connections =
+        per_worker ? std::max(FLAGS_redis_connections, 1) : 1;
+    for (int i = 0; i < connections; ++i) {
+        brpc::Channel* channel = &_channel;
+        if (i > 0) {
+            _extra_channels.emplace_back(new brpc::Channel);
+            channel = _extra_channels.back().get();
+        }
+        const std::string group =
+            per_worker ? "redis_worker_" + std::to_string(i) : "";
+        if (!InitChannel(channel, _address, group)) {
+            return false;
+        }
+        _channels.push_back(channel);
+    }
+
+    if (FLAGS_redis_batch_enabled) {
+        for (brpc::Channel* channel : _channels) {
+            _batchers.emplace_back(new RedisBatcher(
+                channel, FLAGS_redis_batch_window_us,
+                FLAGS_redis_batch_max_size));
+        }
+    }
+
+    LOG(INFO) << "Redis shard " << _index << " connected to " << _address
+              << " with " << _channels.size() << " " << type
+              << " connection(s)"
+              << (_batchers.empty() ? "" : ", batching enabled");
+    return true;
+}
+
+bool RedisShard::LoadScript(const std::string& script, std::string* sha1) {
+    brpc::Controller cnt;
+    brpc::RedisRequest req;
+    brpc::RedisResponse resp;
+
+    req.AddCommand("SCRIPT LOAD %b", script.data(), script.size());
+    _channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+
+    if (cnt.Failed()) {
+        LOG(ERROR) << "Failed to load lua script to " << _address << ": "
+                   << cnt.ErrorText();
+        return false;
+    }
+
+    if (resp.reply_size() == 0 ||
+        resp.reply(0).type() != brpc::REDIS_REPLY_STRING) {
+        LOG(ERROR) << "Invalid response from redis " << _address;
+        return false;
+    }
+
+    *sha1 = resp.reply(0).data().as_string();
+    _scripts.push_back(script);
+    return true;
+}
+
+void RedisShard::OnCallEnd(bool failed, int64_t latency_us) {
+    _breaker.OnCallEnd(failed, latency_us);
+    _concurrency.OnCallEnd(failed, latency_us);
+    _latency << latency_us;
+    if (failed) {
+        _errors << 1;
+    }
+}
+
+void RedisShard::OnReplyError(const brpc::RedisReply& reply) {
+    if (!reply.is_error()) {
+        return;
+    }
+
+    const char* message = reply.error_message();
+    if (strncmp(message, "NOSCRIPT", 8) != 0) {
+        LOG_EVERY_SECOND(WARNING)
+            << "Redis shard " << _index << " returned error: " << message;
+        return;
+    }
+
+    // redis 重启或者执行了 SCRIPT FLUSH，同一时间只重新加载一次
+    bool expected = false;
+    if (!_reloading.compare_exchange_strong(expected, true)) {
+        return;
+    }
+
+    bthread_t tid;
+    if (bthread_start_background(&tid, nullptr, runReloadScripts, this) !=
+        0) {
+        runReloadScripts(this);
+    }
+}
+
+void* RedisShard::runReloadScripts(void* arg) {
+    RedisShard* shard = static_cast<RedisShard*>(arg);
+    shard->reloadScripts();
+    shard->_reloading.store(false, std::memory_order_release);
+    return nullptr;
+}
+
+void RedisShard::reloadScripts() {
+    brpc::Controller cnt;
+    brpc::RedisRequest req;
+    brpc::RedisResponse resp;
+
+    for (const auto& script : _scripts) {
+        req.AddCommand("SCRIPT LOAD %b", script.data(), script.size());
+    }
+    _channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+
+    if (cnt.Failed()) {
+        LOG(ERROR) << "Failed to reload lua scripts to " << _address << ": "
+                   << cnt.ErrorText();
+        return;
+    }
+
+    _script_reloads << 1;
+    LOG(WARNING) << "Reloaded " << _scripts.size()
+                 << " lua scripts to redis shard " << _index << " ("
+                 << _address << ")";
+}
@@ -0,0 +1,197 @@
+#include "service/redis_shard_set.h"
+
+#include <brpc/policy/hasher.h>
+#include <butil/strings/string_split.h>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+constexpr uint16_t kNoOwner = std::numeric_limits<uint16_t>::max();
+
+// CRC16-CCITT (XMODEM)，与 Redis Cluster 计算槽位使用的算法相同
+constexpr std::array<uint16_t, 256> makeCrc16Table() {
+    std::array<uint16_t, 256> table{};
+    for (int i = 0; i < 256; ++i) {
+        uint16_t crc = static_cast<uint16_t>(i << 8);
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021)
+                                 : static_cast<uint16_t>(crc << 1);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+constexpr std::array<uint16_t, 256> kCrc16Table = makeCrc16Table();
+
+uint16_t crc16(std::string_view data) {
+    uint16_t crc = 0;
+    for (unsigned char c : data) {
+        crc = static_cast<uint16_t>((crc << 8) ^
+                                    kCrc16Table[((crc >> 8) ^ c) & 0xff]);
+    }
+    return crc;
+}
+
+}    // namespace
+
+std::string_view RedisShardSet::HashTag(std::string_view key) {
+    size_t open = key.find('{');
+    if (open != std::string_view::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string_view::npos && close > open + 1) {
+            return key.substr(open + 1, close - open - 1);
+        }
+    }
+    return key;
+}
+
+uint16_t RedisShardSet::ClusterSlot(std::string_view key) {
+    return crc16(HashTag(key)) & (kClusterSlots - 1);
+}
+
+void RedisShardSet::addShard(const std::string& address) {
+    std::unique_ptr<RedisShard> shard(new RedisShard(_shards.size(), address));
+    if (!shard->Init()) {
+        throw std::runtime_error("Fail to initialize redis shard " + address);
+    }
+    _shards.push_back(std::move(shard));
+}
+
+void RedisShardSet::Init(const std::string& addresses, bool cluster) {
+    if (cluster) {
+        discoverCluster(addresses);
+        return;
+    }
+
+    std::vector<std::string> parts;
+    butil::SplitString(addresses, ',', &parts);
+    for (const auto& address : parts) {
+        if (!address.empty()) {
+            addShard(address);
+        }
+    }
+
+    if (_shards.empty()) {
+        throw std::runtime_error("No redis address configured");
+    }
+
+    buildRing();
+}
+
+void RedisShardSet::buildRing() {
+    _ring.clear();
+    _ring.reserve(_shards.size() * kVirtualNodes);
+    for (const auto& shard : _shards) {
+        // 按地址计算虚拟节点，所有实例上同一个 token 路由到同一个分片
+        for (int i = 0; i < kVirtualNodes; ++i) {
+            std::string node = shard->address() + "-" + std::to_string(i);
+            _ring.emplace_back(
+                brpc::policy::MurmurHash32(node.data(), node.size()),
+                static_cast<uint32_t>(shard->index()));
+        }
+    }
+    std::sort(_ring.begin(), _ring.end());
+}
+
+void RedisShardSet::discoverCluster(const std::string& seed) {
+    brpc::Channel channel;
+    if (!RedisShard::InitChannel(&channel, seed)) {
+        throw std::runtime_error("Fail to initialize redis channel to " +
+                                 seed);
+    }
+
+    brpc::Controller cnt;
+    brpc::RedisRequest req;
+    brpc::RedisResponse resp;
+
+    req.AddCommand("CLUSTER SLOTS");
+    channel.CallMethod(nullptr, &cnt, &req, &resp, nullptr);
+
+    if (cnt.Failed()) {
+        LOG(ERROR) << "Failed to get redis cluster slots: " << cnt.ErrorText();
+        throw std::runtime_error("Failed to get redis cluster slots");
+    }
+
+    if (resp.reply_size() == 0 || !resp.reply(0).is_array()) {
+        LOG(ERROR) << "Invalid CLUSTER SLOTS response from redis";
+        throw std::runtime_error("Invalid CLUSTER SLOTS response from redis");
+    }
+
+    // 每个元素为 [起始槽位, 结束槽位, [主节点 ip, 端口, id], 从节点...]
+    _slot_owners.assign(kClusterSlots, kNoOwner);
+    const brpc::RedisReply& ranges = resp.reply(0);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        const brpc::RedisReply& range = ranges[i];
+        if (!range.is_array() || range.size() < 3 ||
+            !range[0].is_integer() || !range[1].is_integer() ||
+            !range[2].is_array() || range[2].size() < 2) {
+            throw std::runtime_error(
+                "Invalid CLUSTER SLOTS response from redis");
+        }
+
+        const brpc::RedisReply& master = range[2];
+        std::string address = master[0].data().as_string() + ":" +
+                              std::to_string(master[1].integer());
+
+        size_t owner = _shards.size();
+        for (const auto& shard : _shards) {
+            if (shard->address() == address) {
+                owner = shard->index();
+                break;
+            }
+        }
+        if (owner == _shards.size()) {
+            addShard(address);
+        }
+
+        int64_t start = std::max<int64_t>(range[0].integer(), 0);
+        int64_t end = std::min<int64_t>(range[1].integer(), kClusterSlots - 1);
+        for (int64_t slot = start; slot <= end; ++slot) {
+            _slot_owners[slot] = static_cast<uint16_t>(owner);
+        }
+    }
+
+    if (std::find(_slot_owners.begin(), _slot_owners.end(), kNoOwner) !=
+        _slot_owners.end()) {
+        throw std::runtime_error("Redis cluster slots are not fully covered");
+    }
+
+    LOG(INFO) << "Discovered " << _shards.size()
+              << " redis cluster masters from " << seed;
+}
+
+RedisShard* RedisShardSet::Route(std::string_view token) const {
+    if (!_slot_owners.empty()) {
+        return _shards[_slot_owners[ClusterSlot(token)]].get();
+    }
+
+    if (_shards.size() == 1) {
+        return _shards[0].get();
+    }
+
+    std::string_view tag = HashTag(token);
+    uint32_t hash = brpc::policy::MurmurHash32(tag.data(), tag.size());
+    auto iter = std::lower_bound(
+        _ring.begin(), _ring.end(), hash,
+        [](const std::pair<uint32_t, uint32_t>& node, uint32_t value) {
+            return node.first < value;
+        });
+    if (iter == _ring.end()) {
+        iter = _ring.begin();
+    }
+    return _shards[iter->second].get();
+}
+
+bool RedisShardSet::LoadScript(const std::string& script, std::string* sha1) {
+    for (const auto& shard : _shards) {
+        if (!shard->LoadScript(script, sha1)) {
+            return false;
+        }
+    }
+    return true;
+}
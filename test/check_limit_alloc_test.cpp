@@ -0,0 +1,227 @@
+#include <brpc/controller.h>
+#include <bthread/countdown_event.h>
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "ratelimit.pb.h"
+#include "service/ratelimit_service_impl.h"
+#include "stub_redis.h"
+
+DEFINE_int64(warmup_calls, 100000,
+             "CheckLimit calls before counting allocations");
+DEFINE_int64(calls, 1000000, "CheckLimit calls to count allocations over");
+DEFINE_int32(stub_redis_port, 16379,
+             "Port of the in-process stub redis used with "
+             "-limit_backend=redis");
+DEFINE_string(script_dir, "../conf", "Directory of the lua scripts");
+DEFINE_string(conf_file, "check_limit_alloc_conf.json",
+              "Config file written for the tokens under test");
+
+DECLARE_string(limit_backend);
+DECLARE_string(limit_conf_file);
+DECLARE_string(redis_address);
+DECLARE_int64(hot_key_min_qps);
+
+// 只统计调用线程上的分配，brpc 和各个定时器在其他线程中的分配不计入
+static thread_local bool t_counting = false;
+static thread_local int64_t t_allocations = 0;
+
+static void* countedAlloc(size_t size) {
+    if (t_counting) {
+        ++t_allocations;
+    }
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+static void* countedAlignedAlloc(size_t size, std::align_val_t align) {
+    if (t_counting) {
+        ++t_allocations;
+    }
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, std::max(static_cast<size_t>(align),
+                                      sizeof(void*)),
+                       size == 0 ? 1 : size) != 0) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new(size_t size, std::align_val_t align) {
+    return countedAlignedAlloc(size, align);
+}
+void* operator new[](size_t size, std::align_val_t align) {
+    return countedAlignedAlloc(size, align);
+}
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+namespace {
+
+// 被测的 token 名字超过 std::string 的短字符串长度，任何拷贝都会被统计到。
+// redis 模式的 token 经过 CheckLimitCall 和 EVALSHA 参数的构造，local 模式
+// 的 token 经过进程内状态表。滑动窗口日志按请求保存时间戳，不在此列
+const char* const kTokens[][2] = {
+    {"alloc_test_redis_token_bucket", R"({"burst": 1000000, "rate": 1000})"},
+    {"alloc_test_redis_gcra",
+     R"({"algorithm": "gcra", "burst": 1000000, "rate": 1000})"},
+    {"alloc_test_redis_sliding_window",
+     R"({"algorithm": "sliding_window", "burst": 1000000,)"
+     R"( "window_ms": 1000})"},
+    {"alloc_test_local_token_bucket",
+     R"({"burst": 1000000, "rate": 1000, "mode": "local"})"},
+    {"alloc_test_local_gcra",
+     R"({"algorithm": "gcra", "burst": 1000000, "rate": 1000,)"
+     R"( "mode": "local"})"},
+    {"alloc_test_local_sliding_window",
+     R"({"algorithm": "sliding_window", "burst": 1000000,)"
+     R"( "window_ms": 1000, "mode": "local"})"},
+    {"alloc_test_local_concurrency",
+     R"({"algorithm": "concurrency", "burst": 1000000,)"
+     R"( "window_ms": 60000, "mode": "local"})"},
+};
+
+// 每次调用复用的 done，redis 的回复在 brpc 的 bthread 中处理，
+// 调用线程等待它执行完再发起下一次调用
+class WaitDone : public ::google::protobuf::Closure {
+public:
+    void Reset() { _event.reset(1); }
+
+    void Run() override { _event.signal(); }
+
+    void Wait() { _event.wait(); }
+
+private:
+    bthread::CountdownEvent _event;
+};
+
+bool writeConfFile() {
+    FILE* out = fopen(FLAGS_conf_file.c_str(), "w");
+    if (out == nullptr) {
+        fprintf(stderr, "Failed to open %s\n", FLAGS_conf_file.c_str());
+        return false;
+    }
+    fprintf(out, "{\n");
+    const size_t count = sizeof(kTokens) / sizeof(kTokens[0]);
+    for (size_t i = 0; i < count; ++i) {
+        fprintf(out, "    \"%s\": %s%s\n", kTokens[i][0], kTokens[i][1],
+                i + 1 < count ? "," : "");
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+    return true;
+}
+
+// 依次对每个 token 调用 n 次 CheckLimit，返回调用线程上的分配次数
+int64_t runCalls(RateLimitServiceImpl* service,
+                 std::vector<::RateLimitRequest>& requests, int64_t n) {
+    brpc::Controller cntl;
+    ::RateLimitResponse response;
+    WaitDone done;
+    t_allocations = 0;
+    t_counting = true;
+    for (int64_t i = 0; i < n; ++i) {
+        for (auto& request : requests) {
+            response.Clear();
+            done.Reset();
+            service->CheckLimit(&cntl, &request, &response, &done);
+            done.Wait();
+            if (cntl.Failed()) {
+                t_counting = false;
+                fprintf(stderr, "CheckLimit of %s failed: %s\n",
+                        request.token().c_str(), cntl.ErrorText().c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    t_counting = false;
+    return t_allocations;
+}
+
+}    // namespace
+
+// 在进程内创建限流服务，直接调用 CheckLimit，统计稳态下判断路径（配置
+// 查找、调用上下文、EVALSHA 参数、进程内状态表、写回响应和监控）在调用
+// 线程上每次调用的堆分配次数，不为 0 时以失败退出
+int main(int argc, char* argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    if (!writeConfFile()) {
+        return -1;
+    }
+    FLAGS_limit_conf_file = FLAGS_conf_file;
+    // 反复调用的 token 会被判定为热点而改走租约，不是要测的路径
+    FLAGS_hot_key_min_qps = 0;
+
+    std::unique_ptr<StubRedis> stub_redis;
+    if (FLAGS_limit_backend == "redis") {
+        stub_redis.reset(new StubRedis(FLAGS_script_dir, 1024));
+        if (stub_redis->Start(FLAGS_stub_redis_port) != 0) {
+            return -1;
+        }
+        FLAGS_redis_address =
+            "127.0.0.1:" + std::to_string(FLAGS_stub_redis_port);
+    }
+
+    std::unique_ptr<RateLimitServiceImpl> service(
+        new RateLimitServiceImpl(FLAGS_script_dir));
+
+    std::vector<::RateLimitRequest> requests;
+    for (const auto& token : kTokens) {
+        requests.emplace_back();
+        requests.back().set_token(token[0]);
+        // 并发限制不释放，超过 burst 后的拒绝同样需要不分配内存
+        requests.back().set_cost(1);
+    }
+
+    runCalls(service.get(), requests, FLAGS_warmup_calls);
+    const int64_t allocations =
+        runCalls(service.get(), requests, FLAGS_calls);
+    const int64_t calls = FLAGS_calls * static_cast<int64_t>(requests.size());
+
+    printf("backend=%s calls=%ld allocations=%ld (%.4f per call)\n",
+           FLAGS_limit_backend.c_str(), calls, allocations,
+           calls > 0 ? static_cast<double>(allocations) / calls : 0.0);
+
+    service.reset();
+    if (stub_redis) {
+        stub_redis->Stop();
+    }
+    return allocations == 0 ? 0 : 1;
+}